@@ -0,0 +1,29 @@
+#version 150
+
+in vec3 fPos;
+in vec3 fColor;
+in vec3 transformedNormal;
+
+layout(std140, row_major) uniform FrameData
+{
+    mat4 viewMatrix;
+    mat4 projMatrix;
+    mat4 viewProjMatrix;
+    mat4 screenProjMatrix;
+    vec4 cameraPos;
+    vec4 time;
+    vec4 lightClusterParams; // Near plane, slices per unit of log depth and tile size in pixels
+};
+
+out vec4 out_color;
+
+// The light loop is in shaders/clustered_lights.glsl
+void main()
+{
+    vec3 norm = normalize(transformedNormal);
+    vec3 viewDir = normalize(cameraPos.xyz - fPos);
+    float viewDepth = -(viewMatrix * vec4(fPos, 1.0)).z;
+    vec3 light = clusteredLight(clusterIndex(viewDepth, lightClusterParams), fPos, norm, viewDir);
+
+    out_color = vec4(fColor * light, 1.0);
+}
@@ -0,0 +1,57 @@
+/* Clustered lighting shared by the forward and deferred lighting shaders, see light_clusters_t.
+   build_shader puts it after the #version line of the fragment shaders built with it, following
+   the LIGHT_CLUSTERS_* defines from load_shader_prelude */
+
+// See gpu_light_t and light_clusters_t, the lists of every cluster hold indices into lightData
+uniform samplerBuffer lightData;
+uniform usamplerBuffer lightClusters;
+uniform usamplerBuffer lightIndices;
+
+const ivec3 clusterCounts = ivec3(LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y, LIGHT_CLUSTERS_Z);
+const float LIGHT_POINT = 0.0;
+const float LIGHT_SPOT = 1.0;
+const float LIGHT_DIRECTIONAL = 2.0;
+
+// Cluster of the fragment being shaded, viewDepth units in front of the camera. params is lightClusterParams
+int clusterIndex(float viewDepth, vec4 params)
+{
+    float slice = viewDepth > params.x ? log(viewDepth / params.x) * params.y : 0.0;
+    ivec3 cluster = min(ivec3(vec3(gl_FragCoord.xy / params.zw, slice)), clusterCounts - 1);
+    return (cluster.z * clusterCounts.y + cluster.y) * clusterCounts.x + cluster.x;
+}
+
+/* Phong lighting of a surface at world position fPos by every light in its cluster, same as the single light shader */
+vec3 clusteredLight(int cluster, vec3 fPos, vec3 norm, vec3 viewDir)
+{
+    vec3 light = vec3(0.0);
+    uvec2 list = texelFetch(lightClusters, cluster).xy;
+    for (uint i = 0u; i < list.y; ++i)
+    {
+        int base = int(texelFetch(lightIndices, int(list.x + i)).r) * 4;
+        vec4 position = texelFetch(lightData, base);
+        vec4 colour = texelFetch(lightData, base + 1);
+        vec4 direction = texelFetch(lightData, base + 2);
+        vec4 attenuation = texelFetch(lightData, base + 3);
+
+        vec3 lightDir = direction.xyz;
+        float intensity = 1.0;
+        if (colour.w != LIGHT_DIRECTIONAL)
+        {
+            vec3 toLight = position.xyz - fPos;
+            float d = length(toLight);
+            lightDir = toLight / d;
+            intensity = 1.0 / dot(attenuation.xyz, vec3(1.0, d, d * d));
+            if (colour.w == LIGHT_SPOT)
+            {
+                float cosAngle = dot(-lightDir, direction.xyz);
+                intensity *= cosAngle >= direction.w ? pow(cosAngle, attenuation.w) : 0.0;
+            }
+        }
+
+        float ambient = 0.1;
+        float diffuse = max(dot(norm, lightDir), 0.0);
+        float specular = 0.5 * pow(max(dot(viewDir, reflect(-lightDir, norm)), 0.0), 32);
+        light += intensity * (ambient + diffuse + specular) * colour.rgb;
+    }
+    return light;
+}
@@ -0,0 +1,44 @@
+#version 150
+
+layout(std140, row_major) uniform FrameData
+{
+    mat4 viewMatrix;
+    mat4 projMatrix;
+    mat4 viewProjMatrix;
+    mat4 screenProjMatrix;
+    vec4 cameraPos;
+    vec4 time;
+    vec4 lightClusterParams; // Near plane, slices per unit of log depth and tile size in pixels
+    mat4 inverseViewProjMatrix;
+};
+
+// Targets of the geometry pass, see gbuffer_t
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+out vec4 out_color;
+
+// The light loop is in shaders/clustered_lights.glsl
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, texel, 0).r;
+    // Nothing was drawn here, keep whatever the framebuffer was cleared to
+    if (depth == 1.0)
+        discard;
+    gl_FragDepth = depth;
+
+    // Back from window coordinates to world space
+    vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gDepth, 0)) * 2.0 - 1.0;
+    vec4 world = inverseViewProjMatrix * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 fPos = world.xyz / world.w;
+    vec3 fColor = texelFetch(gAlbedo, texel, 0).rgb;
+    vec3 norm = texelFetch(gNormal, texel, 0).xyz;
+
+    vec3 viewDir = normalize(cameraPos.xyz - fPos);
+    float viewDepth = -(viewMatrix * vec4(fPos, 1.0)).z;
+    vec3 light = clusteredLight(clusterIndex(viewDepth, lightClusterParams), fPos, norm, viewDir);
+
+    out_color = vec4(fColor * light, 1.0);
+}
@@ -0,0 +1,8 @@
+#version 150
+
+// Single triangle covering the whole screen, no vertex buffers needed
+void main()
+{
+    vec2 corner = vec2((gl_VertexID & 1) << 2, (gl_VertexID & 2) << 1);
+    gl_Position = vec4(corner - 1.0, 0.0, 1.0);
+}
@@ -1,14 +1,14 @@
 #version 150
 
-in vec2 TexCoords;
+in vec3 TexCoords;
+in vec3 fColor;
 
 out vec4 color;
 
-uniform sampler2D text;
-uniform vec3 textColor;
+uniform sampler2DArray text;
 
 void main()
 {
 	vec4 sampled = vec4(1.0, 1.0, 1.0, texture(text, TexCoords).r);
-	color = vec4(textColor, 1.0) * sampled;
+	color = vec4(fColor, 1.0) * sampled;
 }
\ No newline at end of file
@@ -1,13 +1,25 @@
 #version 150 
 
-in vec4 vertex; 
+in vec2 position;
+in vec3 texCoords; // u, v and atlas page
+in vec3 vColor;
 
-out vec2 TexCoords; 
+out vec3 TexCoords; 
+out vec3 fColor;
 
-uniform mat4 projMatrix; 
+layout(std140, row_major) uniform FrameData
+{
+    mat4 viewMatrix;
+    mat4 projMatrix;
+    mat4 viewProjMatrix;
+    mat4 screenProjMatrix;
+    vec4 cameraPos;
+    vec4 time;
+};
     
 void main()
 { 
-    gl_Position = projMatrix * vec4(vertex.xy, 0.0, 1.0); 
-    TexCoords = vertex.zw; 
+    gl_Position = screenProjMatrix * vec4(position, 0.0, 1.0); 
+    TexCoords = texCoords; 
+    fColor = vColor;
 }
\ No newline at end of file
@@ -0,0 +1,18 @@
+#version 150
+
+in vec3 TexCoords;
+in vec3 fColor;
+
+out vec4 color;
+
+uniform sampler2DArray text;
+
+void main()
+{
+	/* Distance to the outline, 0.5 right on the edge and growing towards the inside */
+	float dist = texture(text, TexCoords).r;
+	// Antialias over about a pixel, however much the glyph is scaled
+	float width = fwidth(dist);
+	float alpha = smoothstep(0.5 - width, 0.5 + width, dist);
+	color = vec4(fColor, alpha);
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#version 150
+
+in vec3 fPos;
+in vec3 fColor;
+in vec3 transformedNormal;
+
+// Targets of the G-buffer, see gbuffer_t. The lighting pass takes the position from the depth
+out vec4 out_albedo;
+out vec4 out_normal;
+
+void main()
+{
+    out_albedo = vec4(fColor, 1.0);
+    out_normal = vec4(normalize(transformedNormal), 0.0);
+}
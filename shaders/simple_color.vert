@@ -2,15 +2,18 @@
 
 in vec3 position; 
 in vec3 vColor; 
+in uint drawIndex;
 
 out vec3 fColor; 
 
-uniform mat4 modelMatrix;  
-uniform mat4 viewMatrix;  
-uniform mat4 projMatrix;  
+// Per-draw transforms, see draw_data_t. Only the MVP matrix is needed here
+uniform samplerBuffer drawData;
 
 void main()
 { 
-    gl_Position = projMatrix*viewMatrix*modelMatrix*vec4(position, 1.0); 
+    int base = int(drawIndex) * 11 + 4;
+    mat4 mvpMatrix = mat4(texelFetch(drawData, base), texelFetch(drawData, base + 1),
+                          texelFetch(drawData, base + 2), texelFetch(drawData, base + 3));
+    gl_Position = vec4(position, 1.0)*mvpMatrix;
     fColor = vColor; 
-}
\ No newline at end of file
+}
@@ -0,0 +1,25 @@
+#version 150  
+
+in vec3 position; 
+// Our matrices are row-major, so the columns GL reads here are the rows of the model matrix
+in mat4 instanceModel;
+in vec3 instanceColor;
+
+out vec3 fColor; 
+
+layout(std140, row_major) uniform FrameData
+{
+    mat4 viewMatrix;
+    mat4 projMatrix;
+    mat4 viewProjMatrix;
+    mat4 screenProjMatrix;
+    vec4 cameraPos;
+    vec4 time;
+};
+
+void main()
+{ 
+    // Multiplying on the left is the same as using the transposed matrix
+    gl_Position = viewProjMatrix*(vec4(position, 1.0)*instanceModel); 
+    fColor = instanceColor; 
+}
@@ -2,10 +2,20 @@
 
 in vec3 fPos;
 in vec3 fColor;
-in vec3 lightViewPos;
 in vec3 transformedNormal;
 
 uniform vec3 lightColor;
+uniform vec3 lightWorldPos;
+
+layout(std140, row_major) uniform FrameData
+{
+    mat4 viewMatrix;
+    mat4 projMatrix;
+    mat4 viewProjMatrix;
+    mat4 screenProjMatrix;
+    vec4 cameraPos;
+    vec4 time;
+};
 
 out vec4 out_color;
 
@@ -17,14 +27,13 @@ void main()
 
     /* Diffuse component of Phong lighting */
     vec3 norm = normalize(transformedNormal);
-    vec3 lightDir = normalize(lightViewPos - fPos);
+    vec3 lightDir = normalize(lightWorldPos - fPos);
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = diff * lightColor;
 
     /* Specular component of Phong lighting */
     float specularStrength = 0.5;
-    // the viewer is always at (0,0,0) in view-space, so viewDir is (0,0,0) - Position => -Position
-    vec3 viewDir = normalize(-fPos);
+    vec3 viewDir = normalize(cameraPos.xyz - fPos);
     vec3 reflectDir = reflect(-lightDir, norm);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
     vec3 specular = specularStrength * spec * lightColor; 
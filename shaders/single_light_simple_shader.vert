@@ -1,27 +1,45 @@
 #version 150  
 
 in vec3 position;
-in vec3 normal;
+in vec2 normal; // Octahedral encoded, see octahedral_encode
 in vec2 texCoords;
+in uint drawIndex;
 
 out vec3 fPos;
 out vec3 fColor;
-out vec3 lightViewPos;
 out vec3 transformedNormal;
 
-uniform mat4 modelMatrix;  
-uniform mat4 viewMatrix;  
-uniform mat4 projMatrix;
-uniform vec3 lightWorldPos;
+// Per-draw transforms, see draw_data_t. Rows go in as columns, so vectors multiply them from the left
+uniform samplerBuffer drawData;
 uniform sampler2D tex;
 
+mat4 fetch_mat4(int texel)
+{
+    return mat4(texelFetch(drawData, texel), texelFetch(drawData, texel + 1),
+                texelFetch(drawData, texel + 2), texelFetch(drawData, texel + 3));
+}
+
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    // The lower half of the octahedron is unfolded over the corners
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(e.yx)) * vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
 void main()
 { 
-    gl_Position = projMatrix*viewMatrix*modelMatrix*vec4(position, 1.0);
+    int base = int(drawIndex) * 11;
+    mat4 modelMatrix = fetch_mat4(base);
+    mat4 mvpMatrix = fetch_mat4(base + 4);
+    // Inverse transpose of the model matrix, precomputed on the CPU
+    mat3 normalMatrix = mat3(texelFetch(drawData, base + 8).xyz, texelFetch(drawData, base + 9).xyz,
+                             texelFetch(drawData, base + 10).xyz);
+
+    gl_Position = vec4(position, 1.0)*mvpMatrix;
     fColor = vec3(texture(tex, texCoords));
-    fPos = vec3(viewMatrix*modelMatrix*vec4(position, 1.0));
-    lightViewPos = vec3(viewMatrix * vec4(lightWorldPos, 1.0));
-    // TODO: This is kinda expensive, optimize later
-    mat3 normalMatrix = mat3(transpose(inverse(viewMatrix * modelMatrix)));
-    transformedNormal = normalMatrix * normal;
+    // Lighting happens in world space so the normal matrix does not depend on the camera
+    fPos = vec3(vec4(position, 1.0)*modelMatrix);
+    transformedNormal = decodeNormal(normal)*normalMatrix;
 }
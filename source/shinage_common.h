@@ -13,7 +13,12 @@
 #include "shinage_opengl_signatures.h"
 #include "shinage_shaders.h"
 #include "shinage_scene.h"
+#include "shinage_mesh_cache.h"
 #include "shinage_utils.h"
+#include "shinage_simplify.h"
+#include "shinage_mesh_optimizer.h"
+#include "shinage_obj.h"
+#include "shinage_static_batching.h"
 
 /* shinage_text also includes ft2build.h and FT_FREETYPE_H */
 #ifdef __linux__
@@ -23,6 +28,9 @@
 #error "Windows code WIP"
 #endif
 
+#include "shinage_render_queue.h"
+#include "shinage_renderer.h"
+
 /* Types */
 typedef enum {
     PAUSED,
@@ -35,6 +43,20 @@ typedef struct {
     vec3f position;
 } entity_t;
 
+/* Per-vertex colour sets for our debug primitives */
+typedef enum {
+    PALETTE_BLACK,
+    PALETTE_BLUE,
+    PALETTE_GREEN,
+    PALETTE_CYAN,
+    PALETTE_RED,
+    PALETTE_MAGENTA,
+    PALETTE_YELLOW,
+    PALETTE_WHITE,
+    PALETTE_RAINBOW,
+    NUM_PALETTES
+} palette_t;
+
 /* Misc. typedefs */
 typedef unsigned int    uint;
 typedef      uint8_t   uint8;
@@ -61,7 +83,9 @@ typedef struct {
     entity_t *entities; // ideally we would use these
     entity_t test_triangle;
     entity_t test_pyramid;
-    model_t sun;
+    scene_t solar_system;
+    mesh_t *cubes[NUM_PALETTES];
+    mesh_t *pyramids[NUM_PALETTES];
     camera_t main_camera;
 
     player_input_t *curr_frame_input;
@@ -72,7 +96,17 @@ typedef struct {
     matrix_stack_t *active_mat;
     uint simple_color_program;
     uint single_light_program;
-    character_t *default_charmap;
+    uint clustered_light_program; // Every light of the scene, see light_clusters_t
+    uint simple_color_instanced_program;
+    uint font_program;
+    uint font_sdf_program;
+    FT_Face default_face;
+    glyph_cache_t glyph_cache;
+    text_batch_t text_batch;
+    text_batch_t sdf_text_batch;
+    mesh_cache_t mesh_cache;
+    texture_manager_t textures;
+    render_queue_t render_queue;
 
     // Window info
     int window_width;
@@ -81,6 +115,7 @@ typedef struct {
 
     // Timing info
     int framecount;
+    double elapsed_time; // Seconds since the main loop started
     double target_s_per_frame;
     double game_clock;
     double dt;
@@ -0,0 +1,179 @@
+#ifndef SHINAGE_CULLING_H
+#define SHINAGE_CULLING_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+
+/* Width of the culling kernel. Build with -mavx to get the 8 wide one */
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULL_LANES 8
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define CULL_LANES 4
+#else
+#define CULL_LANES 1
+#endif
+
+/* Arrays are always allocated in multiples of this, so any kernel can run past count */
+#define CULL_PADDING 8
+
+typedef enum
+{
+    FRUSTUM_LEFT,
+    FRUSTUM_RIGHT,
+    FRUSTUM_BOTTOM,
+    FRUSTUM_TOP,
+    FRUSTUM_NEAR,
+    FRUSTUM_FAR,
+    NUM_FRUSTUM_PLANES
+} frustum_plane_t;
+
+/* Planes as (normal, distance), normals pointing inside and normalized so
+   dot(normal, p) + distance is the signed distance of p to the plane */
+typedef struct
+{
+    vec4f planes[NUM_FRUSTUM_PLANES];
+} frustum_t;
+
+static inline vec4f normalize_plane(float x, float y, float z, float w)
+{
+    float length = sqrtf(x * x + y * y + z * z);
+    vec4f plane = { .x = x / length, .y = y / length, .z = z / length, .w = w / length };
+    return plane;
+}
+
+/* Gribb-Hartmann extraction: with clip = m * p, the inside of each plane is where
+   -w <= x, y, z <= w, i.e. rows of m added to or subtracted from the fourth one.
+   Planes are in whatever space m transforms from, world space for projection * view */
+frustum_t frustum_from_matrix(mat4x4f m)
+{
+    frustum_t f;
+    f.planes[FRUSTUM_LEFT]   = normalize_plane(m.a4 + m.a1, m.b4 + m.b1, m.c4 + m.c1, m.d4 + m.d1);
+    f.planes[FRUSTUM_RIGHT]  = normalize_plane(m.a4 - m.a1, m.b4 - m.b1, m.c4 - m.c1, m.d4 - m.d1);
+    f.planes[FRUSTUM_BOTTOM] = normalize_plane(m.a4 + m.a2, m.b4 + m.b2, m.c4 + m.c2, m.d4 + m.d2);
+    f.planes[FRUSTUM_TOP]    = normalize_plane(m.a4 - m.a2, m.b4 - m.b2, m.c4 - m.c2, m.d4 - m.d2);
+    f.planes[FRUSTUM_NEAR]   = normalize_plane(m.a4 + m.a3, m.b4 + m.b3, m.c4 + m.c3, m.d4 + m.d3);
+    f.planes[FRUSTUM_FAR]    = normalize_plane(m.a4 - m.a3, m.b4 - m.b3, m.c4 - m.c3, m.d4 - m.d3);
+    return f;
+}
+
+/* Whether any part of a sphere can be inside the frustum. Conservative near the corners */
+bool sphere_in_frustum(frustum_t *f, vec3f centre, float radius)
+{
+    for (uint i = 0; i < NUM_FRUSTUM_PLANES; ++i)
+    {
+        vec4f p = f->planes[i];
+        if (p.x * centre.x + p.y * centre.y + p.z * centre.z + p.w < -radius)
+            return false;
+    }
+    return true;
+}
+
+/* World space bounding spheres packed one component per array, so the kernel loads several at once */
+typedef struct
+{
+    uint count, _max;
+    float *x, *y, *z, *r;
+    uint8 *visible; // Output of frustum_cull_spheres
+} cull_spheres_t;
+
+void push_cull_sphere(cull_spheres_t *s, vec4f sphere)
+{
+    if (s->count == s->_max)
+    {
+        s->_max = s->_max ? s->_max * 2 : 32 * CULL_PADDING;
+        s->x = realloc(s->x, sizeof(float) * s->_max);
+        s->y = realloc(s->y, sizeof(float) * s->_max);
+        s->z = realloc(s->z, sizeof(float) * s->_max);
+        s->r = realloc(s->r, sizeof(float) * s->_max);
+        s->visible = realloc(s->visible, s->_max);
+    }
+    s->x[s->count] = sphere.x;
+    s->y[s->count] = sphere.y;
+    s->z[s->count] = sphere.z;
+    s->r[s->count] = sphere.w;
+    ++s->count;
+}
+
+void destroy_cull_spheres(cull_spheres_t *s)
+{
+    free(s->x);
+    free(s->y);
+    free(s->z);
+    free(s->r);
+    free(s->visible);
+    memset(s, 0, sizeof(cull_spheres_t));
+}
+
+/* Sets visible[i] to whether sphere i passes sphere_in_frustum, CULL_LANES spheres at a time.
+   Lanes past count read and write the padding, their results are meaningless */
+void frustum_cull_spheres(frustum_t *f, cull_spheres_t *s)
+{
+#if CULL_LANES == 8
+    __m256 px[NUM_FRUSTUM_PLANES], py[NUM_FRUSTUM_PLANES], pz[NUM_FRUSTUM_PLANES], pw[NUM_FRUSTUM_PLANES];
+    for (uint p = 0; p < NUM_FRUSTUM_PLANES; ++p)
+    {
+        px[p] = _mm256_set1_ps(f->planes[p].x);
+        py[p] = _mm256_set1_ps(f->planes[p].y);
+        pz[p] = _mm256_set1_ps(f->planes[p].z);
+        pw[p] = _mm256_set1_ps(f->planes[p].w);
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    for (uint i = 0; i < s->count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(s->x + i);
+        __m256 y = _mm256_loadu_ps(s->y + i);
+        __m256 z = _mm256_loadu_ps(s->z + i);
+        __m256 neg_r = _mm256_sub_ps(zero, _mm256_loadu_ps(s->r + i));
+        __m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+        for (uint p = 0; p < NUM_FRUSTUM_PLANES; ++p)
+        {
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px[p], x), _mm256_mul_ps(py[p], y)),
+                                                   _mm256_mul_ps(pz[p], z)), pw[p]);
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, neg_r, _CMP_GE_OQ));
+        }
+        int mask = _mm256_movemask_ps(inside);
+        for (uint k = 0; k < 8; ++k)
+            s->visible[i + k] = (mask >> k) & 1;
+    }
+#elif CULL_LANES == 4
+    __m128 px[NUM_FRUSTUM_PLANES], py[NUM_FRUSTUM_PLANES], pz[NUM_FRUSTUM_PLANES], pw[NUM_FRUSTUM_PLANES];
+    for (uint p = 0; p < NUM_FRUSTUM_PLANES; ++p)
+    {
+        px[p] = _mm_set1_ps(f->planes[p].x);
+        py[p] = _mm_set1_ps(f->planes[p].y);
+        pz[p] = _mm_set1_ps(f->planes[p].z);
+        pw[p] = _mm_set1_ps(f->planes[p].w);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    for (uint i = 0; i < s->count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(s->x + i);
+        __m128 y = _mm_loadu_ps(s->y + i);
+        __m128 z = _mm_loadu_ps(s->z + i);
+        __m128 neg_r = _mm_sub_ps(zero, _mm_loadu_ps(s->r + i));
+        __m128 inside = _mm_cmpeq_ps(zero, zero);
+        for (uint p = 0; p < NUM_FRUSTUM_PLANES; ++p)
+        {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px[p], x), _mm_mul_ps(py[p], y)),
+                                             _mm_mul_ps(pz[p], z)), pw[p]);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_r));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (uint k = 0; k < 4; ++k)
+            s->visible[i + k] = (mask >> k) & 1;
+    }
+#else
+    for (uint i = 0; i < s->count; ++i)
+    {
+        vec3f centre = { .x = s->x[i], .y = s->y[i], .z = s->z[i] };
+        s->visible[i] = sphere_in_frustum(f, centre, s->r[i]);
+    }
+#endif
+}
+
+#endif
@@ -3,8 +3,10 @@
 
 #include "shinage_common.h"
 
-void draw_gl_pyramid(float *colours, unsigned int program);
-void draw_gl_cube(float *colours, unsigned int program);
+void record_stack_draw(game_state_t *g, mesh_t *mesh, unsigned int program);
+void draw_gl_pyramid(game_state_t *g, palette_t palette, unsigned int program);
+void draw_gl_cube(game_state_t *g, palette_t palette, unsigned int program);
+void draw_gl_cubes_instanced(game_state_t *g, mat4x4f *models, vec3f *colours, uint count, unsigned int program);
 void draw_static_cubes_scene(game_state_t *g, uint segments);
 void draw_bouncing_cube_scene(game_state_t *g);
 void log_debug_cpu_computed_vertex_positions(float *vertices, uint count, uint dims);
@@ -26,185 +28,97 @@ GAME_RENDER(game_render)
     update_global_vars(g);
 
     // re-link against OpenGL so we can use it inside our dynamic lib
+    // NOTE: Only resource creation (textures) still calls GL from here
     static bool linked = false;
     if (!linked)
-        link_gl_functions();
+        linked = link_gl_functions();
 
-    //draw_static_cubes_scene(g, 8);
+    /* Nothing is drawn here: we only record render commands, which the platform layer
+       executes once we return */
+    record_frame_uniforms(&g->render_queue, g->window_width, g->window_height, g->elapsed_time, g->dt, g->framecount);
+
+    draw_static_cubes_scene(g, 8);
     draw_solar_system(g);
     draw_fps_counter(g);
+
+    // All the text of the frame goes out in a single draw per glyph mode
+    record_draw_text(&g->render_queue, g->font_program, &g->text_batch);
+    record_draw_text(&g->render_queue, g->font_sdf_program, &g->sdf_text_batch);
+    end_glyph_cache_frame(&g->glyph_cache);
 }
 
 
-void draw_gl_pyramid(float *colours, unsigned int program)
+/* One row per palette_t, 3 floats for each of the 8 vertices of a cube */
+const float palettes[NUM_PALETTES][24] = {
+    {0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0},  // Black
+    {0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1},  // Blue
+    {0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0},  // Green
+    {0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1},  // Cyan
+    {1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0},  // Red
+    {1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1},  // Magenta
+    {1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0},  // Yellow
+    {1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1},  // White
+    {0,0,0, 0,0,1, 0,1,0, 0,1,1, 1,0,0, 1,0,1, 1,1,0, 1,1,1}   // Rainbow
+};
+
+/* Records a draw of a mesh with the top of the matrix stacks. The model-view-projection
+   product is done here so the vertex shader only needs a single matrix product per vertex */
+void record_stack_draw(game_state_t *g, mesh_t *mesh, unsigned int program)
 {
-    float vertices[] = {
-       0.0f,   0.43f,   0.0f,
-      -0.5f,  -0.43f,  -0.5f,
-       0.5f,  -0.43f,  -0.5f,
-       0.0f,  -0.43f,   0.5f
-    };
-
-    uint num_indices = 12;
-    uint indices[] =
-      {
-        3,1,2, 0,1,2, 0,3,1, 0,2,3
-      };
-
-    openGL.glUseProgram(program);
-
-    static int mmatrix_uniform_pos = -1;
-    if (mmatrix_uniform_pos == -1)
-        mmatrix_uniform_pos = openGL.glGetUniformLocation(program, "modelMatrix");
-
-    static int vmatrix_uniform_pos = -1;
-    if (vmatrix_uniform_pos == -1)
-        vmatrix_uniform_pos = openGL.glGetUniformLocation(program, "viewMatrix");
-
-    static int pmatrix_uniform_pos = -1;
-    if (pmatrix_uniform_pos == -1)
-        pmatrix_uniform_pos = openGL.glGetUniformLocation(program, "projMatrix");
-
-
-    mat4x4f mmatrix = peek(mats->model);
-    mat4x4f vmatrix = peek(mats->view);
-    mat4x4f pmatrix = peek(mats->projection);
-
-    openGL.glUniformMatrix4fv(mmatrix_uniform_pos, 1, GL_TRUE, mmatrix.v);
-    openGL.glUniformMatrix4fv(vmatrix_uniform_pos, 1, GL_TRUE, vmatrix.v);
-    openGL.glUniformMatrix4fv(pmatrix_uniform_pos, 1, GL_TRUE, pmatrix.v);
-
-    static unsigned int vao = 0;
-    if (!vao)
-        openGL.glGenVertexArrays(1, &vao);
-
-    openGL.glBindVertexArray(vao);
-
-    static unsigned int position_bo = 0;
-    if (!position_bo)
-        openGL.glGenBuffers(1, &position_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, position_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(0);
-
-    static unsigned int colour_bo = 0;
-    if (!colour_bo)
-        openGL.glGenBuffers(1, &colour_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, colour_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, 24 * sizeof(float), colours, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(1);
-
-    static unsigned int element_bo = 0;
-    if (!element_bo)
-        openGL.glGenBuffers(1, &element_bo);
+    mat4x4f model = peek(mats->model);
+    mat4x4f mvp = mat4x4f_prod(mat4x4f_prod(peek(mats->projection), peek(mats->view)), model);
+    record_draw_mesh(&g->render_queue, RENDER_PASS_OPAQUE, program, mesh, NULL, model, mvp, identity_matrix_3x3);
+}
 
-    openGL.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_bo);
-    openGL.glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), &indices[0], GL_STATIC_DRAW);
+void draw_gl_pyramid(game_state_t *g, palette_t palette, unsigned int program)
+{
+    if (!g->pyramids[palette])
+        g->pyramids[palette] = pyramid_mesh(palettes[palette]);
 
-    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, (void*)0);
+    record_stack_draw(g, g->pyramids[palette], program);
 }
 
 bool show_cpu_calculated_matrix;
 
-void draw_gl_cube(float *colours, unsigned int program)
+void draw_gl_cube(game_state_t *g, palette_t palette, unsigned int program)
 {
-    float vertices[] = {
-         0.5f,  0.5f,  0.5f,
-         0.5f,  0.5f, -0.5f,
-        -0.5f,  0.5f, -0.5f,
-        -0.5f,  0.5f,  0.5f,
-         0.5f, -0.5f,  0.5f,
-         0.5f, -0.5f, -0.5f,
-        -0.5f, -0.5f, -0.5f,
-        -0.5f, -0.5f,  0.5f,
-    };
-
-    uint num_indices = 36;
-    uint indices[] = {
-        0,1,3, 1,2,3, 1,5,2, 5,6,2, 4,5,0, 5,1,0,
-        3,2,7, 2,6,7, 4,0,7, 0,3,7, 5,4,6, 4,7,6
-    };
-
-    openGL.glUseProgram(program);
-
-    static int mmatrix_uniform_pos = -1;
-    if (mmatrix_uniform_pos == -1)
-        mmatrix_uniform_pos = openGL.glGetUniformLocation(program, "modelMatrix");
-
-    static int vmatrix_uniform_pos = -1;
-    if (vmatrix_uniform_pos == -1)
-        vmatrix_uniform_pos = openGL.glGetUniformLocation(program, "viewMatrix");
-
-    static int pmatrix_uniform_pos = -1;
-    if (pmatrix_uniform_pos == -1)
-        pmatrix_uniform_pos = openGL.glGetUniformLocation(program, "projMatrix");
-
-
-    mat4x4f mmatrix = peek(mats->model);
-    mat4x4f vmatrix = peek(mats->view);
-    mat4x4f pmatrix = peek(mats->projection);
-
-    openGL.glUniformMatrix4fv(mmatrix_uniform_pos, 1, GL_TRUE, mmatrix.v);
-    openGL.glUniformMatrix4fv(vmatrix_uniform_pos, 1, GL_TRUE, vmatrix.v);
-    openGL.glUniformMatrix4fv(pmatrix_uniform_pos, 1, GL_TRUE, pmatrix.v);
-
-    static unsigned int vao = 0;
-    if (!vao)
-        openGL.glGenVertexArrays(1, &vao);
-
-    openGL.glBindVertexArray(vao);
-
-    static unsigned int position_bo = 0;
-    if (!position_bo)
-        openGL.glGenBuffers(1, &position_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, position_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(0);
+    if (!g->cubes[palette])
+        g->cubes[palette] = cube_mesh(palettes[palette]);
+    mesh_t *cube = g->cubes[palette];
 
-    static unsigned int colour_bo = 0;
-    if (!colour_bo)
-        openGL.glGenBuffers(1, &colour_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, colour_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, 24 * sizeof(float), colours, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(1);
-
-    static unsigned int element_bo = 0;
-    if (!element_bo)
-        openGL.glGenBuffers(1, &element_bo);
-
-    openGL.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_bo);
-    openGL.glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), &indices[0], GL_STATIC_DRAW);
-
-    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, (void*)0);
+    record_stack_draw(g, cube, program);
 
     if (show_cpu_calculated_matrix)
     {
-        log_debug_cpu_computed_vertex_positions(vertices, 8, 3);
+        log_debug_cpu_computed_vertex_positions((float*)cube->vertices, cube->num_vertices, 3);
         show_cpu_calculated_matrix = false;
     }
 }
 
+/* Draws count unit cubes in a single call. Each cube gets the model matrix and flat colour at the same index */
+void draw_gl_cubes_instanced(game_state_t *g, mat4x4f *models, vec3f *colours, uint count, unsigned int program)
+{
+    // Vertex colours are ignored by the instanced shader, any palette will do
+    if (!g->cubes[PALETTE_WHITE])
+        g->cubes[PALETTE_WHITE] = cube_mesh(palettes[PALETTE_WHITE]);
+
+    record_draw_mesh_instanced(&g->render_queue, RENDER_PASS_OPAQUE, program, g->cubes[PALETTE_WHITE], models, colours, count);
+}
+
+#define MAX_STATIC_CUBE_SEGMENTS 32
+
 void draw_static_cubes_scene(game_state_t *g, uint segments)
 {
-    float colours[9][24] = {
-        {0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0, 0,0,0},  // Black
-        {0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1, 0,0,1},  // Blue
-        {0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0, 0,1,0},  // Green
-        {0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1, 0,1,1},  // Cyan
-        {1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0, 1,0,0},  // Red
-        {1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1, 1,0,1},  // Magenta
-        {1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0, 1,1,0},  // Yellow
-        {1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1, 1,1,1},  // White
-        {0,0,0, 0,0,1, 0,1,0, 0,1,1, 1,0,0, 1,0,1, 1,1,0, 1,1,1}   // Rainbow
-    };
+    /* All the cubes share the same geometry, so we only gather their transforms here
+       and draw them all at once at the end */
+    if (segments > MAX_STATIC_CUBE_SEGMENTS)
+        segments = MAX_STATIC_CUBE_SEGMENTS;
+    uint num_cubes = 0;
+    mat4x4f models[3 * MAX_STATIC_CUBE_SEGMENTS];
+    vec3f colours[3 * MAX_STATIC_CUBE_SEGMENTS];
+    const vec3f blue  = { .x = 0, .y = 0, .z = 1 };
+    const vec3f green = { .x = 0, .y = 1, .z = 0 };
+    const vec3f red   = { .x = 1, .y = 0, .z = 0 };
 
     set_mat(MODEL, g);
     push_matrix();
@@ -213,7 +127,7 @@ void draw_static_cubes_scene(game_state_t *g, uint segments)
     translate_matrix(trans_the_origin);
     vec3f scale = { .x = 0.1f, .y = 0.1f, .z = 0.1f };
     scale_matrix(scale);
-    draw_gl_pyramid(colours[8], g->simple_color_program); // The center
+    draw_gl_pyramid(g, PALETTE_RAINBOW, g->simple_color_program); // The center
     scale.x = 10; scale.y = 10; scale.z = 10;
     scale_matrix(scale);
 
@@ -229,7 +143,8 @@ void draw_static_cubes_scene(game_state_t *g, uint segments)
         translate_matrix(trans_from_origin);
         vec3f scale = { .x = 0.3f, .y = 0.3f, .z = 0.3f };
         scale_matrix(scale);
-        draw_gl_cube(colours[1], g->simple_color_program);
+        models[num_cubes] = peek(mats->model);
+        colours[num_cubes++] = blue;
         pop_matrix();
         rotate_matrix(rot_axis, rot_angle);
     }
@@ -242,7 +157,8 @@ void draw_static_cubes_scene(game_state_t *g, uint segments)
         translate_matrix(trans_from_origin);
         vec3f scale = { .x = 0.3f, .y = 0.3f, .z = 0.3f };
         scale_matrix(scale);
-        draw_gl_cube(colours[2], g->simple_color_program);
+        models[num_cubes] = peek(mats->model);
+        colours[num_cubes++] = green;
         pop_matrix();
         rotate_matrix(rot_axis, rot_angle);
     }
@@ -255,26 +171,18 @@ void draw_static_cubes_scene(game_state_t *g, uint segments)
         translate_matrix(trans_from_origin);
         vec3f scale = { .x = 0.3f, .y = 0.3f, .z = 0.3f };
         scale_matrix(scale);
-        draw_gl_cube(colours[4], g->simple_color_program);
+        models[num_cubes] = peek(mats->model);
+        colours[num_cubes++] = red;
         pop_matrix();
         rotate_matrix(rot_axis, rot_angle);
     }
     pop_matrix();
+
+    draw_gl_cubes_instanced(g, models, colours, num_cubes, g->simple_color_instanced_program);
 }
 
 void draw_bouncing_cube_scene(game_state_t *g)
 {
-    float colours[] =
-        {
-            0,   0,   0,  // Black
-            0,   0,   1,  // Blue
-            0,   1,   0,  // Green
-            0,   1,   1,  // Cyan
-            1,   0,   0,  // Red
-            1,   0,   1,  // Magenta
-            1,   1,   0,  // Yellow
-            1,   1,   1   // White
-        };
     // Dynamic values for a cool animation
     static float scale_fact = 0.5f;
     static float scale_delta = -0.0025f;
@@ -321,7 +229,7 @@ void draw_bouncing_cube_scene(game_state_t *g)
             .pnt = { .x = 0, .y = 0, .z = 0 }
         };
     rotate_matrix(rot_axis, rot_fact);
-    draw_gl_cube(colours, g->simple_color_program);
+    draw_gl_cube(g, PALETTE_RAINBOW, g->simple_color_program);
 
     // Stacking another matrix (copies the previous transformations)
     push_matrix();
@@ -329,7 +237,7 @@ void draw_bouncing_cube_scene(game_state_t *g)
     translation.x = 0; translation.y = 2; translation.z = 0;
     translate_matrix(translation);
     rotate_matrix(rot_axis, rot_fact);
-    draw_gl_cube(colours, g->simple_color_program);
+    draw_gl_cube(g, PALETTE_RAINBOW, g->simple_color_program);
     // Popping the matrix removes the top matrix from the stack
     pop_matrix();
     // The last few transformations on the MODEL matrix have been "undone"
@@ -343,7 +251,7 @@ void draw_bouncing_cube_scene(game_state_t *g)
     translation.x = 0; translation.y = 2; translation.z = 0;
     translate_matrix(translation);
     rotate_matrix(rot_axis, rot_fact);
-    draw_gl_cube(colours, g->simple_color_program);
+    draw_gl_cube(g, PALETTE_RAINBOW, g->simple_color_program);
     pop_matrix();
 
     pop_matrix();
@@ -404,6 +312,7 @@ void basic_camera_logic(game_state_t *g)
     bool shoulder_right = is_pressed(input->shoulder_right);
     bool f1 = is_just_pressed(input->f1);
     bool f2 = is_just_pressed(input->f2);
+    bool f3 = is_just_pressed(input->f3);
     int  mouse_x = input->cursor_x_delta;
     int  mouse_y = input->cursor_y_delta;
     bool left_click   = is_just_pressed(input->mouse_left_click);
@@ -482,6 +391,12 @@ void basic_camera_logic(game_state_t *g)
     {
         lock_roll = !lock_roll;
     }
+    if (f3)
+    {
+        // Same scene and lights either way, to compare both paths
+        g->render_queue.deferred_shading = !g->render_queue.deferred_shading;
+        log_info("Switched to %s shading", g->render_queue.deferred_shading ? "deferred" : "forward");
+    }
 
 }
 
@@ -493,128 +408,35 @@ void solar_system_logic(game_state_t *g)
 
 void draw_solar_system(game_state_t *g)
 {
-    // Initialize the sun if needed
-    if (!g->sun.meshes)
+    scene_t *scene = &g->solar_system;
+
+    // Initialize the sun and its light if needed
+    if (!scene->num_models)
     {
-        g->sun.meshes = sphere_mesh(1.0f, 32, 32);
-        g->sun.num_meshes = 1;
-        g->sun.model_mat = identity_matrix_4x4;
-        g->sun.visible = true;
+        model_t *sun = add_model(scene, -1);
+        sun->meshes = sphere_mesh(1.0f, 32, 32);
+        sun->num_meshes = 1;
+
+        mesh_t *sun_mesh = &sun->meshes[0];
+        sun_mesh->program = &g->clustered_light_program;
+
+        // 1x1 texture for our single color
+        uint8 texels[3] = { 0x01, 0x01, 0x01 /* orange */ };
+        sun_mesh->material = calloc(1, sizeof(material_t));
+        sun_mesh->material->textures[0] = texture_from_texels(&g->textures, 1, 1, 3, texels);
+        sun_mesh->material->texture_count = 1;
+        // Coarser spheres once it covers less than a quarter of the screen
+        add_sphere_lods(sun, 1.0f, 32, 32, 0.25f);
+        optimize_model_meshes(sun);
+
+        light_source_t *light = add_light_source(scene);
+        vec4f light_pos = { .x = 2.0f, .y = 2.0f, .z = 0.0f, .w = 1.0f };
+        vec4f light_color = { .x = 0xFF, .y = 0xFF, .z = 0xFF, .w = 1.0f }; // white
+        light->position_world = light_pos;
+        light->diffuse = light_color;
     }
-    mesh_t *sun_mesh = &g->sun.meshes[0];
-
-    /* Actually draw the sun */
-    openGL.glUseProgram(g->single_light_program);
-
-    /* Texture setup */
-
-    // 1x1 texture for our single color
-    uint8 texels[3] = { 0x01, 0x01, 0x01 /* orange */ };
-
-    GLuint texture = 0;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // set the texture wrapping/filtering options (on the currently bound texture object)
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    /* NOTE: Do we want to use RGB or RGBA for most textures ? */
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, texels);
-    // Is this necessary?
-    openGL.glGenerateMipmap(GL_TEXTURE_2D);
-
-    /* Uniforms */
-
-    GLuint program = g->single_light_program;
-
-    static int mmatrix_uniform_pos = -1;
-    if (mmatrix_uniform_pos == -1)
-        mmatrix_uniform_pos = openGL.glGetUniformLocation(program, "modelMatrix");
-
-    static int vmatrix_uniform_pos = -1;
-    if (vmatrix_uniform_pos == -1)
-        vmatrix_uniform_pos = openGL.glGetUniformLocation(program, "viewMatrix");
-
-    static int pmatrix_uniform_pos = -1;
-    if (pmatrix_uniform_pos == -1)
-        pmatrix_uniform_pos = openGL.glGetUniformLocation(program, "projMatrix");
-
-    static int lightpos_uniform_pos = -1;
-    if (lightpos_uniform_pos == -1)
-        lightpos_uniform_pos = openGL.glGetUniformLocation(program, "lightWorldPos");
-
-    static int lightcolor_uniform_pos = -1;
-    if (lightcolor_uniform_pos == -1)
-        lightcolor_uniform_pos = openGL.glGetUniformLocation(program, "lightColor");
-
-    mat4x4f mmatrix = peek(mats->model);
-    mat4x4f vmatrix = peek(mats->view);
-    mat4x4f pmatrix = peek(mats->projection);
-    vec3f light_pos = { .x = 2.0f, .y = 2.0f, .z = 0.0f};
-    vec3f light_color = { .x = 0xFF, .y = 0xFF, .z = 0xFF }; // white
-
-    openGL.glUniformMatrix4fv(mmatrix_uniform_pos, 1, GL_TRUE, mmatrix.v);
-    openGL.glUniformMatrix4fv(vmatrix_uniform_pos, 1, GL_TRUE, vmatrix.v);
-    openGL.glUniformMatrix4fv(pmatrix_uniform_pos, 1, GL_TRUE, pmatrix.v);
-    openGL.glUniform3f(lightpos_uniform_pos, light_pos.x, light_pos.y, light_pos.z);
-    openGL.glUniform3f(lightcolor_uniform_pos, light_color.x, light_color.y, light_color.z);
-
-    /* Buffers */
-    static unsigned int vao = 0;
-    if (!vao)
-        openGL.glGenVertexArrays(1, &vao);
-
-    openGL.glBindVertexArray(vao);
-
-
-    // Vertex info
-    static unsigned int position_bo = 0;
-    if (!position_bo)
-        openGL.glGenBuffers(1, &position_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, position_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * sun_mesh->num_vertices, sun_mesh->vertices, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(0);
-
-
-    // Normal info
-    static unsigned int normal_bo = 0;
-    if (!normal_bo)
-        openGL.glGenBuffers(1, &normal_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, normal_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * sun_mesh->num_vertices, sun_mesh->normals, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(1);
-
-    // Texture coord info
-    static unsigned int texcoord_bo = 0;
-    if (!texcoord_bo)
-        openGL.glGenBuffers(1, &texcoord_bo);
-
-    openGL.glBindBuffer(GL_ARRAY_BUFFER, texcoord_bo);
-    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * sun_mesh->num_vertices, sun_mesh->tex_coords, GL_STATIC_DRAW);
-    openGL.glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    openGL.glEnableVertexAttribArray(2);
-
-
-    static unsigned int element_bo = 0;
-    if (!element_bo)
-        openGL.glGenBuffers(1, &element_bo);
-
-    openGL.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_bo);
-    openGL.glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32) * sun_mesh->num_indices, sun_mesh->indices, GL_STATIC_DRAW);
-
-    glPointSize(10.0f);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-
-    glDrawElements(GL_TRIANGLES, sun_mesh->num_indices, GL_UNSIGNED_INT, (void*)0);
 
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    render_scene(scene, &g->render_queue);
 }
 
 void draw_fps_counter(game_state_t *g)
@@ -630,7 +452,22 @@ void draw_fps_counter(game_state_t *g)
         total = 0.0;
     }
     vec3f font_color = { .x = 1.0f, .y = 1.0f, .z = 1.0f };
-    render_text(g->default_charmap, str, 5.0f, g->window_height - 20.0f, g->window_width, g->window_height, 0.5f, font_color);
+    render_text(&g->sdf_text_batch, &g->glyph_cache, g->default_face, str, 5.0f, g->window_height - 20.0f, 24, font_color);
+
+    /* State changes of the last frame once sorted, next to those of the recording order. Sorting can
+       add changes of one kind while saving others, so they are not subtracted */
+    char stats_str[96];
+    render_stats_t *stats = &g->render_queue.stats;
+    sprintf(stats_str, "%u cmds, %u programs (%u unsorted), %u meshes (%u unsorted)", stats->commands,
+            stats->program_changes, stats->unsorted_program_changes,
+            stats->mesh_changes, stats->unsorted_mesh_changes);
+    render_text(&g->sdf_text_batch, &g->glyph_cache, g->default_face, stats_str, 5.0f, g->window_height - 36.0f, 14, font_color);
+    sprintf(stats_str, "%u GL state calls, %u elided, %u batches (%u draws)", stats->gl_calls_issued,
+            stats->gl_calls_elided, stats->batches, stats->indirect_commands);
+    render_text(&g->sdf_text_batch, &g->glyph_cache, g->default_face, stats_str, 5.0f, g->window_height - 52.0f, 14, font_color);
+    sprintf(stats_str, "%u draws occluded, %u drawn late, %s shading (F3)", stats->draws_occluded, stats->draws_late,
+            g->render_queue.deferred_shading ? "deferred" : "forward");
+    render_text(&g->sdf_text_batch, &g->glyph_cache, g->default_face, stats_str, 5.0f, g->window_height - 68.0f, 14, font_color);
 }
 
 #endif
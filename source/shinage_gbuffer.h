@@ -0,0 +1,116 @@
+#ifndef SHINAGE_GBUFFER_H
+#define SHINAGE_GBUFFER_H
+
+#include <GL/glx.h>
+#include <GL/glext.h>
+#include "shinage_ints.h"
+#include "shinage_debug.h"
+#include "shinage_opengl_signatures.h"
+#include "shinage_shaders.h"
+
+/* Render targets of deferred shading. The geometry pass writes the albedo and world space normal of
+   the nearest surface of every pixel, then a single full screen pass lights them with the light clusters
+   (shaders/deferred_lighting.frag), so each pixel is shaded once however many surfaces were drawn over it */
+typedef struct
+{
+    uint forward_program;  // Forward lit program the geometry pass stands in for, see render_scene
+    uint geometry_program; // Fills the targets, 0 if it could not be built
+    uint lighting_program; // Full screen lighting pass
+    uint fbo;
+    uint albedo_texture;   // RGBA8
+    uint normal_texture;   // RGBA16F, w is unused
+    uint depth_texture;    // Also the depth buffer of the geometry pass
+    uint vao;              // Empty, the full screen triangle comes from gl_VertexID
+    int target_fbo;        // Bound when the geometry pass began, lit into afterwards. Usually the default one
+    int width, height;     // 0 until first bound
+} gbuffer_t;
+
+static void gbuffer_texture(uint texture, int unit, int internal_format, int width, int height, GLenum format, GLenum type)
+{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+/* (Re)creates the targets for a framebuffer of the given size */
+static void resize_gbuffer(gbuffer_t *g, int width, int height)
+{
+    if (!g->fbo)
+    {
+        openGL.glGenFramebuffers(1, &g->fbo);
+        glGenTextures(1, &g->albedo_texture);
+        glGenTextures(1, &g->normal_texture);
+        glGenTextures(1, &g->depth_texture);
+        openGL.glGenVertexArrays(1, &g->vao);
+    }
+    g->width = width;
+    g->height = height;
+    gbuffer_texture(g->albedo_texture, GBUFFER_ALBEDO_TEXTURE_UNIT, GL_RGBA8, width, height, GL_RGBA, GL_UNSIGNED_BYTE);
+    gbuffer_texture(g->normal_texture, GBUFFER_NORMAL_TEXTURE_UNIT, GL_RGBA16F, width, height, GL_RGBA, GL_FLOAT);
+    // Same format as the depth pyramid copies from, the late occlusion pass builds it out of this one
+    gbuffer_texture(g->depth_texture, GBUFFER_DEPTH_TEXTURE_UNIT, GL_DEPTH_COMPONENT24, width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+    glActiveTexture(GL_TEXTURE0);
+
+    openGL.glBindFramebuffer(GL_FRAMEBUFFER, g->fbo);
+    openGL.glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + FRAG_DATA_COLOUR, GL_TEXTURE_2D, g->albedo_texture, 0);
+    openGL.glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + FRAG_DATA_NORMAL, GL_TEXTURE_2D, g->normal_texture, 0);
+    openGL.glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, g->depth_texture, 0);
+    GLenum targets[] = { GL_COLOR_ATTACHMENT0 + FRAG_DATA_COLOUR, GL_COLOR_ATTACHMENT0 + FRAG_DATA_NORMAL };
+    openGL.glDrawBuffers(2, targets);
+    GLenum status = openGL.glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        log_err("Error: G-buffer framebuffer is incomplete (0x%x)", status);
+}
+
+/* Binds the targets for the geometry pass of a width x height frame and clears them */
+void begin_gbuffer(gbuffer_t *g, int width, int height)
+{
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &g->target_fbo);
+    if (g->width != width || g->height != height)
+        resize_gbuffer(g, width, height);
+    openGL.glBindFramebuffer(GL_FRAMEBUFFER, g->fbo);
+    // Depth cleared to the far plane is how the lighting pass tells there is nothing in a pixel
+    float clear_colour[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_colour);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClearColor(clear_colour[0], clear_colour[1], clear_colour[2], clear_colour[3]);
+}
+
+/* Goes back to the framebuffer bound before begin_gbuffer and lights the targets into it. The depth of the geometry pass
+   goes with them, so whatever is drawn forward afterwards is hidden behind it. Needs a depth test that
+   passes on a cleared depth buffer, like that of the opaque pass, and leaves the lighting program in use */
+void light_gbuffer(gbuffer_t *g)
+{
+    openGL.glBindFramebuffer(GL_FRAMEBUFFER, g->target_fbo);
+    glActiveTexture(GL_TEXTURE0 + GBUFFER_ALBEDO_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, g->albedo_texture);
+    glActiveTexture(GL_TEXTURE0 + GBUFFER_NORMAL_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, g->normal_texture);
+    glActiveTexture(GL_TEXTURE0 + GBUFFER_DEPTH_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, g->depth_texture);
+    glActiveTexture(GL_TEXTURE0);
+
+    gl_use_program(g->lighting_program);
+    gl_bind_vertex_array(g->vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void destroy_gbuffer(gbuffer_t *g)
+{
+    if (g->fbo)
+    {
+        uint textures[] = { g->albedo_texture, g->normal_texture, g->depth_texture };
+        openGL.glDeleteFramebuffers(1, &g->fbo);
+        glDeleteTextures(3, textures);
+        gl_delete_vertex_arrays(1, &g->vao);
+    }
+    gbuffer_t programs = { .forward_program = g->forward_program, .geometry_program = g->geometry_program,
+                           .lighting_program = g->lighting_program };
+    *g = programs;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef SHINAGE_HIZ_H
+#define SHINAGE_HIZ_H
+
+#include <string.h>
+#include <GL/glx.h>
+#include <GL/glext.h>
+#include "shinage_ints.h"
+#include "shinage_opengl_signatures.h"
+#include "shinage_shaders.h"
+
+/* Mip pyramid of the depth buffer where each texel holds the farthest depth of the area it covers,
+   so a single fetch tells whether anything nearer than that is hidden. Level 0 is half the size
+   of the depth buffer. Built by the reduction program in shaders/hiz_reduce.comp */
+typedef struct
+{
+    uint program;        // 0 when compute shaders are not available
+    uint depth_texture;  // Copy of the depth buffer the first level is reduced from
+    uint texture;        // R32F, with levels mips
+    int width, height;   // Of the depth buffer it was built from
+    int levels;          // 0 until the first build
+    uniform_cache_t source_uniform, level_uniform;
+} hiz_pyramid_t;
+
+static inline int hiz_level_size(int size, int level)
+{
+    size >>= level + 1;
+    return size > 0 ? size : 1;
+}
+
+/* (Re)creates the textures for a depth buffer of the given size */
+static void resize_hiz_pyramid(hiz_pyramid_t *hiz, int width, int height)
+{
+    if (!hiz->texture)
+    {
+        glGenTextures(1, &hiz->depth_texture);
+        glGenTextures(1, &hiz->texture);
+    }
+    hiz->width = width;
+    hiz->height = height;
+    hiz->levels = 1;
+    while (hiz_level_size(width, hiz->levels - 1) > 1 || hiz_level_size(height, hiz->levels - 1) > 1)
+        ++hiz->levels;
+
+    glActiveTexture(GL_TEXTURE0 + HIZ_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, hiz->depth_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glBindTexture(GL_TEXTURE_2D, hiz->texture);
+    for (int level = 0; level < hiz->levels; ++level)
+        glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, hiz_level_size(width, level), hiz_level_size(height, level),
+                     0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiz->levels - 1);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+/* Builds the pyramid from the depth buffer of the bound read framebuffer. Leaves the pyramid
+   bound to HIZ_TEXTURE_UNIT and ready to be fetched from */
+void build_hiz_pyramid(hiz_pyramid_t *hiz, int width, int height)
+{
+    if (!hiz->program || width <= 0 || height <= 0)
+        return;
+    if (hiz->width != width || hiz->height != height)
+        resize_hiz_pyramid(hiz, width, height);
+
+    glActiveTexture(GL_TEXTURE0 + HIZ_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, hiz->depth_texture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+    gl_use_program(hiz->program);
+    openGL.glUniform1i(uniform_location(&hiz->source_uniform, hiz->program, "source"), HIZ_TEXTURE_UNIT);
+    int source_level = uniform_location(&hiz->level_uniform, hiz->program, "sourceLevel");
+    for (int level = 0; level < hiz->levels; ++level)
+    {
+        // The first level reads the depth copy, the rest the level right above them
+        if (level == 1)
+            glBindTexture(GL_TEXTURE_2D, hiz->texture);
+        openGL.glUniform1i(source_level, level ? level - 1 : 0);
+        openGL.glBindImageTexture(0, hiz->texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        openGL.glDispatchCompute((hiz_level_size(width, level) + 7) / 8, (hiz_level_size(height, level) + 7) / 8, 1);
+        openGL.glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+    if (hiz->levels == 1)
+        glBindTexture(GL_TEXTURE_2D, hiz->texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void destroy_hiz_pyramid(hiz_pyramid_t *hiz)
+{
+    if (hiz->texture)
+    {
+        glDeleteTextures(1, &hiz->depth_texture);
+        glDeleteTextures(1, &hiz->texture);
+    }
+    uint program = hiz->program;
+    memset(hiz, 0, sizeof(hiz_pyramid_t));
+    hiz->program = program;
+}
+
+#endif
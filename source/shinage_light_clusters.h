@@ -0,0 +1,351 @@
+#ifndef SHINAGE_LIGHT_CLUSTERS_H
+#define SHINAGE_LIGHT_CLUSTERS_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_opengl_signatures.h"
+#include "shinage_shaders.h"
+#include "shinage_scene.h"
+
+/* Clustered forward lighting. The view frustum is split in screen tiles and exponential depth slices,
+   and every frame each light goes to the list of the clusters its range touches. Fragments only walk
+   the list of their own cluster, see shaders/clustered_lights.glsl. The size of the grid is in
+   shinage_shaders.h, which hands it to the shaders */
+#define NUM_LIGHT_CLUSTERS (LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z)
+
+/* Lights stop reaching a cluster once their attenuated colour falls under this */
+#define LIGHT_CUTOFF (1.0f / 256.0f)
+
+typedef enum
+{
+    LIGHT_POINT,
+    LIGHT_SPOT,
+    LIGHT_DIRECTIONAL
+} light_type_t;
+
+/* A light as the shaders fetch it from the lightData buffer texture, one RGBA32F texel per row */
+typedef struct
+{
+    vec4f position;    // World space, w is unused
+    vec4f colour;      // w is the light_type_t
+    vec4f direction;   // Towards directional lights and out of spots, w is the cosine of the spot cutoff
+    vec4f attenuation; // kc, kl, kq and the spot exponent
+} gpu_light_t;
+
+#define GPU_LIGHT_TEXELS (sizeof(gpu_light_t) / sizeof(vec4f))
+
+/* Clusters touched by a light, inclusive */
+typedef struct
+{
+    uint min[3], max[3];
+} light_cluster_range_t;
+
+typedef struct
+{
+    uint num_lights, _max_lights;
+    gpu_light_t *lights;
+    uint32 clusters[NUM_LIGHT_CLUSTERS][2]; // First entry in indices and number of lights of each cluster
+    uint num_indices, _max_indices;
+    uint32 *indices;
+    vec4f params; // Near plane, slices per unit of log depth and tile size in pixels, see light_cluster_index
+    uint max_cluster_lights; // Longest list of the last assignment
+    uint _max_ranges;
+    light_cluster_range_t *ranges; // Scratch for the assignment, one per light
+    // GPU copies, see upload_light_clusters
+    uint lights_bo, clusters_bo, indices_bo;
+    uint lights_texture, clusters_texture, indices_texture;
+} light_clusters_t;
+
+/* Distance past which a light adds less than LIGHT_CUTOFF, INFINITY if it reaches everywhere and 0 if it
+   is never that bright. Lights with no attenuation at all reach everywhere */
+float light_range(light_source_t *light)
+{
+    vec3f a = light->attenuation;
+    if (light->directional || (a.x == 0.0f && a.y == 0.0f && a.z == 0.0f))
+        return INFINITY;
+
+    float intensity = fmaxf(light->diffuse.x, fmaxf(light->diffuse.y, light->diffuse.z));
+    // Solve kc + kl * d + kq * d^2 = intensity / LIGHT_CUTOFF
+    float c = a.x - intensity / LIGHT_CUTOFF;
+    if (c >= 0.0f)
+        return 0.0f;
+    if (a.z > 0.0f)
+        return (-a.y + sqrtf(a.y * a.y - 4.0f * a.z * c)) / (2.0f * a.z);
+    if (a.y > 0.0f)
+        return -c / a.y;
+    return INFINITY;
+}
+
+static gpu_light_t make_gpu_light(light_source_t *light)
+{
+    gpu_light_t g = {0};
+    g.position = light->position_world;
+    g.position.w = 0.0f;
+    g.colour = light->diffuse;
+    g.colour.w = LIGHT_POINT;
+    vec3f a = light->attenuation;
+    // No attenuation at all means none, not a division by zero
+    if (a.x == 0.0f && a.y == 0.0f && a.z == 0.0f)
+        a.x = 1.0f;
+    g.attenuation.x = a.x;
+    g.attenuation.y = a.y;
+    g.attenuation.z = a.z;
+
+    vec3f direction = { .x = 0.0f, .y = 0.0f, .z = -1.0f };
+    if (light->directional)
+    {
+        // Following GL, the position of a directional light is the direction towards it
+        vec3f p = { .x = light->position_world.x, .y = light->position_world.y, .z = light->position_world.z };
+        direction = normalize3f(p);
+        g.colour.w = LIGHT_DIRECTIONAL;
+    }
+    else if (light->spot_cutoff > 0.0f && light->spot_cutoff < 180.0f)
+    {
+        direction = normalize3f(light->spot_direction_world);
+        g.direction.w = cosf(deg_to_rad(light->spot_cutoff));
+        g.attenuation.w = light->spot_exponent;
+        g.colour.w = LIGHT_SPOT;
+    }
+    g.direction.x = direction.x;
+    g.direction.y = direction.y;
+    g.direction.z = direction.z;
+    return g;
+}
+
+/* Cluster of a fragment at window coordinates x, y and depth units in front of the camera */
+uint light_cluster_index(vec4f params, float x, float y, float depth)
+{
+    uint cx = x > 0.0f ? (uint)(x / params.z) : 0;
+    uint cy = y > 0.0f ? (uint)(y / params.w) : 0;
+    uint cz = depth > params.x ? (uint)(logf(depth / params.x) * params.y) : 0;
+    cx = cx < LIGHT_CLUSTERS_X ? cx : LIGHT_CLUSTERS_X - 1;
+    cy = cy < LIGHT_CLUSTERS_Y ? cy : LIGHT_CLUSTERS_Y - 1;
+    cz = cz < LIGHT_CLUSTERS_Z ? cz : LIGHT_CLUSTERS_Z - 1;
+    return (cz * LIGHT_CLUSTERS_Y + cy) * LIGHT_CLUSTERS_X + cx;
+}
+
+/* Tiles covered by the screen projection of a view space box from x0 to x1 and depth d0 to d1 (d0 > 0).
+   Its extremes are always at the corners. Returns false if the box is off screen */
+static bool light_tile_range(float scale, float offset, float x0, float x1, float d0, float d1,
+                             uint tiles, uint *first, uint *last)
+{
+    float lo = fminf(fminf(x0 / d0, x0 / d1), fminf(x1 / d0, x1 / d1)) * scale - offset;
+    float hi = fmaxf(fmaxf(x0 / d0, x0 / d1), fmaxf(x1 / d0, x1 / d1)) * scale - offset;
+    if (hi < -1.0f || lo > 1.0f)
+        return false;
+    lo = fmaxf(lo, -1.0f);
+    hi = fminf(hi, 1.0f);
+    *first = (uint)((lo + 1.0f) * 0.5f * tiles);
+    *last = (uint)((hi + 1.0f) * 0.5f * tiles);
+    *first = *first < tiles ? *first : tiles - 1;
+    *last = *last < tiles ? *last : tiles - 1;
+    return true;
+}
+
+/* Finds the clusters a light reaches. Returns false if it reaches none */
+static bool light_cluster_range(light_clusters_t *lc, light_source_t *light, mat4x4f view, mat4x4f projection,
+                                float near, float far, light_cluster_range_t *range)
+{
+    float r = light_range(light);
+    if (r == 0.0f)
+        return false;
+
+    light_cluster_range_t all = { .max = { LIGHT_CLUSTERS_X - 1, LIGHT_CLUSTERS_Y - 1, LIGHT_CLUSTERS_Z - 1 } };
+    *range = all;
+    if (isinf(r))
+        return true;
+
+    vec4f p = light->position_world;
+    p.w = 1.0f;
+    vec4f c = mat4x4f_vec4f_prod(view, p);
+    float d0 = -c.z - r, d1 = -c.z + r;
+    if (d1 < near || d0 > far)
+        return false;
+    d0 = fmaxf(d0, near);
+    d1 = fminf(d1, far);
+
+    // Projection of view space x and y is scale * x / depth - offset, with offset 0 unless the frustum is off-centre
+    uint tiles[2] = { LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y };
+    float scales[2] = { projection.a1, projection.b2 };
+    float offsets[2] = { projection.c1, projection.c2 };
+    float centres[2] = { c.x, c.y };
+    for (uint axis = 0; axis < 2; ++axis)
+        if (!light_tile_range(scales[axis], offsets[axis], centres[axis] - r, centres[axis] + r, d0, d1,
+                              tiles[axis], &range->min[axis], &range->max[axis]))
+            return false;
+
+    vec4f params = lc->params;
+    range->min[2] = light_cluster_index(params, 0.0f, 0.0f, d0) / (LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y);
+    range->max[2] = light_cluster_index(params, 0.0f, 0.0f, d1) / (LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y);
+    return true;
+}
+
+/* Builds the light lists of every cluster for the given camera and a width x height viewport. The ranges
+   of lights are bounded by spheres, spots included. Projections that are not perspective get a single
+   cluster holding every light */
+void assign_light_clusters(light_clusters_t *lc, light_source_t *lights, uint num_lights, mat4x4f view, mat4x4f projection,
+                           int width, int height)
+{
+    lc->num_lights = 0;
+    lc->num_indices = 0;
+    lc->max_cluster_lights = 0;
+    memset(lc->clusters, 0, sizeof(lc->clusters));
+    if (width < 1)
+        width = 1;
+    if (height < 1)
+        height = 1;
+
+    bool perspective = projection.c4 == -1.0f && projection.a4 == 0.0f && projection.b4 == 0.0f && projection.d4 == 0.0f;
+    float near = 0.0f, far = 0.0f;
+    if (perspective)
+    {
+        near = projection.d3 / (projection.c3 - 1.0f);
+        far = projection.d3 / (projection.c3 + 1.0f);
+        lc->params.x = near;
+        lc->params.y = LIGHT_CLUSTERS_Z / logf(far / near);
+        lc->params.z = ceilf((float)width / LIGHT_CLUSTERS_X);
+        lc->params.w = ceilf((float)height / LIGHT_CLUSTERS_Y);
+    }
+    else
+    {
+        // Every fragment falls in the first cluster
+        lc->params.x = 1.0f;
+        lc->params.y = 0.0f;
+        lc->params.z = width;
+        lc->params.w = height;
+    }
+
+    if (num_lights > lc->_max_ranges)
+    {
+        lc->_max_ranges = num_lights;
+        lc->ranges = realloc(lc->ranges, sizeof(light_cluster_range_t) * lc->_max_ranges);
+    }
+    if (num_lights > lc->_max_lights)
+    {
+        lc->_max_lights = num_lights;
+        lc->lights = realloc(lc->lights, sizeof(gpu_light_t) * lc->_max_lights);
+    }
+
+    // Count the lights of each cluster first so every list goes in one piece
+    for (uint i = 0; i < num_lights; ++i)
+    {
+        light_source_t *light = &lights[i];
+        light_cluster_range_t *range = &lc->ranges[lc->num_lights];
+        if (!light->enabled)
+            continue;
+        if (perspective)
+        {
+            if (!light_cluster_range(lc, light, view, projection, near, far, range))
+                continue;
+        }
+        else
+        {
+            if (light_range(light) == 0.0f)
+                continue;
+            memset(range, 0, sizeof(light_cluster_range_t));
+        }
+
+        lc->lights[lc->num_lights++] = make_gpu_light(light);
+        for (uint z = range->min[2]; z <= range->max[2]; ++z)
+            for (uint y = range->min[1]; y <= range->max[1]; ++y)
+                for (uint x = range->min[0]; x <= range->max[0]; ++x)
+                    ++lc->clusters[(z * LIGHT_CLUSTERS_Y + y) * LIGHT_CLUSTERS_X + x][1];
+    }
+
+    uint32 offset = 0;
+    for (uint i = 0; i < NUM_LIGHT_CLUSTERS; ++i)
+    {
+        lc->clusters[i][0] = offset;
+        offset += lc->clusters[i][1];
+        if (lc->clusters[i][1] > lc->max_cluster_lights)
+            lc->max_cluster_lights = lc->clusters[i][1];
+        lc->clusters[i][1] = 0;
+    }
+    lc->num_indices = offset;
+    if (lc->num_indices > lc->_max_indices)
+    {
+        while (lc->_max_indices < lc->num_indices)
+            lc->_max_indices = lc->_max_indices ? lc->_max_indices * 2 : 1024;
+        lc->indices = realloc(lc->indices, sizeof(uint32) * lc->_max_indices);
+    }
+
+    for (uint i = 0; i < lc->num_lights; ++i)
+    {
+        light_cluster_range_t *range = &lc->ranges[i];
+        for (uint z = range->min[2]; z <= range->max[2]; ++z)
+            for (uint y = range->min[1]; y <= range->max[1]; ++y)
+                for (uint x = range->min[0]; x <= range->max[0]; ++x)
+                {
+                    uint32 *cluster = lc->clusters[(z * LIGHT_CLUSTERS_Y + y) * LIGHT_CLUSTERS_X + x];
+                    lc->indices[cluster[0] + cluster[1]++] = i;
+                }
+    }
+}
+
+static void upload_light_buffer(uint bo, size_t size, void *data)
+{
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, bo);
+    openGL.glBufferData(GL_COPY_WRITE_BUFFER, size, data, GL_STREAM_DRAW);
+}
+
+/* Sends the lights and their cluster lists to the GPU and binds them to their texture units */
+void upload_light_clusters(light_clusters_t *lc)
+{
+    if (!lc->lights_texture)
+    {
+        uint buffers[3], textures[3];
+        uint formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        openGL.glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+        for (uint i = 0; i < 3; ++i)
+        {
+            // Buffer names only become buffers once bound
+            gl_bind_buffer(GL_COPY_WRITE_BUFFER, buffers[i]);
+            glActiveTexture(GL_TEXTURE0 + LIGHT_DATA_TEXTURE_UNIT + i);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            openGL.glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        lc->lights_bo = buffers[0];
+        lc->clusters_bo = buffers[1];
+        lc->indices_bo = buffers[2];
+        lc->lights_texture = textures[0];
+        lc->clusters_texture = textures[1];
+        lc->indices_texture = textures[2];
+    }
+
+    if (lc->num_indices > (uint)gl_caps.max_texture_buffer_size || lc->num_lights * GPU_LIGHT_TEXELS > (uint)gl_caps.max_texture_buffer_size)
+        log_err("%u light cluster entries for %u lights do not fit in a buffer texture", lc->num_indices, lc->num_lights);
+
+    upload_light_buffer(lc->lights_bo, sizeof(gpu_light_t) * lc->num_lights, lc->lights);
+    upload_light_buffer(lc->clusters_bo, sizeof(lc->clusters), lc->clusters);
+    upload_light_buffer(lc->indices_bo, sizeof(uint32) * lc->num_indices, lc->indices);
+
+    glActiveTexture(GL_TEXTURE0 + LIGHT_DATA_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, lc->lights_texture);
+    glActiveTexture(GL_TEXTURE0 + LIGHT_CLUSTERS_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, lc->clusters_texture);
+    glActiveTexture(GL_TEXTURE0 + LIGHT_INDICES_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, lc->indices_texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void destroy_light_clusters(light_clusters_t *lc)
+{
+    if (lc->lights_texture)
+    {
+        uint buffers[] = { lc->lights_bo, lc->clusters_bo, lc->indices_bo };
+        uint textures[] = { lc->lights_texture, lc->clusters_texture, lc->indices_texture };
+        gl_delete_buffers(3, buffers);
+        glDeleteTextures(3, textures);
+    }
+    free(lc->lights);
+    free(lc->indices);
+    free(lc->ranges);
+    memset(lc, 0, sizeof(light_clusters_t));
+}
+
+#endif
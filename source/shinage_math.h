@@ -523,6 +523,26 @@ static inline mat4x4f inverse_mat4x4f(mat4x4f m)
     return res;
 }
 
+/* Inverse transpose of the upper 3x3 block of m, used to transform normals.
+   Computed from the cofactors, which is much cheaper than a full inverse */
+static inline mat3x3f normal_matrix_mat3x3f(mat4x4f m)
+{
+    vec3f r0 = { .x = m.a1, .y = m.b1, .z = m.c1 };
+    vec3f r1 = { .x = m.a2, .y = m.b2, .z = m.c2 };
+    vec3f r2 = { .x = m.a3, .y = m.b3, .z = m.c3 };
+    mat3x3f res;
+    res.rows[0] = cross_product3f(r1, r2);
+    res.rows[1] = cross_product3f(r2, r0);
+    res.rows[2] = cross_product3f(r0, r1);
+
+    float det = dot_product3f(r0, res.rows[0]);
+    if (det == 0)
+        return identity_matrix_3x3;
+    for (int i = 0; i < 9; ++i)
+        res.v[i] /= det;
+    return res;
+}
+
 static inline mat4x4f get_rotation_mat4x4f(mat4x4f m)
 {
     mat4x4f aux =
@@ -0,0 +1,468 @@
+#ifndef SHINAGE_MESH_CACHE_H
+#define SHINAGE_MESH_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "shinage_opengl_signatures.h"
+#include "shinage_shaders.h"
+#include "shinage_scene.h"
+#include "shinage_debug.h"
+#include "shinage_range_allocator.h"
+#include "shinage_vertex_layout.h"
+
+/* Initial sizes of the shared geometry buffers, they double whenever a mesh does not fit */
+#define MESH_BUFFER_INITIAL_VERTICES (1 << 16)
+#define MESH_BUFFER_INITIAL_INDICES  (1 << 18)
+
+/* Draws of a single multi-draw can see at most this many different drawIndex values */
+#define MAX_DRAWS_PER_BATCH (1 << 16)
+
+/* GPU resident copy of a mesh_t: a range of vertices and a range of indices of the shared
+   buffers. It is uploaded the first time the mesh is drawn and only touched again when the
+   mesh's data_revision changes */
+typedef struct
+{
+    mesh_t *mesh; // Key, NULL on empty slots
+    uint base_vertex;
+    uint first_index;
+    uint num_indices;
+    // Sizes of the current ranges, so we know if we can reuse them on re-uploads
+    uint allocated_vertices;
+    uint allocated_indices;
+    uint uploaded_revision;
+    vertex_dequantize_t dequantize; // Folded into the matrices of every draw, see dequantize_matrix
+} gpu_mesh_t;
+
+/* Same layout as GL's DrawElementsIndirectCommand. base_instance is added to the drawIndex
+   attribute, so it tells every instance of the command where to find its transforms */
+typedef struct
+{
+    uint count;
+    uint instance_count;
+    uint first_index;
+    int base_vertex;
+    uint base_instance;
+} draw_elements_indirect_t;
+
+/* Open addressing hash table from mesh_t pointers to their GPU copies, plus the buffers they live in.
+   Every mesh is drawn from the same VAO so switching meshes never rebinds vertex state */
+typedef struct
+{
+    uint num_entries, _max_entries; // _max_entries is always a power of 2
+    gpu_mesh_t *entries;
+    uint vao;
+    uint instanced_vao; // Same streams plus the per-instance attributes
+    vertex_layout_t layout; // Fixed once the buffers exist, compact_vertex_layout unless set before
+    uint vertex_bo;     // Interleaved vertices, see vertex_layout_t
+    uint element_bo;
+    range_allocator_t vertex_ranges;
+    range_allocator_t index_ranges;
+    // Streamed per-instance data shared by every instanced draw
+    uint instance_model_bo;
+    uint instance_colour_bo;
+    // Multi-draw support: a static 0, 1, 2... stream read per instance, and the indirect commands
+    uint draw_index_bo;
+    uint indirect_bo;
+    uint draw_index_source; // Buffer the drawIndex attribute reads, draw_index_bo unless culling replaced it
+    size_t resident_bytes; // Bytes used by resident meshes, not the capacity of the buffers
+    uint uploads; // Total number of mesh uploads, useful to check nothing is re-uploaded each frame
+    uint buffer_resizes;
+    // Scratch space for packing vertices and dequantizing instance matrices
+    size_t _max_scratch;
+    void *scratch;
+} mesh_cache_t;
+
+static inline uint mesh_cache_slot(mesh_cache_t *cache, mesh_t *mesh)
+{
+    // Fibonacci hashing of the pointer, ignoring the always-zero alignment bits
+    uint64 h = ((uint64)(uintptr_t)mesh >> 4) * 0x9E3779B97F4A7C15ull;
+    return (uint)(h >> 32) & (cache->_max_entries - 1);
+}
+
+/* Returns the cache entry for the mesh, or NULL if it is not resident */
+gpu_mesh_t *find_gpu_mesh(mesh_cache_t *cache, mesh_t *mesh)
+{
+    if (!cache->_max_entries)
+        return NULL;
+
+    uint i = mesh_cache_slot(cache, mesh);
+    while (cache->entries[i].mesh)
+    {
+        if (cache->entries[i].mesh == mesh)
+            return &cache->entries[i];
+        i = (i + 1) & (cache->_max_entries - 1);
+    }
+    return NULL;
+}
+
+/* Inserts an entry without checking for duplicates or load factor */
+static gpu_mesh_t *mesh_cache_insert(mesh_cache_t *cache, gpu_mesh_t entry)
+{
+    uint i = mesh_cache_slot(cache, entry.mesh);
+    while (cache->entries[i].mesh)
+        i = (i + 1) & (cache->_max_entries - 1);
+    cache->entries[i] = entry;
+    ++cache->num_entries;
+    return &cache->entries[i];
+}
+
+static void mesh_cache_grow(mesh_cache_t *cache)
+{
+    uint old_max = cache->_max_entries;
+    gpu_mesh_t *old_entries = cache->entries;
+
+    cache->_max_entries = old_max ? old_max * 2 : 64;
+    cache->entries = calloc(cache->_max_entries, sizeof(gpu_mesh_t));
+    cache->num_entries = 0;
+
+    for (uint i = 0; i < old_max; ++i)
+        if (old_entries[i].mesh)
+            mesh_cache_insert(cache, old_entries[i]);
+    free(old_entries);
+}
+
+static void *mesh_cache_scratch(mesh_cache_t *cache, size_t size)
+{
+    if (size > cache->_max_scratch)
+    {
+        while (cache->_max_scratch < size)
+            cache->_max_scratch = cache->_max_scratch ? cache->_max_scratch * 2 : 4096;
+        cache->scratch = realloc(cache->scratch, cache->_max_scratch);
+    }
+    return cache->scratch;
+}
+
+/* Returns a new buffer of new_size bytes holding the first old_size bytes of the old one, which is deleted.
+   The copy targets are used so the bindings of whatever VAO is bound are left alone */
+static uint resize_geometry_buffer(uint old_bo, size_t old_size, size_t new_size)
+{
+    uint bo;
+    openGL.glGenBuffers(1, &bo);
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, bo);
+    openGL.glBufferData(GL_COPY_WRITE_BUFFER, new_size, NULL, GL_STATIC_DRAW);
+    if (old_bo)
+    {
+        gl_bind_buffer(GL_COPY_READ_BUFFER, old_bo);
+        openGL.glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, old_size);
+        gl_delete_buffers(1, &old_bo);
+    }
+    return bo;
+}
+
+/* Points the attributes of a VAO to the current geometry buffers */
+static void bind_geometry_attribs(mesh_cache_t *cache, uint vao, bool instanced)
+{
+    gl_bind_vertex_array(vao);
+    bind_vertex_layout(&cache->layout, cache->vertex_bo);
+    // The element buffer binding is part of the VAO state
+    gl_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, cache->element_bo);
+
+    if (!instanced)
+    {
+        gl_bind_buffer(GL_ARRAY_BUFFER, cache->draw_index_source);
+        openGL.glVertexAttribIPointer(ATTRIB_DRAW_INDEX, 1, GL_UNSIGNED_INT, 0, (void*)0);
+        openGL.glVertexAttribDivisor(ATTRIB_DRAW_INDEX, 1);
+        openGL.glEnableVertexAttribArray(ATTRIB_DRAW_INDEX);
+        return;
+    }
+
+    /* Our matrices are row-major, so each row of the model matrix goes in its own attribute,
+       see shaders/simple_color_instanced.vert */
+    gl_bind_buffer(GL_ARRAY_BUFFER, cache->instance_model_bo);
+    for (uint row = 0; row < 4; ++row)
+    {
+        uint attrib = ATTRIB_INSTANCE_MODEL + row;
+        openGL.glVertexAttribPointer(attrib, 4, GL_FLOAT, GL_FALSE, sizeof(mat4x4f), (void*)(sizeof(vec4f) * row));
+        openGL.glVertexAttribDivisor(attrib, 1);
+        openGL.glEnableVertexAttribArray(attrib);
+    }
+    gl_bind_buffer(GL_ARRAY_BUFFER, cache->instance_colour_bo);
+    openGL.glVertexAttribPointer(ATTRIB_INSTANCE_COLOUR, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    openGL.glVertexAttribDivisor(ATTRIB_INSTANCE_COLOUR, 1);
+    openGL.glEnableVertexAttribArray(ATTRIB_INSTANCE_COLOUR);
+}
+
+/* Grows the shared buffers to hold at least the given number of vertices and indices, keeping their contents.
+   Ranges handed out before stay valid since they only ever live at the same offsets */
+static void grow_geometry_buffers(mesh_cache_t *cache, uint min_vertices, uint min_indices)
+{
+    uint old_vertices = cache->vertex_ranges.capacity;
+    uint old_indices = cache->index_ranges.capacity;
+    uint new_vertices = old_vertices ? old_vertices : MESH_BUFFER_INITIAL_VERTICES;
+    uint new_indices = old_indices ? old_indices : MESH_BUFFER_INITIAL_INDICES;
+    while (new_vertices < min_vertices)
+        new_vertices *= 2;
+    while (new_indices < min_indices)
+        new_indices *= 2;
+
+    if (!cache->vao)
+    {
+        if (!cache->layout.stride)
+            cache->layout = compact_vertex_layout();
+        openGL.glGenVertexArrays(1, &cache->vao);
+        openGL.glGenVertexArrays(1, &cache->instanced_vao);
+        openGL.glGenBuffers(1, &cache->instance_model_bo);
+        openGL.glGenBuffers(1, &cache->instance_colour_bo);
+        openGL.glGenBuffers(1, &cache->indirect_bo);
+
+        uint32 *draw_indices = malloc(sizeof(uint32) * MAX_DRAWS_PER_BATCH);
+        for (uint i = 0; i < MAX_DRAWS_PER_BATCH; ++i)
+            draw_indices[i] = i;
+        openGL.glGenBuffers(1, &cache->draw_index_bo);
+        gl_bind_buffer(GL_COPY_WRITE_BUFFER, cache->draw_index_bo);
+        openGL.glBufferData(GL_COPY_WRITE_BUFFER, sizeof(uint32) * MAX_DRAWS_PER_BATCH, draw_indices, GL_STATIC_DRAW);
+        free(draw_indices);
+        cache->draw_index_source = cache->draw_index_bo;
+    }
+
+    if (new_vertices != old_vertices)
+    {
+        cache->vertex_bo = resize_geometry_buffer(cache->vertex_bo, (size_t)cache->layout.stride * old_vertices,
+                                                  (size_t)cache->layout.stride * new_vertices);
+        grow_range_allocator(&cache->vertex_ranges, new_vertices);
+    }
+    if (new_indices != old_indices)
+    {
+        cache->element_bo = resize_geometry_buffer(cache->element_bo, sizeof(uint32) * old_indices,
+                                                   sizeof(uint32) * new_indices);
+        grow_range_allocator(&cache->index_ranges, new_indices);
+    }
+
+    bind_geometry_attribs(cache, cache->vao, false);
+    bind_geometry_attribs(cache, cache->instanced_vao, true);
+    ++cache->buffer_resizes;
+}
+
+/* Allocates a range from one of the allocators, growing the buffers until it fits */
+static uint alloc_geometry_range(mesh_cache_t *cache, range_allocator_t *ranges, uint size)
+{
+    uint offset = alloc_range(ranges, size);
+    while (offset == INVALID_RANGE)
+    {
+        uint needed = ranges->capacity + size;
+        if (ranges == &cache->vertex_ranges)
+            grow_geometry_buffers(cache, needed, 0);
+        else
+            grow_geometry_buffers(cache, 0, needed);
+        offset = alloc_range(ranges, size);
+    }
+    return offset;
+}
+
+static size_t gpu_mesh_bytes(mesh_cache_t *cache, gpu_mesh_t *gm)
+{
+    return (size_t)cache->layout.stride * gm->allocated_vertices + sizeof(uint32) * gm->allocated_indices;
+}
+
+/* Sends the mesh data to its ranges of the shared buffers. The ranges are only replaced if the mesh grew */
+static void upload_gpu_mesh(mesh_cache_t *cache, gpu_mesh_t *gm)
+{
+    mesh_t *mesh = gm->mesh;
+    if (!cache->vao)
+        grow_geometry_buffers(cache, 0, 0);
+
+    cache->resident_bytes -= gpu_mesh_bytes(cache, gm);
+    if (mesh->num_vertices > gm->allocated_vertices)
+    {
+        free_range(&cache->vertex_ranges, gm->base_vertex, gm->allocated_vertices);
+        gm->base_vertex = alloc_geometry_range(cache, &cache->vertex_ranges, mesh->num_vertices);
+        gm->allocated_vertices = mesh->num_vertices;
+    }
+    if (mesh->num_indices > gm->allocated_indices)
+    {
+        free_range(&cache->index_ranges, gm->first_index, gm->allocated_indices);
+        gm->first_index = alloc_geometry_range(cache, &cache->index_ranges, mesh->num_indices);
+        gm->allocated_indices = mesh->num_indices;
+    }
+    cache->resident_bytes += gpu_mesh_bytes(cache, gm);
+
+    size_t stride = cache->layout.stride;
+    void *vertices = mesh_cache_scratch(cache, stride * mesh->num_vertices);
+    pack_mesh_vertices(&cache->layout, mesh, vertices);
+    gm->dequantize = mesh_vertex_dequantize(&cache->layout, mesh);
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, cache->vertex_bo);
+    openGL.glBufferSubData(GL_COPY_WRITE_BUFFER, stride * gm->base_vertex, stride * mesh->num_vertices, vertices);
+    // Indices stay relative to the mesh, the draws add base_vertex to them
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, cache->element_bo);
+    openGL.glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(uint32) * gm->first_index,
+                           sizeof(uint32) * mesh->num_indices, mesh->indices);
+
+    gm->num_indices = mesh->num_indices;
+    gm->uploaded_revision = mesh->data_revision;
+    ++cache->uploads;
+}
+
+/* Returns the GPU copy of the mesh, uploading it first if it was not resident or it is dirty */
+gpu_mesh_t *get_gpu_mesh(mesh_cache_t *cache, mesh_t *mesh)
+{
+    gpu_mesh_t *gm = find_gpu_mesh(cache, mesh);
+    if (!gm)
+    {
+        // Keep the load factor under 1/2 so probe sequences stay short
+        if (2 * (cache->num_entries + 1) > cache->_max_entries)
+            mesh_cache_grow(cache);
+        gpu_mesh_t entry = { .mesh = mesh };
+        gm = mesh_cache_insert(cache, entry);
+        upload_gpu_mesh(cache, gm);
+    }
+    else if (gm->uploaded_revision != mesh->data_revision)
+    {
+        upload_gpu_mesh(cache, gm);
+    }
+    return gm;
+}
+
+/* Frees the GPU resources of a mesh. Needs to be called before freeing a mesh that has been drawn */
+void release_gpu_mesh(mesh_cache_t *cache, mesh_t *mesh)
+{
+    gpu_mesh_t *gm = find_gpu_mesh(cache, mesh);
+    if (!gm)
+        return;
+
+    free_range(&cache->vertex_ranges, gm->base_vertex, gm->allocated_vertices);
+    free_range(&cache->index_ranges, gm->first_index, gm->allocated_indices);
+    cache->resident_bytes -= gpu_mesh_bytes(cache, gm);
+
+    /* Backward shift deletion: move up the entries of the probe sequence that follows
+       so lookups never stop early on the hole we are leaving */
+    uint mask = cache->_max_entries - 1;
+    uint hole = gm - cache->entries;
+    uint i = (hole + 1) & mask;
+    while (cache->entries[i].mesh)
+    {
+        uint home = mesh_cache_slot(cache, cache->entries[i].mesh);
+        // Only move the entry if its home slot is not between the hole and its current slot
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            cache->entries[hole] = cache->entries[i];
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+    memset(&cache->entries[hole], 0, sizeof(gpu_mesh_t));
+    --cache->num_entries;
+}
+
+/* Draws a mesh through the cache with whatever program is currently in use. Its matrices need to go
+   through dequantize_matrix with the dequantize of the mesh's get_gpu_mesh entry */
+void draw_mesh(mesh_cache_t *cache, mesh_t *mesh)
+{
+    // The lookup goes first since uploading may grow the buffers and rebind the VAOs
+    gpu_mesh_t *gm = get_gpu_mesh(cache, mesh);
+    gl_bind_vertex_array(cache->vao);
+    openGL.glDrawElementsBaseVertex(GL_TRIANGLES, gm->num_indices, GL_UNSIGNED_INT,
+                                    (void*)(sizeof(uint32) * gm->first_index), gm->base_vertex);
+}
+
+/* Draws count copies of a mesh in a single call, each one with its own model matrix and colour.
+   The program in use needs the instanceModel and instanceColor attributes. Note that our
+   matrices are row-major, see shaders/simple_color_instanced.vert */
+void draw_mesh_instanced(mesh_cache_t *cache, mesh_t *mesh, mat4x4f *models, vec3f *colours, uint count)
+{
+    if (!count)
+        return;
+
+    gpu_mesh_t *gm = get_gpu_mesh(cache, mesh);
+    gl_bind_vertex_array(cache->instanced_vao);
+
+    // Quantized positions need the way back to model space in every instance matrix
+    if (cache->layout.format[MESH_STREAM_POSITION] != VERTEX_FLOAT)
+    {
+        mat4x4f *dequantized = mesh_cache_scratch(cache, sizeof(mat4x4f) * count);
+        for (uint i = 0; i < count; ++i)
+            dequantized[i] = dequantize_matrix(models[i], gm->dequantize);
+        models = dequantized;
+    }
+
+    /* Orphan and refill the instance buffers so we never wait on draws still using last contents */
+    gl_bind_buffer(GL_ARRAY_BUFFER, cache->instance_model_bo);
+    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(mat4x4f) * count, models, GL_STREAM_DRAW);
+    gl_bind_buffer(GL_ARRAY_BUFFER, cache->instance_colour_bo);
+    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(vec3f) * count, colours, GL_STREAM_DRAW);
+
+    openGL.glDrawElementsInstancedBaseVertex(GL_TRIANGLES, gm->num_indices, GL_UNSIGNED_INT,
+                                             (void*)(sizeof(uint32) * gm->first_index), count, gm->base_vertex);
+}
+
+/* Returns an indirect command drawing a resident mesh once */
+draw_elements_indirect_t make_indirect_draw(gpu_mesh_t *gm, uint base_instance)
+{
+    draw_elements_indirect_t cmd = {
+        .count = gm->num_indices,
+        .instance_count = 1,
+        .first_index = gm->first_index,
+        .base_vertex = gm->base_vertex,
+        .base_instance = base_instance
+    };
+    return cmd;
+}
+
+/* Sends the indirect commands of a frame to the GPU. Only needed when multi-draw indirect is supported */
+void upload_indirect_draws(mesh_cache_t *cache, draw_elements_indirect_t *cmds, uint count)
+{
+    if (!gl_caps.multi_draw_indirect || !count)
+        return;
+    if (!cache->vao)
+        grow_geometry_buffers(cache, 0, 0);
+    gl_bind_buffer(GL_DRAW_INDIRECT_BUFFER, cache->indirect_bo);
+    openGL.glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(draw_elements_indirect_t) * count, cmds, GL_STREAM_DRAW);
+}
+
+/* Makes the drawIndex attribute read from another buffer, e.g. one written by GPU culling.
+   Passing 0 goes back to the static 0, 1, 2... stream */
+void set_draw_index_source(mesh_cache_t *cache, uint bo)
+{
+    if (!cache->vao)
+        grow_geometry_buffers(cache, 0, 0);
+    if (!bo)
+        bo = cache->draw_index_bo;
+    if (cache->draw_index_source == bo)
+        return;
+    cache->draw_index_source = bo;
+    gl_bind_vertex_array(cache->vao);
+    gl_bind_buffer(GL_ARRAY_BUFFER, bo);
+    openGL.glVertexAttribIPointer(ATTRIB_DRAW_INDEX, 1, GL_UNSIGNED_INT, 0, (void*)0);
+}
+
+/* Submits count commands, starting at first, of the ones last given to upload_indirect_draws.
+   Without multi-draw indirect (GL < 4.3) the commands are issued one by one, moving the drawIndex
+   stream to each base instance since 3.2 has no base instance of its own */
+void multi_draw_meshes(mesh_cache_t *cache, draw_elements_indirect_t *cmds, uint first, uint count)
+{
+    gl_bind_vertex_array(cache->vao);
+    if (gl_caps.multi_draw_indirect)
+    {
+        openGL.glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                           (void*)(sizeof(draw_elements_indirect_t) * first), count, 0);
+        return;
+    }
+
+    gl_bind_buffer(GL_ARRAY_BUFFER, cache->draw_index_source);
+    for (uint i = first; i < first + count; ++i)
+    {
+        draw_elements_indirect_t *cmd = &cmds[i];
+        openGL.glVertexAttribIPointer(ATTRIB_DRAW_INDEX, 1, GL_UNSIGNED_INT, 0, (void*)(sizeof(uint32) * cmd->base_instance));
+        openGL.glDrawElementsInstancedBaseVertex(GL_TRIANGLES, cmd->count, GL_UNSIGNED_INT,
+                                                 (void*)(sizeof(uint32) * cmd->first_index), cmd->instance_count, cmd->base_vertex);
+    }
+}
+
+/* Releases every mesh along with the shared buffers */
+void destroy_mesh_cache(mesh_cache_t *cache)
+{
+    if (cache->vao)
+    {
+        uint buffers[] = { cache->vertex_bo, cache->element_bo, cache->instance_model_bo, cache->instance_colour_bo,
+                           cache->draw_index_bo, cache->indirect_bo };
+        gl_delete_buffers(sizeof(buffers)/sizeof(buffers[0]), buffers);
+        uint vaos[] = { cache->vao, cache->instanced_vao };
+        gl_delete_vertex_arrays(2, vaos);
+    }
+    destroy_range_allocator(&cache->vertex_ranges);
+    destroy_range_allocator(&cache->index_ranges);
+    free(cache->entries);
+    free(cache->scratch);
+    memset(cache, 0, sizeof(mesh_cache_t));
+}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef SHINAGE_MESH_OPTIMIZER_H
+#define SHINAGE_MESH_OPTIMIZER_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_scene.h"
+
+/* Reordering of mesh data for the GPU, none of which changes what gets drawn:
+   - welding vertices that are exact copies of each other
+   - triangle order for the post-transform vertex cache, with Tipsify (Sander et al. 2007)
+   - clusters of those triangles reordered so the ones facing out go first, to cut overdraw
+   - vertices in the order the triangles use them, so fetches walk memory forwards */
+
+/* Entries of the FIFO vertex cache we optimize for and measure with. Real hardware varies,
+   anything around this size gets most of the benefit */
+#define VERTEX_CACHE_SIZE 16
+// How much worse than the cache optimized order the overdraw pass may make the ACMR
+#define OVERDRAW_ACMR_THRESHOLD 1.05f
+
+typedef struct
+{
+    uint vertices_welded;
+    float acmr_before, acmr_after; // Average cache miss ratio, vertex shader runs per triangle
+} mesh_optimize_stats_t;
+
+/* Vertex shader invocations per triangle for a FIFO cache of cache_size entries. 3 is the worst
+   case, and around 0.5 the best a regular grid can do */
+float mesh_acmr(uint32 *indices, uint num_indices, uint num_vertices, uint cache_size)
+{
+    if (num_indices < 3)
+        return 0.0f;
+    // A vertex is in the cache until cache_size more misses happened after the one that loaded it
+    uint *loaded = malloc(sizeof(uint) * num_vertices);
+    memset(loaded, 0, sizeof(uint) * num_vertices);
+    uint misses = 0;
+    for (uint i = 0; i < num_indices; ++i)
+    {
+        uint32 v = indices[i];
+        if (!loaded[v] || misses - loaded[v] >= cache_size)
+            loaded[v] = ++misses;
+    }
+    free(loaded);
+    return (float)misses / (num_indices / 3);
+}
+
+/* Triangles around each vertex, as offsets into a flat list */
+typedef struct
+{
+    uint32 *offsets; // num_vertices + 1
+    uint32 *triangles;
+} vertex_triangles_t;
+
+static vertex_triangles_t build_vertex_triangles(uint32 *indices, uint num_indices, uint num_vertices)
+{
+    vertex_triangles_t vt;
+    vt.offsets = calloc(num_vertices + 1, sizeof(uint32));
+    vt.triangles = malloc(sizeof(uint32) * (num_indices + 1));
+    for (uint i = 0; i < num_indices; ++i)
+        ++vt.offsets[indices[i] + 1];
+    for (uint i = 0; i < num_vertices; ++i)
+        vt.offsets[i + 1] += vt.offsets[i];
+    for (uint i = 0; i < num_indices; ++i)
+        vt.triangles[vt.offsets[indices[i]]++] = i / 3;
+    for (uint i = num_vertices; i > 0; --i)
+        vt.offsets[i] = vt.offsets[i - 1];
+    vt.offsets[0] = 0;
+    return vt;
+}
+
+/* Tipsify: fans around a vertex at a time, picking the next one among the vertices just emitted
+   that will still be in the cache after its own fan. Writes the new triangle order to dst and,
+   if clusters is not NULL, the first triangle of each run started from a dead end, the points
+   where the order can be cut without losing any cache hits. Returns the number of clusters */
+uint optimize_vertex_cache(uint32 *dst, uint32 *indices, uint num_indices, uint num_vertices, uint32 *clusters)
+{
+    uint num_triangles = num_indices / 3;
+    vertex_triangles_t vt = build_vertex_triangles(indices, num_indices, num_vertices);
+    uint32 *live = malloc(sizeof(uint32) * num_vertices);
+    uint32 *cache_time = calloc(num_vertices, sizeof(uint32));
+    uint8 *emitted = calloc(num_triangles + 1, 1);
+    uint32 *dead_end = malloc(sizeof(uint32) * (num_indices + 1));
+    uint32 *candidates = malloc(sizeof(uint32) * (num_indices + 1));
+    for (uint v = 0; v < num_vertices; ++v)
+        live[v] = vt.offsets[v + 1] - vt.offsets[v];
+
+    uint timestamp = VERTEX_CACHE_SIZE + 1, cursor = 0, num_dead_end = 0, num_clusters = 0, n = 0;
+    int fan = num_vertices ? 0 : -1;
+    bool new_cluster = true;
+    while (fan >= 0)
+    {
+        if (new_cluster && clusters)
+            clusters[num_clusters++] = n / 3;
+        new_cluster = false;
+
+        uint num_candidates = 0;
+        for (uint i = vt.offsets[fan]; i < vt.offsets[fan + 1]; ++i)
+        {
+            uint32 t = vt.triangles[i];
+            if (emitted[t])
+                continue;
+            emitted[t] = 1;
+            for (uint k = 0; k < 3; ++k)
+            {
+                uint32 v = indices[3 * t + k];
+                dst[n++] = v;
+                dead_end[num_dead_end++] = v;
+                candidates[num_candidates++] = v;
+                --live[v];
+                if (timestamp - cache_time[v] > VERTEX_CACHE_SIZE)
+                    cache_time[v] = timestamp++;
+            }
+        }
+
+        // Best candidate: still has triangles to emit, and will be in the cache after its fan
+        int next = -1, best = -1;
+        for (uint i = 0; i < num_candidates; ++i)
+        {
+            uint32 v = candidates[i];
+            if (!live[v])
+                continue;
+            int priority = 0;
+            if (timestamp - cache_time[v] + 2 * live[v] <= VERTEX_CACHE_SIZE)
+                priority = timestamp - cache_time[v];
+            if (priority > best)
+            {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next < 0)
+        {
+            // Dead end: go back through the recent vertices, then any vertex left
+            while (num_dead_end && next < 0)
+            {
+                uint32 v = dead_end[--num_dead_end];
+                if (live[v])
+                    next = v;
+            }
+            while (next < 0 && cursor < num_vertices)
+            {
+                if (live[cursor])
+                    next = cursor;
+                ++cursor;
+            }
+            new_cluster = true;
+        }
+        fan = next;
+    }
+
+    free(vt.offsets);
+    free(vt.triangles);
+    free(live);
+    free(cache_time);
+    free(emitted);
+    free(dead_end);
+    free(candidates);
+    return num_clusters;
+}
+
+typedef struct
+{
+    uint first, count; // Triangles
+    float sort_key;
+} triangle_cluster_t;
+
+static int compare_triangle_clusters(const void *a, const void *b)
+{
+    const triangle_cluster_t *ca = a, *cb = b;
+    // Descending by key, in the original order for equal keys to stay deterministic
+    if (ca->sort_key != cb->sort_key)
+        return ca->sort_key < cb->sort_key ? 1 : -1;
+    return (ca->first > cb->first) - (ca->first < cb->first);
+}
+
+/* Reorders the clusters of a cache optimized index buffer so the ones facing away from the centre
+   of the mesh go first, which are the ones most likely to hide the rest. Clusters are split
+   further wherever the ACMR of the part up to there is within threshold of the whole mesh, so
+   there are more of them to sort without giving back many cache hits */
+void optimize_overdraw(uint32 *indices, uint num_indices, vec3f *vertices, uint num_vertices,
+                       uint32 *hard_clusters, uint num_hard_clusters, float threshold)
+{
+    uint num_triangles = num_indices / 3;
+    if (num_triangles < 2)
+        return;
+    float target_acmr = mesh_acmr(indices, num_indices, num_vertices, VERTEX_CACHE_SIZE) * threshold;
+
+    // Soft boundaries, simulating the cache from the start of each cluster
+    triangle_cluster_t *clusters = malloc(sizeof(triangle_cluster_t) * num_triangles);
+    uint num_clusters = 0;
+    uint *loaded = calloc(num_vertices, sizeof(uint));
+    uint misses = 0;
+    for (uint c = 0; c < num_hard_clusters; ++c)
+    {
+        uint end = c + 1 < num_hard_clusters ? hard_clusters[c + 1] : num_triangles;
+        uint start = hard_clusters[c], cluster_misses = 0;
+        misses += VERTEX_CACHE_SIZE; // Empties the cache
+        for (uint t = hard_clusters[c]; t < end; ++t)
+        {
+            for (uint k = 0; k < 3; ++k)
+            {
+                uint32 v = indices[3 * t + k];
+                if (!loaded[v] || misses - loaded[v] >= VERTEX_CACHE_SIZE)
+                {
+                    loaded[v] = ++misses;
+                    ++cluster_misses;
+                }
+            }
+            if (t + 1 == end || (float)cluster_misses / (t + 1 - start) <= target_acmr)
+            {
+                clusters[num_clusters].first = start;
+                clusters[num_clusters].count = t + 1 - start;
+                ++num_clusters;
+                start = t + 1;
+                cluster_misses = 0;
+                misses += VERTEX_CACHE_SIZE;
+            }
+        }
+    }
+    free(loaded);
+
+    // Area weighted centroids and normals
+    vec3f mesh_centre = {0};
+    float mesh_area = 0.0f;
+    vec3f *centres = calloc(num_clusters, sizeof(vec3f));
+    vec3f *normals = calloc(num_clusters, sizeof(vec3f));
+    float *areas = calloc(num_clusters, sizeof(float));
+    for (uint c = 0; c < num_clusters; ++c)
+        for (uint t = clusters[c].first; t < clusters[c].first + clusters[c].count; ++t)
+        {
+            vec3f p0 = vertices[indices[3 * t]], p1 = vertices[indices[3 * t + 1]], p2 = vertices[indices[3 * t + 2]];
+            vec3f n = cross_product3f(diff3f(p1, p0), diff3f(p2, p0));
+            float area = length3f(n) * 0.5f;
+            vec3f centre = { .x = (p0.x + p1.x + p2.x) / 3.0f, .y = (p0.y + p1.y + p2.y) / 3.0f, .z = (p0.z + p1.z + p2.z) / 3.0f };
+            centres[c].x += centre.x * area; centres[c].y += centre.y * area; centres[c].z += centre.z * area;
+            normals[c] = sum3f(normals[c], n);
+            areas[c] += area;
+            mesh_centre.x += centre.x * area; mesh_centre.y += centre.y * area; mesh_centre.z += centre.z * area;
+            mesh_area += area;
+        }
+    if (mesh_area > 0.0f)
+    {
+        mesh_centre.x /= mesh_area; mesh_centre.y /= mesh_area; mesh_centre.z /= mesh_area;
+    }
+    for (uint c = 0; c < num_clusters; ++c)
+    {
+        float length = length3f(normals[c]);
+        clusters[c].sort_key = 0.0f;
+        if (areas[c] > 0.0f && length > 0.0f)
+        {
+            vec3f centre = { .x = centres[c].x / areas[c], .y = centres[c].y / areas[c], .z = centres[c].z / areas[c] };
+            clusters[c].sort_key = dot_product3f(diff3f(centre, mesh_centre), normals[c]) / length;
+        }
+    }
+    free(centres);
+    free(normals);
+    free(areas);
+
+    qsort(clusters, num_clusters, sizeof(triangle_cluster_t), compare_triangle_clusters);
+    uint32 *sorted = malloc(sizeof(uint32) * num_triangles * 3);
+    uint n = 0;
+    for (uint c = 0; c < num_clusters; ++c)
+    {
+        memcpy(sorted + n, indices + 3 * clusters[c].first, sizeof(uint32) * 3 * clusters[c].count);
+        n += 3 * clusters[c].count;
+    }
+    memcpy(indices, sorted, sizeof(uint32) * n);
+    free(sorted);
+    free(clusters);
+}
+
+/* Applies a vertex remap to every attribute of a mesh. remap[i] is the new place of vertex i, or
+   ~0u to drop it */
+static void remap_mesh_vertices(mesh_t *mesh, uint32 *remap, uint num_vertices)
+{
+    vec3f *vertices = malloc(sizeof(vec3f) * num_vertices);
+    vec3f *normals = mesh->normals ? malloc(sizeof(vec3f) * num_vertices) : NULL;
+    vec2f *tex_coords = mesh->tex_coords ? malloc(sizeof(vec2f) * num_vertices) : NULL;
+    vec3f *colours = mesh->colours ? malloc(sizeof(vec3f) * num_vertices) : NULL;
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+    {
+        uint32 v = remap[i];
+        if (v == ~0u)
+            continue;
+        vertices[v] = mesh->vertices[i];
+        if (normals)
+            normals[v] = mesh->normals[i];
+        if (tex_coords)
+            tex_coords[v] = mesh->tex_coords[i];
+        if (colours)
+            colours[v] = mesh->colours[i];
+    }
+    free(mesh->vertices);
+    free(mesh->normals);
+    free(mesh->tex_coords);
+    free(mesh->colours);
+    mesh->vertices = vertices;
+    mesh->normals = normals;
+    mesh->tex_coords = tex_coords;
+    mesh->colours = colours;
+    mesh->num_vertices = num_vertices;
+    mesh->_max_vertices = num_vertices;
+    for (uint i = 0; i < mesh->num_indices; ++i)
+        mesh->indices[i] = remap[mesh->indices[i]];
+}
+
+/* All the attributes of a vertex, to compare and hash them at once */
+typedef struct
+{
+    vec3f position, normal, colour;
+    vec2f tex_coord;
+} weld_vertex_t;
+
+static weld_vertex_t get_weld_vertex(mesh_t *mesh, uint i)
+{
+    weld_vertex_t w;
+    memset(&w, 0, sizeof(weld_vertex_t));
+    w.position = mesh->vertices[i];
+    if (mesh->normals)
+        w.normal = mesh->normals[i];
+    if (mesh->colours)
+        w.colour = mesh->colours[i];
+    if (mesh->tex_coords)
+        w.tex_coord = mesh->tex_coords[i];
+    return w;
+}
+
+/* Merges vertices whose attributes are all bit for bit the same. Returns how many went away */
+uint weld_mesh_vertices(mesh_t *mesh)
+{
+    uint capacity = 16;
+    while (capacity < mesh->num_vertices * 2)
+        capacity *= 2;
+    uint32 *table = malloc(sizeof(uint32) * capacity);
+    memset(table, 0xff, sizeof(uint32) * capacity);
+    uint32 *remap = malloc(sizeof(uint32) * (mesh->num_vertices + 1));
+
+    uint num_unique = 0;
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+    {
+        weld_vertex_t w = get_weld_vertex(mesh, i);
+        // FNV-1a over the bytes
+        uint32 hash = 2166136261u;
+        for (uint k = 0; k < sizeof(weld_vertex_t); ++k)
+            hash = (hash ^ ((uint8*)&w)[k]) * 16777619u;
+
+        uint slot = hash & (capacity - 1);
+        remap[i] = ~0u;
+        while (table[slot] != ~0u)
+        {
+            weld_vertex_t other = get_weld_vertex(mesh, table[slot]);
+            if (!memcmp(&w, &other, sizeof(weld_vertex_t)))
+            {
+                remap[i] = remap[table[slot]];
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (remap[i] == ~0u)
+        {
+            table[slot] = i;
+            remap[i] = num_unique++;
+        }
+    }
+    free(table);
+
+    uint welded = mesh->num_vertices - num_unique;
+    if (welded)
+        remap_mesh_vertices(mesh, remap, num_unique);
+    free(remap);
+    return welded;
+}
+
+/* Puts the vertices in the order the index buffer first uses them, dropping unused ones */
+void optimize_vertex_fetch(mesh_t *mesh)
+{
+    uint32 *remap = malloc(sizeof(uint32) * (mesh->num_vertices + 1));
+    memset(remap, 0xff, sizeof(uint32) * mesh->num_vertices);
+    uint num_used = 0;
+    for (uint i = 0; i < mesh->num_indices; ++i)
+        if (remap[mesh->indices[i]] == ~0u)
+            remap[mesh->indices[i]] = num_used++;
+    remap_mesh_vertices(mesh, remap, num_used);
+    free(remap);
+}
+
+/* Runs every pass above over a mesh, in the order that lets each one build on the last */
+mesh_optimize_stats_t optimize_mesh(mesh_t *mesh)
+{
+    mesh_optimize_stats_t stats = {0};
+    mesh->num_indices -= mesh->num_indices % 3;
+    stats.acmr_before = mesh_acmr(mesh->indices, mesh->num_indices, mesh->num_vertices, VERTEX_CACHE_SIZE);
+    stats.vertices_welded = weld_mesh_vertices(mesh);
+
+    uint num_triangles = mesh->num_indices / 3;
+    uint32 *optimized = malloc(sizeof(uint32) * (mesh->num_indices + 1));
+    uint32 *clusters = malloc(sizeof(uint32) * (num_triangles + 1));
+    uint num_clusters = optimize_vertex_cache(optimized, mesh->indices, mesh->num_indices, mesh->num_vertices, clusters);
+    optimize_overdraw(optimized, mesh->num_indices, mesh->vertices, mesh->num_vertices, clusters, num_clusters,
+                      OVERDRAW_ACMR_THRESHOLD);
+    // Meshes small enough to fit in the cache can come out worse, keep those as they were
+    if (mesh_acmr(optimized, mesh->num_indices, mesh->num_vertices, VERTEX_CACHE_SIZE) < stats.acmr_before)
+        memcpy(mesh->indices, optimized, sizeof(uint32) * mesh->num_indices);
+    free(optimized);
+    free(clusters);
+
+    optimize_vertex_fetch(mesh);
+    stats.acmr_after = mesh_acmr(mesh->indices, mesh->num_indices, mesh->num_vertices, VERTEX_CACHE_SIZE);
+    mark_mesh_dirty(mesh);
+    return stats;
+}
+
+/* Optimizes the meshes of every level of detail of a model, logging the ACMR of each */
+void optimize_model_meshes(model_t *model)
+{
+    uint num_levels = model->num_lods ? model->num_lods : 1;
+    for (uint i = 0; i < num_levels; ++i)
+    {
+        mesh_t *meshes = model->num_lods ? model->lods[i].meshes : model->meshes;
+        uint num_meshes = model->num_lods ? model->lods[i].num_meshes : model->num_meshes;
+        for (uint j = 0; j < num_meshes; ++j)
+        {
+            mesh_optimize_stats_t stats = optimize_mesh(&meshes[j]);
+            log_info("Optimized mesh %u of level %u: %u triangles, ACMR %.3f -> %.3f, %u vertices welded", j, i,
+                     meshes[j].num_indices / 3, stats.acmr_before, stats.acmr_after, stats.vertices_welded);
+        }
+    }
+}
+
+#endif
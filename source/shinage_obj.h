@@ -0,0 +1,264 @@
+#ifndef SHINAGE_OBJ_H
+#define SHINAGE_OBJ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_utils.h"
+#include "shinage_scene.h"
+
+/* Wavefront OBJ meshes. Only positions, texture coordinates, normals and faces are read, the
+   faces of every object and group go to a single mesh, and polygons are split in fans */
+
+/* Corner of a face as the 1-based indices written in the file, 0 when missing */
+typedef struct
+{
+    int position, tex_coord, normal;
+} obj_corner_t;
+
+typedef struct
+{
+    uint num_positions, _max_positions;
+    vec3f *positions;
+    uint num_tex_coords, _max_tex_coords;
+    vec2f *tex_coords;
+    uint num_normals, _max_normals;
+    vec3f *normals;
+    // Mesh being built, with a vertex for each different corner
+    uint num_vertices, _max_vertices;
+    obj_corner_t *corners;
+    uint32 *next_in_bucket;
+    uint32 *buckets;
+    uint num_buckets;
+    uint num_indices, _max_indices;
+    uint32 *indices;
+} obj_reader_t;
+
+#define OBJ_NO_VERTEX (~0u)
+
+static void *grow_obj_array(void *array, uint *max, uint count, size_t size)
+{
+    if (count < *max)
+        return array;
+    *max = *max ? *max * 2 : 64;
+    return realloc(array, size * *max);
+}
+
+static uint32 obj_corner_hash(obj_reader_t *r, obj_corner_t c)
+{
+    uint32 h = (uint32)c.position * 73856093u ^ (uint32)c.tex_coord * 19349663u ^ (uint32)c.normal * 83492791u;
+    return h & (r->num_buckets - 1);
+}
+
+/* Vertex for a corner, added if it is the first time we see that combination */
+static uint32 obj_corner_vertex(obj_reader_t *r, obj_corner_t c)
+{
+    if (r->num_vertices * 2 >= r->num_buckets)
+    {
+        r->num_buckets = r->num_buckets ? r->num_buckets * 2 : 1024;
+        r->buckets = realloc(r->buckets, sizeof(uint32) * r->num_buckets);
+        memset(r->buckets, 0xff, sizeof(uint32) * r->num_buckets);
+        for (uint i = 0; i < r->num_vertices; ++i)
+        {
+            uint32 h = obj_corner_hash(r, r->corners[i]);
+            r->next_in_bucket[i] = r->buckets[h];
+            r->buckets[h] = i;
+        }
+    }
+
+    uint32 h = obj_corner_hash(r, c);
+    for (uint32 v = r->buckets[h]; v != OBJ_NO_VERTEX; v = r->next_in_bucket[v])
+        if (!memcmp(&r->corners[v], &c, sizeof(obj_corner_t)))
+            return v;
+
+    if (r->num_vertices == r->_max_vertices)
+    {
+        r->_max_vertices = r->_max_vertices ? r->_max_vertices * 2 : 64;
+        r->corners = realloc(r->corners, sizeof(obj_corner_t) * r->_max_vertices);
+        r->next_in_bucket = realloc(r->next_in_bucket, sizeof(uint32) * r->_max_vertices);
+    }
+    r->corners[r->num_vertices] = c;
+    r->next_in_bucket[r->num_vertices] = r->buckets[h];
+    r->buckets[h] = r->num_vertices;
+    return r->num_vertices++;
+}
+
+/* Turns an index as written in the file, negative ones counting from the end, into a 1-based one.
+   Returns 0 for missing or out of range indices */
+static int resolve_obj_index(long index, uint count)
+{
+    if (index < 0)
+        index += count + 1;
+    return index > 0 && index <= (long)count ? (int)index : 0;
+}
+
+/* Reads the mesh in an OBJ file. Returns NULL if it cannot be read or has no faces */
+mesh_t *load_obj_mesh(char *pathname)
+{
+    char *contents = load_file(pathname);
+    if (!contents)
+        return NULL;
+
+    obj_reader_t r = {0};
+    char *line = contents;
+    while (line && *line)
+    {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+
+        char *p = line;
+        if (!strncmp(p, "v ", 2))
+        {
+            r.positions = grow_obj_array(r.positions, &r._max_positions, r.num_positions, sizeof(vec3f));
+            vec3f *v = &r.positions[r.num_positions++];
+            v->x = strtof(p + 2, &p);
+            v->y = strtof(p, &p);
+            v->z = strtof(p, &p);
+        }
+        else if (!strncmp(p, "vt ", 3))
+        {
+            r.tex_coords = grow_obj_array(r.tex_coords, &r._max_tex_coords, r.num_tex_coords, sizeof(vec2f));
+            vec2f *t = &r.tex_coords[r.num_tex_coords++];
+            t->x = strtof(p + 3, &p);
+            t->y = strtof(p, &p);
+        }
+        else if (!strncmp(p, "vn ", 3))
+        {
+            r.normals = grow_obj_array(r.normals, &r._max_normals, r.num_normals, sizeof(vec3f));
+            vec3f *n = &r.normals[r.num_normals++];
+            n->x = strtof(p + 3, &p);
+            n->y = strtof(p, &p);
+            n->z = strtof(p, &p);
+        }
+        else if (!strncmp(p, "f ", 2))
+        {
+            p += 2;
+            uint32 first = 0, previous = 0;
+            for (uint corners = 0;; ++corners)
+            {
+                char *start = p;
+                obj_corner_t c = {0};
+                c.position = resolve_obj_index(strtol(p, &p, 10), r.num_positions);
+                if (p == start)
+                    break;
+                if (*p == '/')
+                {
+                    if (p[1] != '/')
+                        c.tex_coord = resolve_obj_index(strtol(p + 1, &p, 10), r.num_tex_coords);
+                    else
+                        ++p;
+                    if (*p == '/')
+                        c.normal = resolve_obj_index(strtol(p + 1, &p, 10), r.num_normals);
+                }
+                if (!c.position)
+                {
+                    log_err("Bad face index in %s: %s", pathname, line);
+                    break;
+                }
+
+                uint32 v = obj_corner_vertex(&r, c);
+                if (!corners)
+                    first = v;
+                if (corners >= 2)
+                {
+                    r.indices = grow_obj_array(r.indices, &r._max_indices, r.num_indices + 2, sizeof(uint32));
+                    r.indices[r.num_indices++] = first;
+                    r.indices[r.num_indices++] = previous;
+                    r.indices[r.num_indices++] = v;
+                }
+                previous = v;
+            }
+        }
+        line = end ? end + 1 : NULL;
+    }
+    free(contents);
+
+    mesh_t *mesh = NULL;
+    if (r.num_indices)
+    {
+        mesh = (mesh_t*) calloc(1, sizeof(mesh_t));
+        mesh->num_vertices = r.num_vertices;
+        mesh->num_indices = r.num_indices;
+        mesh->indices = r.indices;
+        r.indices = NULL;
+        mesh->vertices = malloc(sizeof(vec3f) * r.num_vertices);
+        // Attributes only some corners have are left zeroed on the rest
+        if (r.num_tex_coords)
+            mesh->tex_coords = calloc(r.num_vertices, sizeof(vec2f));
+        if (r.num_normals)
+            mesh->normals = calloc(r.num_vertices, sizeof(vec3f));
+        for (uint i = 0; i < r.num_vertices; ++i)
+        {
+            obj_corner_t c = r.corners[i];
+            mesh->vertices[i] = r.positions[c.position - 1];
+            if (c.tex_coord)
+                mesh->tex_coords[i] = r.tex_coords[c.tex_coord - 1];
+            if (c.normal)
+                mesh->normals[i] = r.normals[c.normal - 1];
+        }
+        mesh->model_mat = identity_matrix_4x4;
+        mesh->visible = true;
+        compute_mesh_bounds(mesh);
+    }
+    else
+    {
+        log_err("No faces in %s", pathname);
+    }
+
+    free(r.positions);
+    free(r.tex_coords);
+    free(r.normals);
+    free(r.corners);
+    free(r.next_in_bucket);
+    free(r.buckets);
+    free(r.indices);
+    return mesh;
+}
+
+/* Writes the positions, texture coordinates, normals and triangles of a mesh to an OBJ file */
+bool save_obj_mesh(mesh_t *mesh, char *pathname)
+{
+    FILE *file = fopen(pathname, "w");
+    if (!file)
+    {
+        log_err("Could not open %s for writing", pathname);
+        return false;
+    }
+
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+        fprintf(file, "v %g %g %g\n", mesh->vertices[i].x, mesh->vertices[i].y, mesh->vertices[i].z);
+    if (mesh->tex_coords)
+        for (uint i = 0; i < mesh->num_vertices; ++i)
+            fprintf(file, "vt %g %g\n", mesh->tex_coords[i].x, mesh->tex_coords[i].y);
+    if (mesh->normals)
+        for (uint i = 0; i < mesh->num_vertices; ++i)
+            fprintf(file, "vn %g %g %g\n", mesh->normals[i].x, mesh->normals[i].y, mesh->normals[i].z);
+
+    for (uint i = 0; i + 2 < mesh->num_indices; i += 3)
+    {
+        fprintf(file, "f");
+        for (uint k = 0; k < 3; ++k)
+        {
+            uint32 v = mesh->indices[i + k] + 1;
+            if (mesh->tex_coords && mesh->normals)
+                fprintf(file, " %u/%u/%u", v, v, v);
+            else if (mesh->tex_coords)
+                fprintf(file, " %u/%u", v, v);
+            else if (mesh->normals)
+                fprintf(file, " %u//%u", v, v);
+            else
+                fprintf(file, " %u", v);
+        }
+        fprintf(file, "\n");
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+#endif
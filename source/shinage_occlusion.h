@@ -0,0 +1,327 @@
+#ifndef SHINAGE_OCCLUSION_H
+#define SHINAGE_OCCLUSION_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_culling.h"
+
+/* Coarse depth-only buffer the CPU rasterizes occluders into, so other meshes can be culled before
+   any GL work without waiting on the GPU. It does not store per pixel depths: each 8x8 tile keeps
+   the farthest depth of a layer known to cover it completely (z0) and a working layer being built
+   from the triangles seen so far (z1, with a coverage mask). When the working layer covers the
+   whole tile it becomes the new z0 if nearer. Anything nearer than z0 in a tile may be visible */
+#define OCCLUSION_WIDTH       256
+#define OCCLUSION_HEIGHT      128
+#define OCCLUSION_TILE_SIZE   8
+#define OCCLUSION_TILES_X     (OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y     (OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE)
+#define MAX_OCCLUSION_THREADS 8
+// Below this many triangles rasterizing on a single thread is faster than starting more
+#define OCCLUSION_TRIANGLES_PER_THREAD 64
+// Vertices closer than this in clip space w are clipped away
+#define OCCLUSION_NEAR_W 1e-4f
+
+typedef struct
+{
+    float z0[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+    float z1[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+    uint64 mask[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+    uint num_triangles, _max_triangles;
+    vec3f *triangles; // Three vertices each, x and y in buffer pixels and z as window depth
+    uint num_clip, _max_clip;
+    vec4f *clip;      // Scratch for the clip space vertices of the occluder being added
+    uint num_threads; // Picked from the number of cores on first use
+} occlusion_buffer_t;
+
+void clear_occlusion_buffer(occlusion_buffer_t *ob)
+{
+    for (uint i = 0; i < OCCLUSION_TILES_X * OCCLUSION_TILES_Y; ++i)
+        ob->z0[i] = 1.0f;
+    memset(ob->z1, 0, sizeof(ob->z1));
+    memset(ob->mask, 0, sizeof(ob->mask));
+    ob->num_triangles = 0;
+}
+
+void destroy_occlusion_buffer(occlusion_buffer_t *ob)
+{
+    free(ob->triangles);
+    free(ob->clip);
+    memset(ob, 0, sizeof(occlusion_buffer_t));
+}
+
+static void push_occluder_triangle(occlusion_buffer_t *ob, vec4f a, vec4f b, vec4f c)
+{
+    if (ob->num_triangles == ob->_max_triangles)
+    {
+        ob->_max_triangles = ob->_max_triangles ? ob->_max_triangles * 2 : 256;
+        ob->triangles = realloc(ob->triangles, sizeof(vec3f) * 3 * ob->_max_triangles);
+    }
+    vec4f clip[3] = { a, b, c };
+    vec3f *v = ob->triangles + 3 * ob->num_triangles++;
+    for (uint i = 0; i < 3; ++i)
+    {
+        v[i].x = (clip[i].x / clip[i].w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        v[i].y = (clip[i].y / clip[i].w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        v[i].z = clip[i].z / clip[i].w * 0.5f + 0.5f;
+    }
+}
+
+static inline vec4f lerp_clip_vertex(vec4f a, vec4f b, float t)
+{
+    vec4f v = { .x = a.x + (b.x - a.x) * t, .y = a.y + (b.y - a.y) * t,
+                .z = a.z + (b.z - a.z) * t, .w = a.w + (b.w - a.w) * t };
+    return v;
+}
+
+/* Clips a triangle against the near plane (z = -w), which leaves nothing, the triangle
+   itself, or a quad split in two. The other planes are dealt with when rasterizing */
+static void clip_occluder_triangle(occlusion_buffer_t *ob, vec4f a, vec4f b, vec4f c)
+{
+    vec4f in[3] = { a, b, c }, out[4];
+    uint n = 0;
+    for (uint i = 0; i < 3; ++i)
+    {
+        vec4f p = in[i], q = in[(i + 1) % 3];
+        float dp = p.z + p.w - OCCLUSION_NEAR_W, dq = q.z + q.w - OCCLUSION_NEAR_W;
+        if (dp >= 0.0f)
+            out[n++] = p;
+        if ((dp >= 0.0f) != (dq >= 0.0f))
+            out[n++] = lerp_clip_vertex(p, q, dp / (dp - dq));
+    }
+    if (n >= 3)
+        push_occluder_triangle(ob, out[0], out[1], out[2]);
+    if (n == 4)
+        push_occluder_triangle(ob, out[0], out[2], out[3]);
+}
+
+/* Adds the triangles of an occluder, transformed by its MVP matrix. Call once per occluder
+   after clear_occlusion_buffer, and rasterize_occluders once they are all in */
+void add_occluder(occlusion_buffer_t *ob, mat4x4f mvp, vec3f *vertices, uint num_vertices, uint32 *indices, uint num_indices)
+{
+    if (num_vertices > ob->_max_clip)
+    {
+        ob->_max_clip = num_vertices;
+        ob->clip = realloc(ob->clip, sizeof(vec4f) * ob->_max_clip);
+    }
+    for (uint i = 0; i < num_vertices; ++i)
+    {
+        vec4f v = { .x = vertices[i].x, .y = vertices[i].y, .z = vertices[i].z, .w = 1.0f };
+        ob->clip[i] = mat4x4f_vec4f_prod(mvp, v);
+    }
+    for (uint i = 0; i + 2 < num_indices; i += 3)
+        clip_occluder_triangle(ob, ob->clip[indices[i]], ob->clip[indices[i + 1]], ob->clip[indices[i + 2]]);
+}
+
+/* Which pixel centres of a tile are inside all three edges, a bit per pixel, row by row.
+   Edge i is a[i] * x + b[i] * y + c[i] >= 0, with x and y relative to the first pixel of the tile */
+static inline uint64 occlusion_tile_coverage(float a[3], float b[3], float c[3])
+{
+    uint64 mask = 0;
+#if CULL_LANES == 8
+    __m256 xs = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    __m256 e[3];
+    for (uint i = 0; i < 3; ++i)
+        e[i] = _mm256_mul_ps(_mm256_set1_ps(a[i]), xs);
+    for (uint row = 0; row < OCCLUSION_TILE_SIZE; ++row)
+    {
+        float y = row + 0.5f;
+        __m256 inside = _mm256_cmp_ps(_mm256_add_ps(e[0], _mm256_set1_ps(b[0] * y + c[0])), _mm256_setzero_ps(), _CMP_GE_OQ);
+        for (uint i = 1; i < 3; ++i)
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(e[i], _mm256_set1_ps(b[i] * y + c[i])), _mm256_setzero_ps(), _CMP_GE_OQ));
+        mask |= (uint64)_mm256_movemask_ps(inside) << (row * OCCLUSION_TILE_SIZE);
+    }
+#elif CULL_LANES == 4
+    __m128 xs = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 e[3], e4[3];
+    for (uint i = 0; i < 3; ++i)
+    {
+        e[i] = _mm_mul_ps(_mm_set1_ps(a[i]), xs);
+        e4[i] = _mm_add_ps(e[i], _mm_set1_ps(a[i] * 4.0f));
+    }
+    for (uint row = 0; row < OCCLUSION_TILE_SIZE; ++row)
+    {
+        float y = row + 0.5f;
+        __m128 lo = _mm_cmpge_ps(_mm_add_ps(e[0], _mm_set1_ps(b[0] * y + c[0])), _mm_setzero_ps());
+        __m128 hi = _mm_cmpge_ps(_mm_add_ps(e4[0], _mm_set1_ps(b[0] * y + c[0])), _mm_setzero_ps());
+        for (uint i = 1; i < 3; ++i)
+        {
+            __m128 row_c = _mm_set1_ps(b[i] * y + c[i]);
+            lo = _mm_and_ps(lo, _mm_cmpge_ps(_mm_add_ps(e[i], row_c), _mm_setzero_ps()));
+            hi = _mm_and_ps(hi, _mm_cmpge_ps(_mm_add_ps(e4[i], row_c), _mm_setzero_ps()));
+        }
+        uint64 bits = _mm_movemask_ps(lo) | (_mm_movemask_ps(hi) << 4);
+        mask |= bits << (row * OCCLUSION_TILE_SIZE);
+    }
+#else
+    for (uint row = 0; row < OCCLUSION_TILE_SIZE; ++row)
+        for (uint col = 0; col < OCCLUSION_TILE_SIZE; ++col)
+        {
+            float x = col + 0.5f, y = row + 0.5f;
+            if (a[0] * x + b[0] * y + c[0] >= 0.0f && a[1] * x + b[1] * y + c[1] >= 0.0f && a[2] * x + b[2] * y + c[2] >= 0.0f)
+                mask |= 1ull << (row * OCCLUSION_TILE_SIZE + col);
+        }
+#endif
+    return mask;
+}
+
+/* Merges the pixels a triangle covers in a tile, all of them at most depth away */
+static inline void update_occlusion_tile(occlusion_buffer_t *ob, uint tile, uint64 coverage, float depth)
+{
+    if (!coverage || depth >= ob->z0[tile])
+        return;
+    ob->z1[tile] = ob->mask[tile] ? fmaxf(ob->z1[tile], depth) : depth;
+    ob->mask[tile] |= coverage;
+    if (ob->mask[tile] == ~0ull)
+    {
+        ob->z0[tile] = fminf(ob->z0[tile], ob->z1[tile]);
+        ob->mask[tile] = 0;
+    }
+}
+
+/* Floor of a coordinate in tiles, clamped to [-1, count] so it can always be cast */
+static inline int occlusion_tile_index(float t, int count)
+{
+    return (int)fminf(fmaxf(floorf(t), -1.0f), (float)count);
+}
+
+/* Rasterizes a triangle into the tile rows [first_row, end_row). Depth is taken as constant at the
+   farthest vertex, which keeps the buffer conservative without interpolating anything */
+static void rasterize_occluder_triangle(occlusion_buffer_t *ob, vec3f *v, int first_row, int end_row)
+{
+    float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+    if (area == 0.0f)
+        return;
+    float depth = fmaxf(v[0].z, fmaxf(v[1].z, v[2].z));
+
+    float min_x = fminf(v[0].x, fminf(v[1].x, v[2].x)), max_x = fmaxf(v[0].x, fmaxf(v[1].x, v[2].x));
+    float min_y = fminf(v[0].y, fminf(v[1].y, v[2].y)), max_y = fmaxf(v[0].y, fmaxf(v[1].y, v[2].y));
+    int tx0 = occlusion_tile_index(min_x / OCCLUSION_TILE_SIZE, OCCLUSION_TILES_X);
+    int tx1 = occlusion_tile_index(max_x / OCCLUSION_TILE_SIZE, OCCLUSION_TILES_X);
+    int ty0 = occlusion_tile_index(min_y / OCCLUSION_TILE_SIZE, OCCLUSION_TILES_Y);
+    int ty1 = occlusion_tile_index(max_y / OCCLUSION_TILE_SIZE, OCCLUSION_TILES_Y);
+    tx0 = tx0 < 0 ? 0 : tx0;
+    tx1 = tx1 > OCCLUSION_TILES_X - 1 ? OCCLUSION_TILES_X - 1 : tx1;
+    ty0 = ty0 < first_row ? first_row : ty0;
+    ty1 = ty1 > end_row - 1 ? end_row - 1 : ty1;
+
+    // Edge i goes from vertex i to the next one, flipped so the inside is positive for either winding.
+    // Clipped triangles can reach far out of the buffer, so the constant is worked out in double
+    // at each tile to keep the precision near the edges
+    double sign = area > 0.0f ? 1.0 : -1.0;
+    float a[3], b[3], c[3];
+    double c_origin[3];
+    for (uint i = 0; i < 3; ++i)
+    {
+        vec3f p = v[i], q = v[(i + 1) % 3];
+        a[i] = sign * (p.y - q.y);
+        b[i] = sign * (q.x - p.x);
+        c_origin[i] = sign * ((double)p.x * q.y - (double)p.y * q.x);
+    }
+
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+        {
+            uint tile = ty * OCCLUSION_TILES_X + tx;
+            if (depth >= ob->z0[tile])
+                continue;
+            for (uint i = 0; i < 3; ++i)
+                c[i] = c_origin[i] + (double)a[i] * tx * OCCLUSION_TILE_SIZE + (double)b[i] * ty * OCCLUSION_TILE_SIZE;
+            update_occlusion_tile(ob, tile, occlusion_tile_coverage(a, b, c), depth);
+        }
+}
+
+typedef struct
+{
+    occlusion_buffer_t *ob;
+    int first_row, end_row;
+} occlusion_band_t;
+
+static void *rasterize_occlusion_band(void *arg)
+{
+    occlusion_band_t *band = arg;
+    for (uint i = 0; i < band->ob->num_triangles; ++i)
+        rasterize_occluder_triangle(band->ob, band->ob->triangles + 3 * i, band->first_row, band->end_row);
+    return NULL;
+}
+
+/* Rasterizes every occluder added since the last clear. The tile rows are split in bands, one per
+   thread, each going through all the triangles. Threads only live for the call, so the game code
+   can be reloaded at any time */
+void rasterize_occluders(occlusion_buffer_t *ob)
+{
+    if (!ob->num_threads)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        ob->num_threads = cores < 1 ? 1 : cores > MAX_OCCLUSION_THREADS ? MAX_OCCLUSION_THREADS : (uint)cores;
+    }
+    uint threads = ob->num_triangles / OCCLUSION_TRIANGLES_PER_THREAD;
+    if (threads > ob->num_threads)
+        threads = ob->num_threads;
+    if (threads < 1)
+        threads = 1;
+
+    occlusion_band_t bands[MAX_OCCLUSION_THREADS];
+    pthread_t handles[MAX_OCCLUSION_THREADS];
+    bool started[MAX_OCCLUSION_THREADS] = { false };
+    for (uint i = 0; i < threads; ++i)
+    {
+        bands[i].ob = ob;
+        bands[i].first_row = OCCLUSION_TILES_Y * i / threads;
+        bands[i].end_row = OCCLUSION_TILES_Y * (i + 1) / threads;
+    }
+    // The first band goes on this thread, and so does any band we fail to start a thread for
+    for (uint i = 1; i < threads; ++i)
+        started[i] = !pthread_create(&handles[i], NULL, rasterize_occlusion_band, &bands[i]);
+    rasterize_occlusion_band(&bands[0]);
+    for (uint i = 1; i < threads; ++i)
+    {
+        if (started[i])
+            pthread_join(handles[i], NULL);
+        else
+            rasterize_occlusion_band(&bands[i]);
+    }
+}
+
+/* Whether any part of a box, given by its corners in model space, may be visible past the occluders.
+   Boxes crossing the near plane or off screen are left to the frustum culling and count as visible */
+bool occlusion_box_visible(occlusion_buffer_t *ob, mat4x4f mvp, vec3f min, vec3f max)
+{
+    float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY, nearest = INFINITY;
+    for (uint i = 0; i < 8; ++i)
+    {
+        vec4f corner = { .x = (i & 1) ? max.x : min.x, .y = (i & 2) ? max.y : min.y, .z = (i & 4) ? max.z : min.z, .w = 1.0f };
+        vec4f clip = mat4x4f_vec4f_prod(mvp, corner);
+        if (clip.w <= OCCLUSION_NEAR_W)
+            return true;
+        min_x = fminf(min_x, clip.x / clip.w);
+        max_x = fmaxf(max_x, clip.x / clip.w);
+        min_y = fminf(min_y, clip.y / clip.w);
+        max_y = fmaxf(max_y, clip.y / clip.w);
+        nearest = fminf(nearest, clip.z / clip.w);
+    }
+    nearest = nearest * 0.5f + 0.5f;
+
+    int tx0 = occlusion_tile_index((min_x * 0.5f + 0.5f) * OCCLUSION_TILES_X, OCCLUSION_TILES_X);
+    int tx1 = occlusion_tile_index((max_x * 0.5f + 0.5f) * OCCLUSION_TILES_X, OCCLUSION_TILES_X);
+    int ty0 = occlusion_tile_index((min_y * 0.5f + 0.5f) * OCCLUSION_TILES_Y, OCCLUSION_TILES_Y);
+    int ty1 = occlusion_tile_index((max_y * 0.5f + 0.5f) * OCCLUSION_TILES_Y, OCCLUSION_TILES_Y);
+    if (tx1 < 0 || ty1 < 0 || tx0 >= OCCLUSION_TILES_X || ty0 >= OCCLUSION_TILES_Y)
+        return true;
+    tx0 = tx0 < 0 ? 0 : tx0;
+    ty0 = ty0 < 0 ? 0 : ty0;
+    tx1 = tx1 >= OCCLUSION_TILES_X ? OCCLUSION_TILES_X - 1 : tx1;
+    ty1 = ty1 >= OCCLUSION_TILES_Y ? OCCLUSION_TILES_Y - 1 : ty1;
+
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+            if (nearest <= ob->z0[ty * OCCLUSION_TILES_X + tx])
+                return true;
+    return false;
+}
+
+#endif
@@ -14,6 +14,7 @@ typedef struct {
     PFNGLCREATESHADERPROC            glCreateShader;
     PFNGLCREATEPROGRAMPROC           glCreateProgram;
     PFNGLDELETESHADERPROC            glDeleteShader;
+    PFNGLDELETEPROGRAMPROC           glDeleteProgram;
     PFNGLGETPROGRAMIVPROC            glGetProgramiv;
     PFNGLGETPROGRAMINFOLOGPROC       glGetProgramInfoLog;
     PFNGLATTACHSHADERPROC            glAttachShader;
@@ -30,15 +31,211 @@ typedef struct {
     PFNGLUNIFORM3FPROC               glUniform3f;
     PFNGLGETUNIFORMLOCATIONPROC      glGetUniformLocation;
     PFNGLUNIFORMMATRIX4FVPROC        glUniformMatrix4fv;
+    PFNGLUNIFORMMATRIX3FVPROC        glUniformMatrix3fv;
     PFNGLUNIFORM1IPROC               glUniform1i;
     PFNGLVERTEXATTRIBDIVISORPROC     glVertexAttribDivisor;
     PFNGLDRAWARRAYSINSTANCEDPROC     glDrawArraysInstanced;
     PFNGLBUFFERSUBDATAPROC           glBufferSubData;
     PFNGLGENERATEMIPMAPPROC          glGenerateMipmap;
+    PFNGLDELETEBUFFERSPROC           glDeleteBuffers;
+    PFNGLDELETEVERTEXARRAYSPROC      glDeleteVertexArrays;
+    PFNGLBINDATTRIBLOCATIONPROC      glBindAttribLocation;
+    PFNGLDRAWELEMENTSINSTANCEDPROC   glDrawElementsInstanced;
+    PFNGLGETUNIFORMBLOCKINDEXPROC    glGetUniformBlockIndex;
+    PFNGLUNIFORMBLOCKBINDINGPROC     glUniformBlockBinding;
+    PFNGLBINDBUFFERBASEPROC          glBindBufferBase;
+    PFNGLDRAWELEMENTSBASEVERTEXPROC  glDrawElementsBaseVertex;
+    PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC glDrawElementsInstancedBaseVertex;
+    PFNGLCOPYBUFFERSUBDATAPROC       glCopyBufferSubData;
+    PFNGLTEXBUFFERPROC               glTexBuffer;
+    PFNGLMULTIDRAWELEMENTSINDIRECTPROC glMultiDrawElementsIndirect; // 4.3, check gl_caps first
+    PFNGLDISPATCHCOMPUTEPROC         glDispatchCompute;                 // 4.3
+    PFNGLMEMORYBARRIERPROC           glMemoryBarrier;                   // 4.2
+    PFNGLUNIFORM4FVPROC              glUniform4fv;
+    PFNGLUNIFORM1UIPROC              glUniform1ui;
+    PFNGLBINDIMAGETEXTUREPROC        glBindImageTexture;                // 4.2
+    PFNGLGETBUFFERSUBDATAPROC        glGetBufferSubData;
+    PFNGLGENFRAMEBUFFERSPROC         glGenFramebuffers;
+    PFNGLBINDFRAMEBUFFERPROC         glBindFramebuffer;
+    PFNGLFRAMEBUFFERTEXTURE2DPROC    glFramebufferTexture2D;
+    PFNGLCHECKFRAMEBUFFERSTATUSPROC  glCheckFramebufferStatus;
+    PFNGLDELETEFRAMEBUFFERSPROC      glDeleteFramebuffers;
+    PFNGLDRAWBUFFERSPROC             glDrawBuffers;
+    PFNGLBINDFRAGDATALOCATIONPROC    glBindFragDataLocation;
+    PFNGLFENCESYNCPROC               glFenceSync;
+    PFNGLCLIENTWAITSYNCPROC          glClientWaitSync;
+    PFNGLDELETESYNCPROC              glDeleteSync;
 } openGL_function_pointers;
 
 openGL_function_pointers openGL;
 
+/* What the context we got can do beyond the 3.2 we ask for. Drivers usually give us the newest
+   version they support, so the faster paths are picked at runtime */
+typedef struct {
+    int major, minor;
+    int multi_draw_indirect;     // glMultiDrawElementsIndirect with per-command base instances
+    int compute_shaders;         // Compute programs and shader storage buffers
+    int max_texture_buffer_size; // In texels
+} gl_caps_t;
+
+gl_caps_t gl_caps;
+
+void query_gl_caps(void)
+{
+    glGetIntegerv(GL_MAJOR_VERSION, &gl_caps.major);
+    glGetIntegerv(GL_MINOR_VERSION, &gl_caps.minor);
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &gl_caps.max_texture_buffer_size);
+    int gl_4_3 = gl_caps.major > 4 || (gl_caps.major == 4 && gl_caps.minor >= 3);
+    gl_caps.multi_draw_indirect = gl_4_3 && openGL.glMultiDrawElementsIndirect;
+    gl_caps.compute_shaders = gl_4_3 && openGL.glDispatchCompute && openGL.glMemoryBarrier && openGL.glBindImageTexture;
+}
+
+/* Shadow copy of the bindings and capabilities we change the most, so calls that would not
+   change anything are skipped. Code changing these behind its back needs to call invalidate_gl_state.
+   Only the program, the VAO, the buffer targets below and the capabilities below are tracked. Texture
+   units and the blend function go straight to GL: code binding textures selects its unit with
+   glActiveTexture first and goes back to unit 0 when done, which is where texture creation binds */
+#define GL_STATE_UNKNOWN 0xFFFFFFFFu
+
+typedef enum {
+    GL_STATE_ARRAY_BUFFER,
+    GL_STATE_ELEMENT_ARRAY_BUFFER, // Part of the VAO state, so it is forgotten on VAO changes
+    GL_STATE_UNIFORM_BUFFER,
+    GL_STATE_DRAW_INDIRECT_BUFFER,
+    NUM_GL_STATE_BUFFERS
+} gl_state_buffer_t;
+
+typedef enum {
+    GL_STATE_DEPTH_TEST,
+    GL_STATE_BLEND,
+    GL_STATE_CULL_FACE,
+    NUM_GL_STATE_CAPS
+} gl_state_cap_t;
+
+typedef struct {
+    GLuint program;
+    GLuint vao;
+    GLuint buffers[NUM_GL_STATE_BUFFERS];
+    GLuint caps[NUM_GL_STATE_CAPS]; // GL_TRUE, GL_FALSE or GL_STATE_UNKNOWN
+    unsigned int issued_calls;      // Counters, reset by whoever wants per-frame numbers
+    unsigned int elided_calls;
+} gl_state_t;
+
+gl_state_t gl_state;
+
+/* Forgets everything we know about the GL state, so the next call of each kind goes through */
+void invalidate_gl_state(void)
+{
+    gl_state.program = GL_STATE_UNKNOWN;
+    gl_state.vao = GL_STATE_UNKNOWN;
+    for (int i = 0; i < NUM_GL_STATE_BUFFERS; ++i)
+        gl_state.buffers[i] = GL_STATE_UNKNOWN;
+    for (int i = 0; i < NUM_GL_STATE_CAPS; ++i)
+        gl_state.caps[i] = GL_STATE_UNKNOWN;
+}
+
+/* Returns true, and counts it, if the shadowed value needs to change */
+static inline int gl_state_changes(GLuint *shadow, GLuint value)
+{
+    if (*shadow == value)
+    {
+        ++gl_state.elided_calls;
+        return 0;
+    }
+    *shadow = value;
+    ++gl_state.issued_calls;
+    return 1;
+}
+
+static inline int gl_state_buffer_index(GLenum target)
+{
+    switch (target)
+    {
+    case GL_ARRAY_BUFFER:         return GL_STATE_ARRAY_BUFFER;
+    case GL_ELEMENT_ARRAY_BUFFER: return GL_STATE_ELEMENT_ARRAY_BUFFER;
+    case GL_UNIFORM_BUFFER:       return GL_STATE_UNIFORM_BUFFER;
+    case GL_DRAW_INDIRECT_BUFFER: return GL_STATE_DRAW_INDIRECT_BUFFER;
+    default:                      return -1;
+    }
+}
+
+static inline int gl_state_cap_index(GLenum cap)
+{
+    switch (cap)
+    {
+    case GL_DEPTH_TEST: return GL_STATE_DEPTH_TEST;
+    case GL_BLEND:      return GL_STATE_BLEND;
+    case GL_CULL_FACE:  return GL_STATE_CULL_FACE;
+    default:            return -1;
+    }
+}
+
+static inline void gl_use_program(GLuint program)
+{
+    if (gl_state_changes(&gl_state.program, program))
+        openGL.glUseProgram(program);
+}
+
+static inline void gl_bind_vertex_array(GLuint vao)
+{
+    if (gl_state_changes(&gl_state.vao, vao))
+    {
+        openGL.glBindVertexArray(vao);
+        gl_state.buffers[GL_STATE_ELEMENT_ARRAY_BUFFER] = GL_STATE_UNKNOWN;
+    }
+}
+
+static inline void gl_bind_buffer(GLenum target, GLuint buffer)
+{
+    int i = gl_state_buffer_index(target);
+    if (i < 0 || gl_state_changes(&gl_state.buffers[i], buffer))
+        openGL.glBindBuffer(target, buffer);
+}
+
+/* Also binds the buffer to the generic binding point of the target */
+static inline void gl_bind_buffer_base(GLenum target, GLuint index, GLuint buffer)
+{
+    int i = gl_state_buffer_index(target);
+    if (i >= 0)
+        gl_state.buffers[i] = buffer;
+    openGL.glBindBufferBase(target, index, buffer);
+}
+
+/* Deleted buffers and VAOs are unbound by GL, so our copy has to follow */
+static inline void gl_delete_buffers(GLsizei n, const GLuint *buffers)
+{
+    for (GLsizei b = 0; b < n; ++b)
+        for (int i = 0; i < NUM_GL_STATE_BUFFERS; ++i)
+            if (buffers[b] && gl_state.buffers[i] == buffers[b])
+                gl_state.buffers[i] = 0;
+    openGL.glDeleteBuffers(n, buffers);
+}
+
+static inline void gl_delete_vertex_arrays(GLsizei n, const GLuint *vaos)
+{
+    for (GLsizei i = 0; i < n; ++i)
+        if (vaos[i] && gl_state.vao == vaos[i])
+        {
+            gl_state.vao = 0;
+            gl_state.buffers[GL_STATE_ELEMENT_ARRAY_BUFFER] = GL_STATE_UNKNOWN;
+        }
+    openGL.glDeleteVertexArrays(n, vaos);
+}
+
+static inline void gl_enable(GLenum cap)
+{
+    int i = gl_state_cap_index(cap);
+    if (i < 0 || gl_state_changes(&gl_state.caps[i], GL_TRUE))
+        glEnable(cap);
+}
+
+static inline void gl_disable(GLenum cap)
+{
+    int i = gl_state_cap_index(cap);
+    if (i < 0 || gl_state_changes(&gl_state.caps[i], GL_FALSE))
+        glDisable(cap);
+}
+
 #ifdef __linux__
 
 int link_gl_functions(void)
@@ -52,6 +249,7 @@ int link_gl_functions(void)
     openGL.glCreateShader            = (PFNGLCREATESHADERPROC)           glXGetProcAddress((const GLubyte *)"glCreateShader");
     openGL.glCreateProgram           = (PFNGLCREATEPROGRAMPROC)          glXGetProcAddress((const GLubyte *)"glCreateProgram");
     openGL.glDeleteShader            = (PFNGLDELETESHADERPROC)           glXGetProcAddress((const GLubyte *)"glDeleteShader");
+    openGL.glDeleteProgram           = (PFNGLDELETEPROGRAMPROC)          glXGetProcAddress((const GLubyte *)"glDeleteProgram");
     openGL.glGetProgramiv            = (PFNGLGETPROGRAMIVPROC)           glXGetProcAddress((const GLubyte *)"glGetProgramiv");
     openGL.glGetProgramInfoLog       = (PFNGLGETPROGRAMINFOLOGPROC)      glXGetProcAddress((const GLubyte *)"glGetProgramInfoLog");
     openGL.glAttachShader            = (PFNGLATTACHSHADERPROC)           glXGetProcAddress((const GLubyte *)"glAttachShader");
@@ -68,15 +266,49 @@ int link_gl_functions(void)
     openGL.glUniform3f               = (PFNGLUNIFORM3FPROC)              glXGetProcAddress((const GLubyte *)"glUniform3f");
     openGL.glGetUniformLocation      = (PFNGLGETUNIFORMLOCATIONPROC)     glXGetProcAddress((const GLubyte *)"glGetUniformLocation");
     openGL.glUniformMatrix4fv        = (PFNGLUNIFORMMATRIX4FVPROC)       glXGetProcAddress((const GLubyte *)"glUniformMatrix4fv");
+    openGL.glUniformMatrix3fv        = (PFNGLUNIFORMMATRIX3FVPROC)       glXGetProcAddress((const GLubyte *)"glUniformMatrix3fv");
     openGL.glUniform1i               = (PFNGLUNIFORM1IPROC)              glXGetProcAddress((const GLubyte *)"glUniform1i");
     openGL.glVertexAttribDivisor     = (PFNGLVERTEXATTRIBDIVISORPROC)    glXGetProcAddress((const GLubyte *)"glVertexAttribDivisor");
     openGL.glDrawArraysInstanced     = (PFNGLDRAWARRAYSINSTANCEDPROC)    glXGetProcAddress((const GLubyte *)"glDrawArraysInstanced");
     openGL.glBufferSubData           = (PFNGLBUFFERSUBDATAPROC)          glXGetProcAddress((const GLubyte *)"glBufferSubData");
     openGL.glGenerateMipmap          = (PFNGLGENERATEMIPMAPPROC)         glXGetProcAddress((const GLubyte *)"glGenerateMipmap");
+    openGL.glDeleteBuffers           = (PFNGLDELETEBUFFERSPROC)          glXGetProcAddress((const GLubyte *)"glDeleteBuffers");
+    openGL.glDeleteVertexArrays      = (PFNGLDELETEVERTEXARRAYSPROC)     glXGetProcAddress((const GLubyte *)"glDeleteVertexArrays");
+    openGL.glBindAttribLocation      = (PFNGLBINDATTRIBLOCATIONPROC)     glXGetProcAddress((const GLubyte *)"glBindAttribLocation");
+    openGL.glDrawElementsInstanced   = (PFNGLDRAWELEMENTSINSTANCEDPROC)  glXGetProcAddress((const GLubyte *)"glDrawElementsInstanced");
+    openGL.glGetUniformBlockIndex    = (PFNGLGETUNIFORMBLOCKINDEXPROC)   glXGetProcAddress((const GLubyte *)"glGetUniformBlockIndex");
+    openGL.glUniformBlockBinding     = (PFNGLUNIFORMBLOCKBINDINGPROC)    glXGetProcAddress((const GLubyte *)"glUniformBlockBinding");
+    openGL.glBindBufferBase          = (PFNGLBINDBUFFERBASEPROC)         glXGetProcAddress((const GLubyte *)"glBindBufferBase");
+    openGL.glDrawElementsBaseVertex  = (PFNGLDRAWELEMENTSBASEVERTEXPROC) glXGetProcAddress((const GLubyte *)"glDrawElementsBaseVertex");
+    openGL.glDrawElementsInstancedBaseVertex = (PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC)glXGetProcAddress((const GLubyte *)"glDrawElementsInstancedBaseVertex");
+    openGL.glCopyBufferSubData       = (PFNGLCOPYBUFFERSUBDATAPROC)      glXGetProcAddress((const GLubyte *)"glCopyBufferSubData");
+    openGL.glTexBuffer               = (PFNGLTEXBUFFERPROC)              glXGetProcAddress((const GLubyte *)"glTexBuffer");
+    openGL.glMultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC)glXGetProcAddress((const GLubyte *)"glMultiDrawElementsIndirect");
+    openGL.glDispatchCompute         = (PFNGLDISPATCHCOMPUTEPROC)        glXGetProcAddress((const GLubyte *)"glDispatchCompute");
+    openGL.glMemoryBarrier           = (PFNGLMEMORYBARRIERPROC)          glXGetProcAddress((const GLubyte *)"glMemoryBarrier");
+    openGL.glUniform4fv              = (PFNGLUNIFORM4FVPROC)             glXGetProcAddress((const GLubyte *)"glUniform4fv");
+    openGL.glUniform1ui              = (PFNGLUNIFORM1UIPROC)             glXGetProcAddress((const GLubyte *)"glUniform1ui");
+    openGL.glBindImageTexture        = (PFNGLBINDIMAGETEXTUREPROC)       glXGetProcAddress((const GLubyte *)"glBindImageTexture");
+    openGL.glGetBufferSubData        = (PFNGLGETBUFFERSUBDATAPROC)       glXGetProcAddress((const GLubyte *)"glGetBufferSubData");
+    openGL.glGenFramebuffers         = (PFNGLGENFRAMEBUFFERSPROC)        glXGetProcAddress((const GLubyte *)"glGenFramebuffers");
+    openGL.glBindFramebuffer         = (PFNGLBINDFRAMEBUFFERPROC)        glXGetProcAddress((const GLubyte *)"glBindFramebuffer");
+    openGL.glFramebufferTexture2D    = (PFNGLFRAMEBUFFERTEXTURE2DPROC)   glXGetProcAddress((const GLubyte *)"glFramebufferTexture2D");
+    openGL.glCheckFramebufferStatus  = (PFNGLCHECKFRAMEBUFFERSTATUSPROC) glXGetProcAddress((const GLubyte *)"glCheckFramebufferStatus");
+    openGL.glDeleteFramebuffers      = (PFNGLDELETEFRAMEBUFFERSPROC)     glXGetProcAddress((const GLubyte *)"glDeleteFramebuffers");
+    openGL.glDrawBuffers             = (PFNGLDRAWBUFFERSPROC)            glXGetProcAddress((const GLubyte *)"glDrawBuffers");
+    openGL.glBindFragDataLocation    = (PFNGLBINDFRAGDATALOCATIONPROC)   glXGetProcAddress((const GLubyte *)"glBindFragDataLocation");
+    openGL.glFenceSync               = (PFNGLFENCESYNCPROC)              glXGetProcAddress((const GLubyte *)"glFenceSync");
+    openGL.glClientWaitSync          = (PFNGLCLIENTWAITSYNCPROC)         glXGetProcAddress((const GLubyte *)"glClientWaitSync");
+    openGL.glDeleteSync              = (PFNGLDELETESYNCPROC)             glXGetProcAddress((const GLubyte *)"glDeleteSync");
 
+    invalidate_gl_state();
+    // Each binary links once, the game library again on every reload; the capabilities do not change
+    if (!gl_caps.major)
+        query_gl_caps();
     return 1;
 }
 #else
 #error "Windows version WIP"
 #endif
+
 #endif
@@ -0,0 +1,110 @@
+#ifndef SHINAGE_RANGE_ALLOCATOR_H
+#define SHINAGE_RANGE_ALLOCATOR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+
+#define INVALID_RANGE 0xFFFFFFFFu
+
+typedef struct
+{
+    uint offset, size;
+} range_t;
+
+/* Hands out ranges of a linear space of capacity units, e.g. vertices of a GPU buffer.
+   Free ranges are kept sorted by offset so neighbours are merged back when freed */
+typedef struct
+{
+    uint capacity;
+    uint num_free, _max_free;
+    range_t *free;
+} range_allocator_t;
+
+static void insert_free_range(range_allocator_t *a, uint index, range_t range)
+{
+    if (a->num_free == a->_max_free)
+    {
+        a->_max_free = a->_max_free ? a->_max_free * 2 : 64;
+        a->free = realloc(a->free, sizeof(range_t) * a->_max_free);
+    }
+    memmove(a->free + index + 1, a->free + index, sizeof(range_t) * (a->num_free - index));
+    a->free[index] = range;
+    ++a->num_free;
+}
+
+static void remove_free_range(range_allocator_t *a, uint index)
+{
+    memmove(a->free + index, a->free + index + 1, sizeof(range_t) * (a->num_free - index - 1));
+    --a->num_free;
+}
+
+/* Returns the offset of a new range of size units, or INVALID_RANGE if no free range is big enough.
+   Takes the smallest free range that fits, so big ones stay around for big meshes */
+uint alloc_range(range_allocator_t *a, uint size)
+{
+    uint best = INVALID_RANGE;
+    for (uint i = 0; i < a->num_free; ++i)
+        if (a->free[i].size >= size && (best == INVALID_RANGE || a->free[i].size < a->free[best].size))
+            best = i;
+    if (best == INVALID_RANGE)
+        return INVALID_RANGE;
+
+    uint offset = a->free[best].offset;
+    a->free[best].offset += size;
+    a->free[best].size -= size;
+    if (!a->free[best].size)
+        remove_free_range(a, best);
+    return offset;
+}
+
+/* Gives a range back, merging it with the free ranges right before and after it */
+void free_range(range_allocator_t *a, uint offset, uint size)
+{
+    if (!size)
+        return;
+
+    uint i = 0;
+    while (i < a->num_free && a->free[i].offset < offset)
+        ++i;
+
+    bool merges_prev = i > 0 && a->free[i - 1].offset + a->free[i - 1].size == offset;
+    bool merges_next = i < a->num_free && offset + size == a->free[i].offset;
+    if (merges_prev && merges_next)
+    {
+        a->free[i - 1].size += size + a->free[i].size;
+        remove_free_range(a, i);
+    }
+    else if (merges_prev)
+    {
+        a->free[i - 1].size += size;
+    }
+    else if (merges_next)
+    {
+        a->free[i].offset = offset;
+        a->free[i].size += size;
+    }
+    else
+    {
+        range_t range = { .offset = offset, .size = size };
+        insert_free_range(a, i, range);
+    }
+}
+
+/* Adds room at the end of the space. Used after growing whatever the ranges live in */
+void grow_range_allocator(range_allocator_t *a, uint new_capacity)
+{
+    if (new_capacity <= a->capacity)
+        return;
+    uint old_capacity = a->capacity;
+    a->capacity = new_capacity;
+    free_range(a, old_capacity, new_capacity - old_capacity);
+}
+
+void destroy_range_allocator(range_allocator_t *a)
+{
+    free(a->free);
+    memset(a, 0, sizeof(range_allocator_t));
+}
+
+#endif
@@ -0,0 +1,983 @@
+#ifndef SHINAGE_RENDER_QUEUE_H
+#define SHINAGE_RENDER_QUEUE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_debug.h"
+#include "shinage_math.h"
+#include "shinage_opengl_signatures.h"
+#include "shinage_matrix_stack_ops.h"
+#include "shinage_shaders.h"
+#include "shinage_scene.h"
+#include "shinage_textures.h"
+#include "shinage_mesh_cache.h"
+#include "shinage_culling.h"
+#include "shinage_hiz.h"
+#include "shinage_light_clusters.h"
+#include "shinage_gbuffer.h"
+#include "x11_shinage_text.h"
+
+/* Per-frame data shared by every program through the FrameData uniform block.
+   Laid out following std140; the block is declared row_major so our matrices go in as they are */
+typedef struct
+{
+    mat4x4f view;
+    mat4x4f projection;
+    mat4x4f view_projection;
+    mat4x4f screen_projection; // Orthographic projection in window pixels, for text and overlays
+    vec4f camera_position;     // w is unused
+    vec4f time;                // Seconds since start, seconds since last frame, frame number, unused
+    vec4f light_clusters;      // params of the light clusters of the frame, see light_clusters_t
+    mat4x4f inverse_view_projection; // For the deferred lighting pass to go back to world space
+} frame_uniforms_t;
+
+/* Passes are executed in order, each one with its own fixed render state */
+typedef enum
+{
+    RENDER_PASS_GBUFFER, // Deferred shading geometry, drawn like the opaque pass into the G-buffer and lit after it
+    RENDER_PASS_OPAQUE,  // Depth tested, no blending
+    RENDER_PASS_OVERLAY, // Text and other screen space elements: alpha blended, no depth test
+    NUM_RENDER_PASSES
+} render_pass_t;
+
+typedef enum
+{
+    RENDER_CMD_DRAW_MESH,
+    RENDER_CMD_DRAW_MESH_INSTANCED,
+    RENDER_CMD_UNIFORM_3F,
+    RENDER_CMD_DRAW_TEXT
+} render_command_type_t;
+
+/* Every command starts with this header, followed by its payload */
+typedef struct
+{
+    uint16 type;
+    uint16 pass;
+    uint32 size;  // Header and payload, always a multiple of RENDER_COMMAND_ALIGNMENT
+} render_command_t;
+
+#define RENDER_COMMAND_ALIGNMENT 16
+
+/* Draws a mesh through the mesh cache. Programs with a drawData buffer texture read the matrices
+   from there and get their draws batched, see draw_data_t. Otherwise they go to the modelMatrix,
+   mvpMatrix and normalMatrix uniforms, which programs are free to ignore */
+typedef struct
+{
+    uint program;
+    mesh_t *mesh;
+    material_t *material; // NULL for untextured meshes
+    mat4x4f model;
+    mat4x4f mvp;
+    mat3x3f normal;
+} render_draw_mesh_t;
+
+/* Draws count copies of a mesh. The model matrices and colours of the instances
+   follow the payload in the command buffer */
+typedef struct
+{
+    uint program;
+    mesh_t *mesh;
+    uint count;
+} render_draw_mesh_instanced_t;
+
+/* Sets a uniform of a program for the draws recorded after it */
+typedef struct
+{
+    uint program;
+    char *name; // Only needs to live until the queue is executed
+    vec3f value;
+} render_uniform_3f_t;
+
+/* Draws all the text queued in a batch */
+typedef struct
+{
+    uint program;
+    text_batch_t *batch;
+} render_draw_text_t;
+
+/* Transforms of a single mesh draw as the shaders fetch them from the drawData buffer texture,
+   one RGBA32F texel per matrix row */
+typedef struct
+{
+    mat4x4f model;
+    mat4x4f mvp;
+    vec4f normal[3]; // Rows of the normal matrix, w is unused
+} draw_data_t;
+
+#define DRAW_DATA_TEXELS (sizeof(draw_data_t) / sizeof(vec4f))
+
+/* Consecutive sorted mesh draws sharing pass, program and material, submitted with a single
+   multi-draw. Draws of the same mesh next to each other share an indirect command as instances */
+typedef struct
+{
+    uint first_entry, num_entries;
+    uint first_command, num_commands;
+    uint window; // First draw_data_t of the part of the buffer the batch indexes into
+    render_pass_t pass;
+} render_batch_t;
+
+/* Input of the GPU culling pass for a single mesh draw, laid out following std430.
+   See shaders/frustum_cull.comp */
+typedef struct
+{
+    vec4f model[3];     // Top three rows of the model matrix
+    vec4f sphere;       // Model space centre and radius, negative radius for draws that are never culled
+    uint32 command;     // Indirect command the draw is an instance of
+    uint32 draw_index;  // drawIndex the draw gets if it survives
+    uint32 occluded;    // Written by the early occlusion pass, 0 on upload
+    uint32 pad;
+} cull_object_t;
+
+/* Commands are sorted with these instead of moving the commands themselves.
+   Keys of depth sorted passes hold, from the most significant bit:
+     pass (4) | program (12) | uniform group (8) | material (12) | mesh (12) | depth (16)
+   so draws sharing state end up together and, inside a group, go front to back. The uniform group
+   keeps uniform commands ahead of the draws recorded after them, see render_uniform_group_t.
+   Passes that need to keep the recording order (blending) use the pass and a sequence number */
+typedef struct
+{
+    uint64 key;
+    uint32 offset; // Of the command inside the queue buffer
+} render_sort_entry_t;
+
+#define SORT_KEY_PASS_SHIFT     60
+#define SORT_KEY_PROGRAM_SHIFT  48
+#define SORT_KEY_GROUP_SHIFT    40
+#define SORT_KEY_MATERIAL_SHIFT 28
+#define SORT_KEY_MESH_SHIFT     16
+#define SORT_KEY_PROGRAMS       0x1000 // Programs are told apart by the low 12 bits of their names
+
+/* Uniform commands of a program start a new group of its draws. Draws recorded before the uniform stay
+   in the older group and sort ahead of it, those recorded after it sort behind, so each draw sees the
+   values last recorded before it. Uniforms in a row without draws in between share the group */
+typedef struct
+{
+    uint8 group;
+    bool drawn; // Since the group started
+} render_uniform_group_t;
+
+#define OCCLUSION_STATS_FRAMES 3 // Frames the GPU may be behind before the occlusion stats stop updating
+
+/* State changes of the last executed frame, in the order the commands were recorded and
+   once sorted. The difference between both is what sorting saved us */
+typedef struct
+{
+    uint commands;
+    uint program_changes, unsorted_program_changes;
+    uint material_changes, unsorted_material_changes;
+    uint mesh_changes, unsorted_mesh_changes;
+    uint gl_calls_issued, gl_calls_elided; // State calls that reached GL or were found redundant, see gl_state_t
+    uint batches, indirect_commands;
+    // Draws the early occlusion pass rejected and, out of those, the ones the late pass drew anyway.
+    // Read back from the GPU, so they are OCCLUSION_STATS_FRAMES frames older than the rest
+    uint draws_occluded, draws_late;
+} render_stats_t;
+
+/* Linear buffer of render commands recorded by the game layer during a frame.
+   The platform layer sorts and executes them at the end of the frame */
+typedef struct
+{
+    uint8 *buffer;
+    size_t used, capacity;
+    uint num_commands, _max_commands;
+    render_sort_entry_t *entries;
+    render_sort_entry_t *sort_scratch; // Same size as entries
+    render_stats_t stats;
+    frame_uniforms_t frame_uniforms;
+    bool has_frame_uniforms;
+    render_uniform_group_t uniform_groups[SORT_KEY_PROGRAMS];
+    uint frame_ubo;
+    // Built from the sorted commands on execution
+    uint num_draw_data, _max_draw_data;
+    draw_data_t *draw_data;
+    uint num_indirect, _max_indirect;
+    draw_elements_indirect_t *indirect;
+    uint num_batches, _max_batches;
+    render_batch_t *batches;
+    uint draw_data_bo, draw_data_texture;
+    /* GPU frustum culling of the opaque mesh draws, used when gpu_culling is set and the
+       context can run cull_program (GL 4.3). Surviving draws are compacted into the instances
+       of their indirect command, so culled ones cost nothing past the compute pass */
+    bool gpu_culling;
+    uint cull_program;
+    uint num_cull_objects, _max_cull_objects;
+    cull_object_t *cull_objects;
+    uint cull_objects_bo, visible_draws_bo;
+    uniform_cache_t cull_planes_uniform, cull_count_uniform;
+    /* Occlusion culling on top of the above, when occlusion_culling is set and hiz.program is available.
+       The early pass tests the draws against the depth pyramid of the last frame. Once the opaque
+       pass is drawn the pyramid is rebuilt and the late pass retests the draws the early one
+       rejected, drawing the ones that show up after all. Nothing pops in when the view changes */
+    bool occlusion_culling;
+    hiz_pyramid_t hiz;
+    uint late_commands; // The late pass has its own copy of the indirect commands starting here, 0 without one
+    uint occlusion_stats_bo[OCCLUSION_STATS_FRAMES]; // Ring of counters, one per frame in flight
+    GLsync occlusion_stats_fence[OCCLUSION_STATS_FRAMES];
+    uint occlusion_stats_frame;
+    uniform_cache_t cull_hiz_uniform, cull_levels_uniform, cull_late_uniform, cull_base_uniform;
+    int target_width, target_height; // Of the framebuffer we draw into, for the depth pyramid
+    // Lights of the frame sorted into clusters, see record_scene_lights. Uploaded on execution if has_lights is set
+    light_clusters_t lights;
+    bool has_lights;
+    /* Deferred shading of the scene draws made with gbuffer.forward_program, when deferred_shading is set
+       and the G-buffer programs built. Can be switched any frame, the forward path is always there */
+    bool deferred_shading;
+    gbuffer_t gbuffer;
+} render_queue_t;
+
+/* Fills the frame uniforms from the current view and projection matrices.
+   Needs to be recorded once per frame before any drawing */
+void record_frame_uniforms(render_queue_t *queue, int window_width, int window_height, double elapsed_time, double dt, int framecount)
+{
+    frame_uniforms_t *u = &queue->frame_uniforms;
+    u->view = peek(mats->view);
+    u->projection = peek(mats->projection);
+    u->view_projection = mat4x4f_prod(u->projection, u->view);
+    u->inverse_view_projection = inverse_mat4x4f(u->view_projection);
+    u->screen_projection = orthogonal_proj_matrix(0.0f, window_width, 0.0f, window_height);
+    vec3f eye = get_position_inverted_space_mat4x4f(u->view);
+    vec4f camera_position = { .x = eye.x, .y = eye.y, .z = eye.z, .w = 1.0f };
+    vec4f time = { .x = elapsed_time, .y = dt, .z = framecount, .w = 0.0f };
+    u->camera_position = camera_position;
+    u->time = time;
+    memset(&u->light_clusters, 0, sizeof(vec4f));
+    queue->target_width = window_width;
+    queue->target_height = window_height;
+    queue->has_frame_uniforms = true;
+}
+
+/* Positive floats keep their order when compared as integers, so the top bits of the
+   IEEE representation make a cheap logarithmic depth. Anything behind the camera goes first */
+static inline uint64 quantize_sort_depth(float depth)
+{
+    if (!(depth > 0.0f))
+        return 0;
+    uint32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return bits >> 16;
+}
+
+/* Builds the key of a command in a depth sorted pass. Materials are told apart by their first
+   texture, and meshes by their address, since that is what decides the bindings */
+static inline uint64 make_sort_key(render_pass_t pass, uint program, uint group, material_t *material, mesh_t *mesh, float depth)
+{
+    uint64 material_id = material ? material->textures[0] & 0xFFF : 0;
+    uint64 mesh_id = mesh ? ((uintptr_t)mesh >> 4) & 0xFFF : 0;
+    return ((uint64)pass << SORT_KEY_PASS_SHIFT) |
+        ((uint64)(program & (SORT_KEY_PROGRAMS - 1)) << SORT_KEY_PROGRAM_SHIFT) |
+        ((uint64)group << SORT_KEY_GROUP_SHIFT) |
+        (material_id << SORT_KEY_MATERIAL_SHIFT) |
+        (mesh_id << SORT_KEY_MESH_SHIFT) |
+        quantize_sort_depth(depth);
+}
+
+/* Whether a pass draws the scene through the frame's camera, with depth testing */
+static inline bool is_scene_pass(render_pass_t pass)
+{
+    return pass == RENDER_PASS_GBUFFER || pass == RENDER_PASS_OPAQUE;
+}
+
+/* Whether a pass has to run its commands in the order they were recorded */
+static inline bool is_ordered_pass(render_pass_t pass)
+{
+    return pass == RENDER_PASS_OVERLAY;
+}
+
+/* Uniform group the next draw of a program goes in */
+static inline uint draw_uniform_group(render_queue_t *queue, uint program)
+{
+    render_uniform_group_t *g = &queue->uniform_groups[program & (SORT_KEY_PROGRAMS - 1)];
+    g->drawn = true;
+    return g->group;
+}
+
+/* Starts a new uniform group for a program, unless nothing was drawn with it since the last one started */
+static uint uniform_command_group(render_queue_t *queue, uint program)
+{
+    render_uniform_group_t *g = &queue->uniform_groups[program & (SORT_KEY_PROGRAMS - 1)];
+    if (g->drawn)
+    {
+        if (g->group == 0xFF)
+            log_err("Error: too many uniform changes for program %u in a frame, draws may get the wrong values", program);
+        else
+            ++g->group;
+        g->drawn = false;
+    }
+    return g->group;
+}
+
+/* Appends a command with room for size bytes of payload and returns the payload.
+   The key is ignored in ordered passes. The pointer is only valid until the next command is pushed */
+void *push_render_command(render_queue_t *queue, render_command_type_t type, render_pass_t pass, uint64 key, size_t size)
+{
+    size_t total = (sizeof(render_command_t) + size + RENDER_COMMAND_ALIGNMENT - 1) & ~(size_t)(RENDER_COMMAND_ALIGNMENT - 1);
+    if (queue->used + total > queue->capacity)
+    {
+        while (queue->used + total > queue->capacity)
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 64 * 1024;
+        queue->buffer = realloc(queue->buffer, queue->capacity);
+    }
+    if (queue->num_commands == queue->_max_commands)
+    {
+        queue->_max_commands = queue->_max_commands ? queue->_max_commands * 2 : 1024;
+        queue->entries = realloc(queue->entries, sizeof(render_sort_entry_t) * queue->_max_commands);
+        queue->sort_scratch = realloc(queue->sort_scratch, sizeof(render_sort_entry_t) * queue->_max_commands);
+    }
+
+    render_command_t *cmd = (render_command_t *)(queue->buffer + queue->used);
+    cmd->type = type;
+    cmd->pass = pass;
+    cmd->size = total;
+
+    render_sort_entry_t *entry = &queue->entries[queue->num_commands];
+    if (is_ordered_pass(pass))
+        entry->key = ((uint64)pass << SORT_KEY_PASS_SHIFT) | queue->num_commands;
+    else
+        entry->key = key;
+    entry->offset = queue->used;
+    ++queue->num_commands;
+
+    queue->used += total;
+    return cmd + 1;
+}
+
+void record_draw_mesh(render_queue_t *queue, render_pass_t pass, uint program, mesh_t *mesh, material_t *material, mat4x4f model, mat4x4f mvp, mat3x3f normal)
+{
+    // The w of the model's origin in clip space is its distance along the view direction
+    uint64 key = make_sort_key(pass, program, draw_uniform_group(queue, program), material, mesh, mvp.d4);
+    render_draw_mesh_t *cmd = push_render_command(queue, RENDER_CMD_DRAW_MESH, pass, key, sizeof(render_draw_mesh_t));
+    cmd->program = program;
+    cmd->mesh = mesh;
+    cmd->material = material;
+    cmd->model = model;
+    cmd->mvp = mvp;
+    cmd->normal = normal;
+}
+
+void record_draw_mesh_instanced(render_queue_t *queue, render_pass_t pass, uint program, mesh_t *mesh, mat4x4f *models, vec3f *colours, uint count)
+{
+    size_t size = sizeof(render_draw_mesh_instanced_t) + (sizeof(mat4x4f) + sizeof(vec3f)) * count;
+    uint64 key = make_sort_key(pass, program, draw_uniform_group(queue, program), NULL, mesh, 0.0f);
+    render_draw_mesh_instanced_t *cmd = push_render_command(queue, RENDER_CMD_DRAW_MESH_INSTANCED, pass, key, size);
+    cmd->program = program;
+    cmd->mesh = mesh;
+    cmd->count = count;
+    mat4x4f *cmd_models = (mat4x4f *)(cmd + 1);
+    memcpy(cmd_models, models, sizeof(mat4x4f) * count);
+    memcpy(cmd_models + count, colours, sizeof(vec3f) * count);
+}
+
+/* In depth sorted passes the uniform sorts ahead of the draws with the same program recorded after it,
+   up to the next uniform of the program, and behind those recorded before it */
+void record_uniform_3f(render_queue_t *queue, render_pass_t pass, uint program, char *name, vec3f value)
+{
+    uint64 key = make_sort_key(pass, program, uniform_command_group(queue, program), NULL, NULL, 0.0f);
+    render_uniform_3f_t *cmd = push_render_command(queue, RENDER_CMD_UNIFORM_3F, pass, key, sizeof(render_uniform_3f_t));
+    cmd->program = program;
+    cmd->name = name;
+    cmd->value = value;
+}
+
+/* Sorts the lights of a scene into the clusters of the frame's camera for the programs that read them,
+   see shaders/clustered_lights.glsl. Needs the frame uniforms recorded first. There is a single set
+   of lights per frame, the last one recorded */
+void record_scene_lights(render_queue_t *queue, scene_t *scene)
+{
+    frame_uniforms_t *u = &queue->frame_uniforms;
+    assign_light_clusters(&queue->lights, scene->light_sources, scene->num_light_sources, u->view, u->projection,
+                          queue->target_width, queue->target_height);
+    u->light_clusters = queue->lights.params;
+    queue->has_lights = true;
+}
+
+void record_draw_text(render_queue_t *queue, uint program, text_batch_t *batch)
+{
+    render_draw_text_t *cmd = push_render_command(queue, RENDER_CMD_DRAW_TEXT, RENDER_PASS_OVERLAY, 0, sizeof(render_draw_text_t));
+    cmd->program = program;
+    cmd->batch = batch;
+}
+
+/* Stable LSD radix sort of the entries by key, a byte at a time. Bytes where every key
+   is the same (most of them, with few programs and passes) are skipped */
+void radix_sort_entries(render_sort_entry_t *entries, render_sort_entry_t *scratch, uint count)
+{
+    uint histograms[8][256] = {{0}};
+    for (uint i = 0; i < count; ++i)
+        for (uint d = 0; d < 8; ++d)
+            ++histograms[d][(entries[i].key >> (8 * d)) & 0xFF];
+
+    render_sort_entry_t *src = entries, *dst = scratch;
+    for (uint d = 0; d < 8; ++d)
+    {
+        uint *histogram = histograms[d];
+        if (histogram[(src[0].key >> (8 * d)) & 0xFF] == count)
+            continue;
+
+        uint offset = 0;
+        for (uint b = 0; b < 256; ++b)
+        {
+            uint c = histogram[b];
+            histogram[b] = offset;
+            offset += c;
+        }
+        for (uint i = 0; i < count; ++i)
+            dst[histogram[(src[i].key >> (8 * d)) & 0xFF]++] = src[i];
+
+        render_sort_entry_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != entries)
+        memcpy(entries, src, sizeof(render_sort_entry_t) * count);
+}
+
+/* Counts how many times the program, material and mesh fields change along the entries.
+   Commands from ordered passes do not carry these fields and are skipped */
+static void count_state_changes(render_sort_entry_t *entries, uint count, uint *programs, uint *materials, uint *meshes)
+{
+    uint64 last = ~0ull;
+    *programs = *materials = *meshes = 0;
+    for (uint i = 0; i < count; ++i)
+    {
+        uint64 key = entries[i].key;
+        if (is_ordered_pass(key >> SORT_KEY_PASS_SHIFT))
+            continue;
+        if (((key ^ last) >> SORT_KEY_PROGRAM_SHIFT))
+            ++*programs;
+        if (((key ^ last) >> SORT_KEY_MATERIAL_SHIFT) & 0xFFF)
+            ++*materials;
+        if (((key ^ last) >> SORT_KEY_MESH_SHIFT) & 0xFFF)
+            ++*meshes;
+        last = key;
+    }
+}
+
+void sort_render_commands(render_queue_t *queue)
+{
+    render_stats_t *stats = &queue->stats;
+    stats->commands = queue->num_commands;
+    count_state_changes(queue->entries, queue->num_commands, &stats->unsorted_program_changes,
+                        &stats->unsorted_material_changes, &stats->unsorted_mesh_changes);
+    if (queue->num_commands > 1)
+        radix_sort_entries(queue->entries, queue->sort_scratch, queue->num_commands);
+    count_state_changes(queue->entries, queue->num_commands, &stats->program_changes,
+                        &stats->material_changes, &stats->mesh_changes);
+}
+
+/* Number of draw_data_t that fit in the drawData buffer texture at once */
+static inline uint draw_data_window_size(void)
+{
+    uint size = gl_caps.max_texture_buffer_size / DRAW_DATA_TEXELS;
+    return size < MAX_DRAWS_PER_BATCH ? size : MAX_DRAWS_PER_BATCH;
+}
+
+static draw_data_t *push_draw_data(render_queue_t *queue)
+{
+    if (queue->num_draw_data == queue->_max_draw_data)
+    {
+        queue->_max_draw_data = queue->_max_draw_data ? queue->_max_draw_data * 2 : 1024;
+        queue->draw_data = realloc(queue->draw_data, sizeof(draw_data_t) * queue->_max_draw_data);
+    }
+    return &queue->draw_data[queue->num_draw_data++];
+}
+
+static void push_indirect_draw(render_queue_t *queue, draw_elements_indirect_t cmd)
+{
+    if (queue->num_indirect == queue->_max_indirect)
+    {
+        queue->_max_indirect = queue->_max_indirect ? queue->_max_indirect * 2 : 1024;
+        queue->indirect = realloc(queue->indirect, sizeof(draw_elements_indirect_t) * queue->_max_indirect);
+    }
+    queue->indirect[queue->num_indirect++] = cmd;
+}
+
+static cull_object_t *push_cull_object(render_queue_t *queue)
+{
+    if (queue->num_cull_objects == queue->_max_cull_objects)
+    {
+        queue->_max_cull_objects = queue->_max_cull_objects ? queue->_max_cull_objects * 2 : 1024;
+        queue->cull_objects = realloc(queue->cull_objects, sizeof(cull_object_t) * queue->_max_cull_objects);
+    }
+    return &queue->cull_objects[queue->num_cull_objects++];
+}
+
+/* Culling needs the frame's camera to build the frustum and multi-draw indirect to consume its output */
+static inline bool gpu_culling_active(render_queue_t *queue)
+{
+    return queue->gpu_culling && queue->cull_program && queue->has_frame_uniforms && gl_caps.multi_draw_indirect;
+}
+
+static inline bool occlusion_culling_active(render_queue_t *queue)
+{
+    return queue->occlusion_culling && queue->hiz.program && gpu_culling_active(queue);
+}
+
+/* The lighting pass reads the frame uniforms to go back to world space */
+static inline bool deferred_shading_active(render_queue_t *queue)
+{
+    return queue->deferred_shading && queue->gbuffer.geometry_program && queue->gbuffer.lighting_program &&
+        queue->has_frame_uniforms;
+}
+
+static render_batch_t *push_render_batch(render_queue_t *queue)
+{
+    if (queue->num_batches == queue->_max_batches)
+    {
+        queue->_max_batches = queue->_max_batches ? queue->_max_batches * 2 : 256;
+        queue->batches = realloc(queue->batches, sizeof(render_batch_t) * queue->_max_batches);
+    }
+    return &queue->batches[queue->num_batches++];
+}
+
+/* Groups the sorted mesh draws into batches and lays out their transforms and indirect commands.
+   A batch never spans more draws than fit in the drawData buffer texture; when the current window
+   is full the next batch starts a new one. When culling on the GPU, base instances index the
+   whole frame's visible draws buffer instead of the static drawIndex stream */
+static void build_render_batches(render_queue_t *queue, mesh_cache_t *meshes)
+{
+    queue->num_draw_data = queue->num_indirect = queue->num_batches = queue->num_cull_objects = 0;
+    bool culling = gpu_culling_active(queue);
+    uint window_size = draw_data_window_size();
+    uint window = 0;
+    render_batch_t *batch = NULL;
+    render_draw_mesh_t *first = NULL; // First draw of the current batch
+    uint16 first_pass = 0;
+    mesh_t *last_mesh = NULL;
+
+    for (uint i = 0; i < queue->num_commands; ++i)
+    {
+        render_command_t *cmd = (render_command_t *)(queue->buffer + queue->entries[i].offset);
+        if (cmd->type != RENDER_CMD_DRAW_MESH)
+        {
+            batch = NULL;
+            continue;
+        }
+
+        render_draw_mesh_t *draw = (render_draw_mesh_t *)(cmd + 1);
+        bool window_full = queue->num_draw_data - window >= window_size;
+        if (!batch || window_full || cmd->pass != first_pass ||
+            draw->program != first->program || draw->material != first->material)
+        {
+            if (window_full)
+                window = queue->num_draw_data;
+            batch = push_render_batch(queue);
+            batch->first_entry = i;
+            batch->num_entries = 0;
+            batch->first_command = queue->num_indirect;
+            batch->num_commands = 0;
+            batch->window = window;
+            batch->pass = cmd->pass;
+            first = draw;
+            first_pass = cmd->pass;
+            last_mesh = NULL;
+        }
+        ++batch->num_entries;
+
+        gpu_mesh_t *gm = get_gpu_mesh(meshes, draw->mesh);
+        uint draw_index = queue->num_draw_data;
+        draw_data_t *data = push_draw_data(queue);
+        // The vertices may be stored relative to the mesh bounds, the shaders get matrices taking them to model space first
+        data->model = dequantize_matrix(draw->model, gm->dequantize);
+        data->mvp = dequantize_matrix(draw->mvp, gm->dequantize);
+        for (uint row = 0; row < 3; ++row)
+        {
+            vec4f normal_row = { .x = draw->normal.rows[row].v[0], .y = draw->normal.rows[row].v[1], .z = draw->normal.rows[row].v[2], .w = 0.0f };
+            data->normal[row] = normal_row;
+        }
+
+        if (draw->mesh == last_mesh)
+        {
+            ++queue->indirect[queue->num_indirect - 1].instance_count;
+        }
+        else
+        {
+            push_indirect_draw(queue, make_indirect_draw(gm, culling ? draw_index : draw_index - window));
+            ++batch->num_commands;
+            last_mesh = draw->mesh;
+        }
+
+        if (culling)
+        {
+            cull_object_t *object = push_cull_object(queue);
+            for (uint row = 0; row < 3; ++row)
+                object->model[row] = draw->model.rows[row];
+            object->sphere = draw->mesh->bounds.sphere;
+            // Our frustum is only meaningful for the passes drawn through the camera
+            if (!is_scene_pass(cmd->pass))
+                object->sphere.w = -1.0f;
+            object->command = queue->num_indirect - 1;
+            object->draw_index = draw_index - window;
+            object->occluded = 0;
+        }
+    }
+
+    queue->stats.batches = queue->num_batches;
+    queue->stats.indirect_commands = queue->num_indirect;
+    // The culling pass counts the instances again, keeping only the visible ones
+    if (culling)
+        for (uint i = 0; i < queue->num_indirect; ++i)
+            queue->indirect[i].instance_count = 0;
+    // The late occlusion pass fills a copy of the commands, compacting into its own half of the visible draws
+    queue->late_commands = 0;
+    if (culling && occlusion_culling_active(queue))
+    {
+        uint count = queue->num_indirect;
+        queue->late_commands = count;
+        for (uint i = 0; i < count; ++i)
+        {
+            draw_elements_indirect_t late = queue->indirect[i];
+            late.base_instance += queue->num_cull_objects;
+            push_indirect_draw(queue, late);
+        }
+    }
+    upload_indirect_draws(meshes, queue->indirect, queue->num_indirect);
+}
+
+/* Reads back the occlusion counters written OCCLUSION_STATS_FRAMES frames ago into the stats and clears
+   them for this frame. They are only read once the fence of their late pass has signalled, so we never
+   wait on the GPU: when it is further behind than that, the stats keep their older values */
+static void read_occlusion_stats(render_queue_t *queue)
+{
+    uint slot = queue->occlusion_stats_frame++ % OCCLUSION_STATS_FRAMES;
+    uint *bo = &queue->occlusion_stats_bo[slot];
+    GLsync *fence = &queue->occlusion_stats_fence[slot];
+    uint32 counters[2] = { 0, 0 };
+    if (!*bo)
+    {
+        openGL.glGenBuffers(1, bo);
+        gl_bind_buffer(GL_COPY_WRITE_BUFFER, *bo);
+        openGL.glBufferData(GL_COPY_WRITE_BUFFER, sizeof(counters), counters, GL_DYNAMIC_READ);
+    }
+    else
+    {
+        gl_bind_buffer(GL_COPY_WRITE_BUFFER, *bo);
+        if (*fence)
+        {
+            GLenum status = openGL.glClientWaitSync(*fence, 0, 0);
+            if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+            {
+                openGL.glGetBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(counters), counters);
+                queue->stats.draws_occluded = counters[0];
+                queue->stats.draws_late = counters[1];
+                counters[0] = counters[1] = 0;
+            }
+            openGL.glDeleteSync(*fence);
+            *fence = 0;
+        }
+        openGL.glBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(counters), counters);
+    }
+    gl_bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 3, *bo);
+}
+
+/* Once the late pass is dispatched, the counters of this frame are complete when the GPU gets past here */
+static void fence_occlusion_stats(render_queue_t *queue)
+{
+    uint slot = (queue->occlusion_stats_frame - 1) % OCCLUSION_STATS_FRAMES;
+    openGL.glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    queue->occlusion_stats_fence[slot] = openGL.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Runs one pass of the culling program over the draws laid out by build_render_batches.
+   The late pass only looks at the draws the early one marked as occluded */
+static void dispatch_cull_pass(render_queue_t *queue, bool late)
+{
+    uint program = queue->cull_program;
+    bool occlusion = queue->late_commands && queue->hiz.levels;
+    gl_use_program(program);
+    glActiveTexture(GL_TEXTURE0 + HIZ_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, occlusion ? queue->hiz.texture : 0);
+    glActiveTexture(GL_TEXTURE0);
+    openGL.glUniform1i(uniform_location(&queue->cull_hiz_uniform, program, "hiZ"), HIZ_TEXTURE_UNIT);
+    openGL.glUniform1i(uniform_location(&queue->cull_levels_uniform, program, "hiZLevels"), occlusion ? queue->hiz.levels : 0);
+    openGL.glUniform1i(uniform_location(&queue->cull_late_uniform, program, "latePass"), late);
+    openGL.glUniform1ui(uniform_location(&queue->cull_base_uniform, program, "commandBase"), late ? queue->late_commands : 0);
+    openGL.glDispatchCompute((queue->num_cull_objects + 63) / 64, 1, 1);
+    // The draws read the results as indirect commands and as a vertex attribute, the late pass as storage
+    openGL.glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+/* Runs the early culling pass over the draws laid out by build_render_batches. Its output feeds
+   the drawIndex attribute, so there is no readback: the CPU never learns what was culled */
+static void cull_draws_on_gpu(render_queue_t *queue, mesh_cache_t *meshes)
+{
+    if (!queue->cull_objects_bo)
+    {
+        openGL.glGenBuffers(1, &queue->cull_objects_bo);
+        openGL.glGenBuffers(1, &queue->visible_draws_bo);
+    }
+    uint count = queue->num_cull_objects;
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, queue->cull_objects_bo);
+    openGL.glBufferData(GL_COPY_WRITE_BUFFER, sizeof(cull_object_t) * count, queue->cull_objects, GL_STREAM_DRAW);
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, queue->visible_draws_bo);
+    openGL.glBufferData(GL_COPY_WRITE_BUFFER, sizeof(uint32) * count * (queue->late_commands ? 2 : 1), NULL, GL_STREAM_DRAW);
+    if (queue->late_commands)
+        read_occlusion_stats(queue);
+
+    frustum_t frustum = frustum_from_matrix(queue->frame_uniforms.view_projection);
+    gl_use_program(queue->cull_program);
+    openGL.glUniform4fv(uniform_location(&queue->cull_planes_uniform, queue->cull_program, "frustumPlanes"),
+                        NUM_FRUSTUM_PLANES, frustum.planes[0].v);
+    openGL.glUniform1ui(uniform_location(&queue->cull_count_uniform, queue->cull_program, "numObjects"), count);
+    gl_bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 0, queue->cull_objects_bo);
+    gl_bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 1, meshes->indirect_bo);
+    gl_bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 2, queue->visible_draws_bo);
+    dispatch_cull_pass(queue, false);
+
+    set_draw_index_source(meshes, queue->visible_draws_bo);
+}
+
+/* Uploads the transforms a batch indexes into, starting at its window, and binds them to the drawData unit.
+   The buffer is orphaned each time so draws still reading the previous window are not waited on */
+static void upload_draw_data_window(render_queue_t *queue, uint window)
+{
+    if (!queue->draw_data_texture)
+    {
+        // Buffer names only become buffers once bound
+        openGL.glGenBuffers(1, &queue->draw_data_bo);
+        gl_bind_buffer(GL_COPY_WRITE_BUFFER, queue->draw_data_bo);
+        glGenTextures(1, &queue->draw_data_texture);
+        glActiveTexture(GL_TEXTURE0 + DRAW_DATA_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, queue->draw_data_texture);
+        openGL.glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, queue->draw_data_bo);
+    }
+
+    uint count = queue->num_draw_data - window;
+    if (count > draw_data_window_size())
+        count = draw_data_window_size();
+    gl_bind_buffer(GL_COPY_WRITE_BUFFER, queue->draw_data_bo);
+    openGL.glBufferData(GL_COPY_WRITE_BUFFER, sizeof(draw_data_t) * count, queue->draw_data + window, GL_STREAM_DRAW);
+
+    glActiveTexture(GL_TEXTURE0 + DRAW_DATA_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, queue->draw_data_texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+static void apply_pass_state(render_pass_t pass)
+{
+    if (pass == RENDER_PASS_OVERLAY)
+    {
+        gl_disable(GL_DEPTH_TEST);
+        gl_enable(GL_CULL_FACE);
+        gl_enable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    else
+    {
+        gl_enable(GL_DEPTH_TEST);
+        gl_disable(GL_CULL_FACE);
+        gl_disable(GL_BLEND);
+    }
+}
+
+static void upload_frame_uniforms(uint *ubo, frame_uniforms_t *u)
+{
+    if (!*ubo)
+    {
+        openGL.glGenBuffers(1, ubo);
+        gl_bind_buffer(GL_UNIFORM_BUFFER, *ubo);
+        openGL.glBufferData(GL_UNIFORM_BUFFER, sizeof(frame_uniforms_t), NULL, GL_DYNAMIC_DRAW);
+    }
+    gl_bind_buffer(GL_UNIFORM_BUFFER, *ubo);
+    openGL.glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame_uniforms_t), u);
+    gl_bind_buffer_base(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, *ubo);
+}
+
+/* Uniform locations of the program the executor is currently drawing with */
+typedef struct
+{
+    uint program;
+    int model_matrix;
+    int mvp_matrix;
+    int normal_matrix;
+    int draw_data; // -1 if the program takes its transforms from the uniforms
+} draw_program_t;
+
+static void use_draw_program(draw_program_t *p, uint program)
+{
+    if (p->program == program)
+        return;
+    p->program = program;
+    gl_use_program(program);
+    p->model_matrix  = openGL.glGetUniformLocation(program, "modelMatrix");
+    p->mvp_matrix    = openGL.glGetUniformLocation(program, "mvpMatrix");
+    p->normal_matrix = openGL.glGetUniformLocation(program, "normalMatrix");
+    p->draw_data     = openGL.glGetUniformLocation(program, "drawData");
+}
+
+/* Draws the meshes of a batch one at a time, setting the transforms of each through uniforms */
+static void execute_unbatched_draws(render_queue_t *queue, render_batch_t *batch, draw_program_t *p,
+                                    mesh_cache_t *meshes, texture_manager_t *textures)
+{
+    for (uint i = batch->first_entry; i < batch->first_entry + batch->num_entries; ++i)
+    {
+        render_draw_mesh_t *draw = (render_draw_mesh_t *)((render_command_t *)(queue->buffer + queue->entries[i].offset) + 1);
+        gpu_mesh_t *gm = get_gpu_mesh(meshes, draw->mesh);
+        mat4x4f model = dequantize_matrix(draw->model, gm->dequantize);
+        mat4x4f mvp = dequantize_matrix(draw->mvp, gm->dequantize);
+        openGL.glUniformMatrix4fv(p->model_matrix, 1, GL_TRUE, model.v);
+        openGL.glUniformMatrix4fv(p->mvp_matrix, 1, GL_TRUE, mvp.v);
+        openGL.glUniformMatrix3fv(p->normal_matrix, 1, GL_TRUE, draw->normal.v);
+        if (draw->material)
+            bind_material_textures(textures, draw->material);
+        draw_mesh(meshes, draw->mesh);
+    }
+}
+
+/* Draws a batch of a program that reads the drawData buffer texture, with the indirect commands
+   starting at first_command (those of the late occlusion pass come after the early ones) */
+static void draw_render_batch(render_queue_t *queue, render_batch_t *batch, material_t *material, uint first_command,
+                              uint *uploaded_window, mesh_cache_t *meshes, texture_manager_t *textures)
+{
+    if (batch->window != *uploaded_window)
+    {
+        upload_draw_data_window(queue, batch->window);
+        *uploaded_window = batch->window;
+    }
+    if (material)
+        bind_material_textures(textures, material);
+    multi_draw_meshes(meshes, queue->indirect, first_command + batch->first_command, batch->num_commands);
+}
+
+/* Second half of occlusion culling, once a scene pass is drawn. The first one to get here builds the
+   depth pyramid from what it drew, then retests the draws the early pass rejected, those of every pass.
+   Each scene pass then draws its own that turn out to be visible. The pyramid stays around for the early
+   pass of the next frame */
+static void draw_late_batches(render_queue_t *queue, render_pass_t pass, bool *late_culled, draw_program_t *current,
+                              uint *uploaded_window, mesh_cache_t *meshes, texture_manager_t *textures)
+{
+    if (!*late_culled)
+    {
+        build_hiz_pyramid(&queue->hiz, queue->target_width, queue->target_height);
+        dispatch_cull_pass(queue, true);
+        fence_occlusion_stats(queue);
+        current->program = 0; // We left the compute programs in use
+        *late_culled = true;
+    }
+
+    for (uint i = 0; i < queue->num_batches; ++i)
+    {
+        render_batch_t *batch = &queue->batches[i];
+        if (batch->pass != pass)
+            continue;
+        render_draw_mesh_t *draw = (render_draw_mesh_t *)((render_command_t *)(queue->buffer + queue->entries[batch->first_entry].offset) + 1);
+        use_draw_program(current, draw->program);
+        // Draws through uniforms are never culled, they are all in already
+        if (current->draw_data != -1)
+            draw_render_batch(queue, batch, draw->material, queue->late_commands, uploaded_window, meshes, textures);
+    }
+}
+
+/* The geometry pass draws into the G-buffer instead of the bound framebuffer until end_render_pass lights it */
+static void begin_render_pass(render_queue_t *queue, render_pass_t pass)
+{
+    apply_pass_state(pass);
+    if (pass == RENDER_PASS_GBUFFER)
+        begin_gbuffer(&queue->gbuffer, queue->target_width, queue->target_height);
+}
+
+/* Wraps up a pass once all its commands ran: draws what the late occlusion pass finds visible in it,
+   and lights the G-buffer into the framebuffer we were drawing into after the geometry pass */
+static void end_render_pass(render_queue_t *queue, render_pass_t pass, bool *late_culled, draw_program_t *current,
+                            uint *uploaded_window, mesh_cache_t *meshes, texture_manager_t *textures)
+{
+    if (is_scene_pass(pass) && queue->late_commands)
+        draw_late_batches(queue, pass, late_culled, current, uploaded_window, meshes, textures);
+    if (pass == RENDER_PASS_GBUFFER)
+    {
+        light_gbuffer(&queue->gbuffer);
+        current->program = 0;
+    }
+}
+
+/* Sorts and executes every command recorded this frame, then empties the queue */
+void execute_render_queue(render_queue_t *queue, mesh_cache_t *meshes, texture_manager_t *textures, glyph_cache_t *glyphs)
+{
+    if (queue->has_frame_uniforms)
+        upload_frame_uniforms(&queue->frame_ubo, &queue->frame_uniforms);
+    if (queue->has_lights)
+        upload_light_clusters(&queue->lights);
+
+    sort_render_commands(queue);
+    build_render_batches(queue, meshes);
+    if (queue->num_cull_objects)
+        cull_draws_on_gpu(queue, meshes);
+    else if (queue->num_batches)
+        set_draw_index_source(meshes, 0);
+
+    int pass = -1;
+    draw_program_t current = { .program = 0 };
+    uint next_batch = 0;
+    uint uploaded_window = ~0u;
+    bool late_culled = false;
+    for (uint i = 0; i < queue->num_commands; ++i)
+    {
+        render_command_t *cmd = (render_command_t *)(queue->buffer + queue->entries[i].offset);
+        if (cmd->pass != pass)
+        {
+            if (pass != -1)
+                end_render_pass(queue, pass, &late_culled, &current, &uploaded_window, meshes, textures);
+            pass = cmd->pass;
+            begin_render_pass(queue, pass);
+        }
+
+        switch (cmd->type)
+        {
+        case RENDER_CMD_DRAW_MESH:
+        {
+            // Mesh draws only ever come in batches, which we consume whole
+            render_batch_t *batch = &queue->batches[next_batch++];
+            render_draw_mesh_t *draw = (render_draw_mesh_t *)(cmd + 1);
+            use_draw_program(&current, draw->program);
+            i += batch->num_entries - 1;
+            if (current.draw_data == -1)
+            {
+                execute_unbatched_draws(queue, batch, &current, meshes, textures);
+                break;
+            }
+
+            draw_render_batch(queue, batch, draw->material, 0, &uploaded_window, meshes, textures);
+        } break;
+        case RENDER_CMD_DRAW_MESH_INSTANCED:
+        {
+            render_draw_mesh_instanced_t *draw = (render_draw_mesh_instanced_t *)(cmd + 1);
+            mat4x4f *models = (mat4x4f *)(draw + 1);
+            use_draw_program(&current, draw->program);
+            draw_mesh_instanced(meshes, draw->mesh, models, (vec3f *)(models + draw->count), draw->count);
+        } break;
+        case RENDER_CMD_UNIFORM_3F:
+        {
+            render_uniform_3f_t *uniform = (render_uniform_3f_t *)(cmd + 1);
+            use_draw_program(&current, uniform->program);
+            openGL.glUniform3f(openGL.glGetUniformLocation(uniform->program, uniform->name), uniform->value.x, uniform->value.y, uniform->value.z);
+        } break;
+        case RENDER_CMD_DRAW_TEXT:
+        {
+            render_draw_text_t *draw = (render_draw_text_t *)(cmd + 1);
+            use_draw_program(&current, draw->program);
+            flush_text(draw->batch, glyphs);
+        } break;
+        default:
+            log_err("Error: unknown render command %u", cmd->type);
+        }
+    }
+    if (pass != -1)
+        end_render_pass(queue, pass, &late_culled, &current, &uploaded_window, meshes, textures);
+    gl_bind_vertex_array(0);
+    // Leave the default state behind for whatever is drawn outside the queue
+    if (pass != RENDER_PASS_OPAQUE)
+        apply_pass_state(RENDER_PASS_OPAQUE);
+
+    // Everything since the last execution counts as part of this frame
+    queue->stats.gl_calls_issued = gl_state.issued_calls;
+    queue->stats.gl_calls_elided = gl_state.elided_calls;
+    gl_state.issued_calls = gl_state.elided_calls = 0;
+
+    queue->used = 0;
+    queue->num_commands = 0;
+    queue->has_frame_uniforms = false;
+    queue->has_lights = false;
+    memset(queue->uniform_groups, 0, sizeof(queue->uniform_groups));
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SHINAGE_RENDERER_H
+#define SHINAGE_RENDERER_H
+
+#include "shinage_matrix_stack_ops.h"
+#include "shinage_scene.h"
+#include "shinage_render_queue.h"
+
+/* Programs of a scene that get their uniforms recorded only once, before their first draw.
+   Past this many they are recorded again on every program change, which is still correct */
+#define MAX_SCENE_PROGRAMS 16
+
+/* Records the light uniforms a program needs before the draws that use it */
+static void record_scene_program_uniforms(render_queue_t *queue, uint program, scene_t *scene)
+{
+    // The single light shader takes the first enabled light, clustered programs read them all from the clusters
+    for (uint i = 0; i < scene->num_light_sources; ++i)
+    {
+        light_source_t *light = &scene->light_sources[i];
+        if (!light->enabled)
+            continue;
+        vec3f position = { .x = light->position_world.x, .y = light->position_world.y, .z = light->position_world.z };
+        vec3f colour = { .x = light->diffuse.x, .y = light->diffuse.y, .z = light->diffuse.z };
+        record_uniform_3f(queue, RENDER_PASS_OPAQUE, program, "lightWorldPos", position);
+        record_uniform_3f(queue, RENDER_PASS_OPAQUE, program, "lightColor", colour);
+        break;
+    }
+}
+
+/* Updates the scene transforms, picks the levels of detail, culls the meshes outside the view,
+   sorts the lights into clusters and records a draw for every visible mesh, with its own program
+   and material. With deferred shading on, meshes lit by the forward program it replaces go to the G-buffer */
+void render_scene(scene_t *scene, render_queue_t *queue)
+{
+    update_scene_transforms(scene);
+    set_scene_view_projection(scene, mat4x4f_prod(peek(mats->projection), peek(mats->view)));
+    select_scene_lods(scene);
+    cull_scene(scene);
+    record_scene_lights(queue, scene);
+    bool deferred = deferred_shading_active(queue);
+
+    uint current_program = 0;
+    uint recorded_programs[MAX_SCENE_PROGRAMS];
+    uint num_recorded_programs = 0;
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible)
+            continue;
+
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            mesh_t *mesh = &model->meshes[j];
+            if (!mesh->visible || !mesh->program || !*mesh->program)
+                continue;
+
+            if (*mesh->program != current_program)
+            {
+                current_program = *mesh->program;
+                // Uniforms hold for every later draw of the program, see render_uniform_group_t
+                bool recorded = false;
+                for (uint k = 0; k < num_recorded_programs && !recorded; ++k)
+                    recorded = recorded_programs[k] == current_program;
+                if (!recorded)
+                {
+                    record_scene_program_uniforms(queue, current_program, scene);
+                    if (num_recorded_programs < MAX_SCENE_PROGRAMS)
+                        recorded_programs[num_recorded_programs++] = current_program;
+                }
+            }
+
+            update_mesh_draw_matrices(scene, mesh);
+            if (deferred && current_program == queue->gbuffer.forward_program)
+                record_draw_mesh(queue, RENDER_PASS_GBUFFER, queue->gbuffer.geometry_program, mesh, mesh->material,
+                                 mesh->preprocessed_model_mat, mesh->mvp_mat, mesh->normal_mat);
+            else
+                record_draw_mesh(queue, RENDER_PASS_OPAQUE, current_program, mesh, mesh->material,
+                                 mesh->preprocessed_model_mat, mesh->mvp_mat, mesh->normal_mat);
+        }
+    }
+}
+
+#endif
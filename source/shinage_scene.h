@@ -5,6 +5,9 @@
 #include "shinage_camera.h"
 #include "shinage_debug.h"
 #include "shinage_ints.h"
+#include "shinage_textures.h"
+#include "shinage_culling.h"
+#include "shinage_occlusion.h"
 
 typedef struct
 {
@@ -14,6 +17,7 @@ typedef struct
 	vec4f emissive;
 	float shininess;
 	int texture_count;
+	texture_handle_t textures[MAX_MATERIAL_TEXTURES]; // One per sampler in material_sampler_names
 } material_t;
 
 typedef struct {
@@ -27,6 +31,13 @@ typedef struct {
 	vec3f attenuation; // kc, kl, kq
 } light_source_t;
 
+/* Model space bounding volumes of a mesh, see compute_mesh_bounds */
+typedef struct
+{
+    vec3f min, max; // Axis aligned box
+    vec4f sphere;   // Centre and radius
+} bounds_t;
+
 typedef struct
 {
 	uint num_vertices, _max_vertices;
@@ -35,6 +46,11 @@ typedef struct
     uint32 *indices;
     vec3f *normals;
     vec2f *tex_coords;
+    vec3f *colours;
+    // Bump (see mark_mesh_dirty) whenever the vertex data above changes so the
+    // mesh cache knows it has to upload it again
+    uint data_revision;
+    bounds_t bounds; // Kept up to date by the mesh constructors and mark_mesh_dirty
     material_t *material;
     uint *program;
     //model_t* my_model;
@@ -43,22 +59,50 @@ typedef struct
     // there is no need to recalculate the final model_mat for the mesh
     mat4x4f preprocessed_model_mat;
     int model_mat_mismatches;
-    bool visible;
+    uint world_revision;  // Bumped each time preprocessed_model_mat is recomputed, 0 if it never was
+    uint parent_revision; // world_revision of the owning model when we last recomputed ours
+    // Per-draw matrices, only recomputed when the mesh or the camera moved
+    mat4x4f mvp_mat;
+    mat3x3f normal_mat;
+    uint mvp_world_revision, mvp_view_revision;
+    uint normal_world_revision;
+    vec4f world_sphere; // bounds.sphere in world space, for the world_revision in sphere_world_revision
+    uint sphere_world_revision;
+    bool visible; // Written each frame by cull_scene, hide whole models through model_t.visible
+    bool occluder; // Rasterized by cull_scene to hide what is behind it, keep these low poly
+    bool static_geometry; // Never moves, so build_static_batches can merge it with its neighbours
+    bool batched;         // Merged by build_static_batches, the batch is drawn instead
     // bool casts_shadows; TODO
 } mesh_t;
 
+/* Levels of detail a model can swap its meshes for, see add_model_lod */
+#define MAX_LODS 4
+// How far past a switch size the projected size has to go before switching back, as a fraction of it
+#define LOD_HYSTERESIS 0.15f
+
 typedef struct
 {
-	uint num_meshes, _max_meshes;
     mesh_t *meshes;
-    //model_t* parent;
-	//uint num_children, _max_children;
-    //model_t* children;
+    uint num_meshes;
+    float switch_size; // Used below this projected size, as a fraction of the viewport height
+} lod_t;
+
+typedef struct
+{
+	uint num_meshes, _max_meshes;
+    mesh_t *meshes; // Those of the current level of detail when there are several
+    uint num_lods;  // 0 when the model has a single level
+    uint lod;       // Current level, picked each frame by select_scene_lods
+    lod_t lods[MAX_LODS];
+    int parent; // Index of the parent model inside the scene, -1 for root models
     mat4x4f model_mat;
     // If model and its parentdo not change there is no need
     // to recalculate the final model_mat for the model
     mat4x4f preprocessed_model_mat;
     int model_mat_mismatches;
+    uint world_revision;  // Same as in mesh_t
+    uint parent_revision;
+    uint updated_frame;   // Last scene frame in which we checked the transform
     bool visible;
     // bool casts_shadows; TODO
 } model_t;
@@ -69,9 +113,55 @@ typedef struct
 	model_t *models;
 	uint num_light_sources, _max_light_sources;
 	light_source_t *light_sources;
+    uint frame;
+    uint transforms_updated; // Models and meshes whose final matrix had to be recomputed this frame
+    mat4x4f view_projection;
+    uint view_revision;      // Bumped whenever view_projection changes
+    cull_spheres_t cull_spheres; // Scratch for cull_scene, one per mesh of the visible models
+    uint meshes_culled;          // By the last cull_scene
+    occlusion_buffer_t occlusion; // Depth of the occluder meshes, see cull_scene
+    uint meshes_occluded;         // By the last cull_scene, on top of meshes_culled
     // bool render_shadows; TODO
 } scene_t;
 
+/* Binds the textures of a material to consecutive texture units, starting from 0 */
+void bind_material_textures(texture_manager_t *tm, material_t *material)
+{
+    for (int i = 0; i < material->texture_count && i < (int)MAX_MATERIAL_TEXTURES; ++i)
+        bind_texture(tm, material->textures[i], i);
+    if (material->texture_count > 1)
+        glActiveTexture(GL_TEXTURE0);
+}
+
+/* Computes the bounding box of the vertices and a sphere around it. The sphere is not the
+   tightest one but it is close, and cheap. Needs to be called again if the vertices change */
+void compute_mesh_bounds(mesh_t *mesh)
+{
+    bounds_t *b = &mesh->bounds;
+    memset(b, 0, sizeof(bounds_t));
+    if (!mesh->num_vertices)
+        return;
+
+    b->min = b->max = mesh->vertices[0];
+    for (uint i = 1; i < mesh->num_vertices; ++i)
+    {
+        vec3f v = mesh->vertices[i];
+        b->min.x = fminf(b->min.x, v.x); b->min.y = fminf(b->min.y, v.y); b->min.z = fminf(b->min.z, v.z);
+        b->max.x = fmaxf(b->max.x, v.x); b->max.y = fmaxf(b->max.y, v.y); b->max.z = fmaxf(b->max.z, v.z);
+    }
+    b->sphere.x = 0.5f * (b->min.x + b->max.x);
+    b->sphere.y = 0.5f * (b->min.y + b->max.y);
+    b->sphere.z = 0.5f * (b->min.z + b->max.z);
+    float radius_sq = 0.0f;
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+    {
+        vec3f v = mesh->vertices[i];
+        float dx = v.x - b->sphere.x, dy = v.y - b->sphere.y, dz = v.z - b->sphere.z;
+        radius_sq = fmaxf(radius_sq, dx * dx + dy * dy + dz * dz);
+    }
+    b->sphere.w = sqrtf(radius_sq);
+}
+
 /* Get a UV spherical mesh of radius r.
    Adapted from http://www.songho.ca/opengl/gl_sphere.html */
 mesh_t *sphere_mesh(float r, int nsectors, int nstacks)
@@ -164,10 +254,91 @@ mesh_t *sphere_mesh(float r, int nsectors, int nstacks)
     sphere->num_vertices = (nstacks+1) * (nsectors+1);
     sphere->model_mat = identity_matrix_4x4;
     sphere->visible = true;
+    compute_mesh_bounds(sphere);
 
     return sphere;
 }
 
+/* Builds a mesh out of copies of the input arrays. colours holds 3 floats per vertex and may be NULL */
+mesh_t *mesh_from_arrays(const float *vertices, const float *colours, uint num_vertices, const uint32 *indices, uint num_indices)
+{
+    mesh_t *mesh = (mesh_t*) calloc(1, sizeof(mesh_t));
+    mesh->num_vertices = num_vertices;
+    mesh->num_indices = num_indices;
+    mesh->vertices = malloc(sizeof(vec3f) * num_vertices);
+    memcpy(mesh->vertices, vertices, sizeof(vec3f) * num_vertices);
+    if (colours)
+    {
+        mesh->colours = malloc(sizeof(vec3f) * num_vertices);
+        memcpy(mesh->colours, colours, sizeof(vec3f) * num_vertices);
+    }
+    mesh->indices = malloc(sizeof(uint32) * num_indices);
+    memcpy(mesh->indices, indices, sizeof(uint32) * num_indices);
+    mesh->model_mat = identity_matrix_4x4;
+    mesh->visible = true;
+    compute_mesh_bounds(mesh);
+    return mesh;
+}
+
+/* Unit cube centered on the origin. colours holds 3 floats for each of its 8 vertices */
+mesh_t *cube_mesh(const float *colours)
+{
+    const float vertices[] = {
+         0.5f,  0.5f,  0.5f,
+         0.5f,  0.5f, -0.5f,
+        -0.5f,  0.5f, -0.5f,
+        -0.5f,  0.5f,  0.5f,
+         0.5f, -0.5f,  0.5f,
+         0.5f, -0.5f, -0.5f,
+        -0.5f, -0.5f, -0.5f,
+        -0.5f, -0.5f,  0.5f,
+    };
+
+    const uint32 indices[] = {
+        0,1,3, 1,2,3, 1,5,2, 5,6,2, 4,5,0, 5,1,0,
+        3,2,7, 2,6,7, 4,0,7, 0,3,7, 5,4,6, 4,7,6
+    };
+
+    return mesh_from_arrays(vertices, colours, 8, indices, 36);
+}
+
+/* Unit pyramid with a triangular base. colours holds 3 floats for each of its 4 vertices */
+mesh_t *pyramid_mesh(const float *colours)
+{
+    const float vertices[] = {
+       0.0f,   0.43f,   0.0f,
+      -0.5f,  -0.43f,  -0.5f,
+       0.5f,  -0.43f,  -0.5f,
+       0.0f,  -0.43f,   0.5f
+    };
+
+    const uint32 indices[] = {
+        3,1,2, 0,1,2, 0,3,1, 0,2,3
+    };
+
+    return mesh_from_arrays(vertices, colours, 4, indices, 12);
+}
+
+/* Frees a mesh made by one of the constructors above, simplify_mesh or load_obj_mesh, with its vertex data.
+   Materials can be shared and are left alone */
+void free_mesh(mesh_t *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->normals);
+    free(mesh->tex_coords);
+    free(mesh->colours);
+    free(mesh);
+}
+
+/* Flags the vertex data of the mesh as changed so it gets uploaded again */
+static inline void mark_mesh_dirty(mesh_t *mesh)
+{
+    mesh->data_revision += 1;
+    compute_mesh_bounds(mesh);
+    mesh->sphere_world_revision = 0;
+}
+
 /* Convenience function that takes into account the View matrix Z coord
    orientation, see notes on add_translation */
 void translate_model(model_t* model, float x, float y, float z)
@@ -228,20 +399,329 @@ void scale_mesh(mesh_t* mesh, float x, float y, float z)
     mesh->model_mat_mismatches += 1;
 }
 
-void render_scene(scene_t scene)
-{
-	log_debug("Scene rendering NOT implemented yet: %d objects not rendered", scene.num_models);
-	/*uint i, j;
-	for (i = 0; i < scene.num_models; i++)
-	{
-		model_t model = scene.models[i];
-		mat4x4f model_mat = model.model_mat;
-		for (j = 0; j < model.num_meshes; j++)
-		{
-			mesh_t mesh = model.meshes[j];
-			mat4x4f mesh_mat = mesh.model_mat;
-		}
-	}*/
+/* Appends an empty model to the scene. Parents need to be added before their children.
+   NOTE: The returned pointer is only valid until the next call, the models array may move */
+model_t *add_model(scene_t *scene, int parent)
+{
+    if (scene->num_models == scene->_max_models)
+    {
+        scene->_max_models = scene->_max_models ? scene->_max_models * 2 : 8;
+        scene->models = realloc(scene->models, sizeof(model_t) * scene->_max_models);
+    }
+    model_t *model = &scene->models[scene->num_models++];
+    memset(model, 0, sizeof(model_t));
+    model->parent = parent;
+    model->model_mat = identity_matrix_4x4;
+    model->visible = true;
+    return model;
+}
+
+/* Adds a coarser level of detail to a model, used while its projected size is below switch_size.
+   The meshes the model had become the first level. Each new mesh takes the program, material and
+   local transform of the mesh at the same position in the first level */
+void add_model_lod(model_t *model, mesh_t *meshes, uint num_meshes, float switch_size)
+{
+    if (!model->num_lods)
+    {
+        model->lods[0].meshes = model->meshes;
+        model->lods[0].num_meshes = model->num_meshes;
+        model->lods[0].switch_size = INFINITY;
+        model->num_lods = 1;
+        model->lod = 0;
+    }
+    if (model->num_lods == MAX_LODS)
+    {
+        log_err("Model already has %d levels of detail", MAX_LODS);
+        return;
+    }
+
+    lod_t *first = &model->lods[0];
+    for (uint i = 0; i < num_meshes && i < first->num_meshes; ++i)
+    {
+        meshes[i].program = first->meshes[i].program;
+        meshes[i].material = first->meshes[i].material;
+        meshes[i].model_mat = first->meshes[i].model_mat;
+        meshes[i].occluder = first->meshes[i].occluder;
+        meshes[i].model_mat_mismatches += 1;
+    }
+    lod_t *lod = &model->lods[model->num_lods++];
+    lod->meshes = meshes;
+    lod->num_meshes = num_meshes;
+    lod->switch_size = switch_size;
+}
+
+/* Gives a model made of a sphere_mesh of radius r coarser spheres, halving the tessellation for each
+   level down to a few dozen triangles. The first one is used below switch_size, the next ones
+   each time the size halves again */
+void add_sphere_lods(model_t *model, float r, int nsectors, int nstacks, float switch_size)
+{
+    while (model->num_lods < MAX_LODS && nsectors > 6)
+    {
+        nsectors = nsectors / 2 < 6 ? 6 : nsectors / 2;
+        nstacks = nstacks / 2 < 4 ? 4 : nstacks / 2;
+        add_model_lod(model, sphere_mesh(r, nsectors, nstacks), 1, switch_size);
+        switch_size *= 0.5f;
+    }
+}
+
+light_source_t *add_light_source(scene_t *scene)
+{
+    if (scene->num_light_sources == scene->_max_light_sources)
+    {
+        scene->_max_light_sources = scene->_max_light_sources ? scene->_max_light_sources * 2 : 4;
+        scene->light_sources = realloc(scene->light_sources, sizeof(light_source_t) * scene->_max_light_sources);
+    }
+    light_source_t *light = &scene->light_sources[scene->num_light_sources++];
+    memset(light, 0, sizeof(light_source_t));
+    light->enabled = true;
+    return light;
+}
+
+/* Recomputes the final matrix of a model if it or any of its ancestors changed */
+static void update_model_transform(scene_t *scene, model_t *model)
+{
+    if (model->updated_frame == scene->frame)
+        return;
+    model->updated_frame = scene->frame;
+
+    model_t *parent = model->parent >= 0 ? &scene->models[model->parent] : NULL;
+    if (parent)
+        update_model_transform(scene, parent);
+
+    bool dirty = !model->world_revision || model->model_mat_mismatches ||
+        (parent && parent->world_revision != model->parent_revision);
+    if (!dirty)
+        return;
+
+    if (parent)
+    {
+        model->preprocessed_model_mat = mat4x4f_prod(parent->preprocessed_model_mat, model->model_mat);
+        model->parent_revision = parent->world_revision;
+    }
+    else
+    {
+        model->preprocessed_model_mat = model->model_mat;
+    }
+    model->model_mat_mismatches = 0;
+    ++model->world_revision;
+    ++scene->transforms_updated;
+}
+
+/* Recomputes the final matrix of the meshes of a model whose transform is up to date */
+static void update_model_mesh_transforms(scene_t *scene, model_t *model)
+{
+    for (uint j = 0; j < model->num_meshes; ++j)
+    {
+        mesh_t *mesh = &model->meshes[j];
+        if (mesh->world_revision && !mesh->model_mat_mismatches && mesh->parent_revision == model->world_revision)
+            continue;
+        mesh->preprocessed_model_mat = mat4x4f_prod(model->preprocessed_model_mat, mesh->model_mat);
+        mesh->parent_revision = model->world_revision;
+        mesh->model_mat_mismatches = 0;
+        ++mesh->world_revision;
+        ++scene->transforms_updated;
+    }
+}
+
+/* Brings the preprocessed_model_mat of every model and mesh up to date. Only the nodes that
+   changed since last frame, and everything below them, get their matrices recomputed */
+void update_scene_transforms(scene_t *scene)
+{
+    ++scene->frame;
+    scene->transforms_updated = 0;
+
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        update_model_transform(scene, model);
+        update_model_mesh_transforms(scene, model);
+    }
+}
+
+/* Updates the view-projection matrix the scene is drawn with, noting if it changed */
+void set_scene_view_projection(scene_t *scene, mat4x4f view_projection)
+{
+    if (!scene->view_revision || memcmp(&scene->view_projection, &view_projection, sizeof(mat4x4f)))
+    {
+        scene->view_projection = view_projection;
+        ++scene->view_revision;
+    }
+}
+
+/* Brings the MVP and normal matrices of a mesh up to date. Normals are transformed to world
+   space, so the normal matrix only depends on the mesh and survives camera movement */
+void update_mesh_draw_matrices(scene_t *scene, mesh_t *mesh)
+{
+    if (mesh->mvp_world_revision != mesh->world_revision || mesh->mvp_view_revision != scene->view_revision)
+    {
+        mesh->mvp_mat = mat4x4f_prod(scene->view_projection, mesh->preprocessed_model_mat);
+        mesh->mvp_world_revision = mesh->world_revision;
+        mesh->mvp_view_revision = scene->view_revision;
+    }
+    if (mesh->normal_world_revision != mesh->world_revision)
+    {
+        mesh->normal_mat = normal_matrix_mat3x3f(mesh->preprocessed_model_mat);
+        mesh->normal_world_revision = mesh->world_revision;
+    }
+}
+
+/* Brings the world space bounding sphere of a mesh up to date. The radius grows with the
+   longest axis of the model matrix, so non-uniform scales stay conservative */
+static void update_mesh_world_sphere(mesh_t *mesh)
+{
+    if (mesh->sphere_world_revision && mesh->sphere_world_revision == mesh->world_revision)
+        return;
+
+    mat4x4f m = mesh->preprocessed_model_mat;
+    vec4f centre = mesh->bounds.sphere;
+    centre.w = 1.0f;
+    mesh->world_sphere = mat4x4f_vec4f_prod(m, centre);
+    float scale_sq = fmaxf(m.a1 * m.a1 + m.a2 * m.a2 + m.a3 * m.a3,
+                           fmaxf(m.b1 * m.b1 + m.b2 * m.b2 + m.b3 * m.b3,
+                                 m.c1 * m.c1 + m.c2 * m.c2 + m.c3 * m.c3));
+    mesh->world_sphere.w = mesh->bounds.sphere.w * sqrtf(scale_sq);
+    mesh->sphere_world_revision = mesh->world_revision;
+}
+
+/* Height of a world space sphere on screen as a fraction of the viewport height. With view_projection
+   being projection * view, the second row has the length of the focal length in y, and the fourth
+   gives the distance along the view direction */
+static float projected_sphere_size(mat4x4f view_projection, vec4f sphere)
+{
+    mat4x4f m = view_projection;
+    float w = m.a4 * sphere.x + m.b4 * sphere.y + m.c4 * sphere.z + m.d4;
+    if (w <= sphere.w)
+        return INFINITY;
+    float focal = sqrtf(m.a2 * m.a2 + m.b2 * m.b2 + m.c2 * m.c2);
+    return sphere.w * focal / w;
+}
+
+/* Picks the level of detail of every visible model with several, going by the largest projected
+   size of its current meshes. Needs up to date transforms and view_projection */
+void select_scene_lods(scene_t *scene)
+{
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible || model->num_lods < 2)
+            continue;
+
+        float size = 0.0f;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            update_mesh_world_sphere(&model->meshes[j]);
+            size = fmaxf(size, projected_sphere_size(scene->view_projection, model->meshes[j].world_sphere));
+        }
+
+        // Move past a switch size only once the size is clear of it on the side we are going to
+        uint lod = 0;
+        while (lod + 1 < model->num_lods)
+        {
+            float bias = model->lod <= lod ? 1.0f - LOD_HYSTERESIS : 1.0f + LOD_HYSTERESIS;
+            if (size >= model->lods[lod + 1].switch_size * bias)
+                break;
+            ++lod;
+        }
+        if (lod == model->lod)
+            continue;
+
+        model->lod = lod;
+        model->meshes = model->lods[lod].meshes;
+        model->num_meshes = model->lods[lod].num_meshes;
+        update_model_mesh_transforms(scene, model);
+    }
+}
+
+/* Hides the meshes whose bounding box is behind the occluders, all on the CPU */
+static void occlusion_cull_scene(scene_t *scene)
+{
+    occlusion_buffer_t *ob = &scene->occlusion;
+    clear_occlusion_buffer(ob);
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible)
+            continue;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            mesh_t *mesh = &model->meshes[j];
+            if (!mesh->visible || !mesh->occluder)
+                continue;
+            update_mesh_draw_matrices(scene, mesh);
+            add_occluder(ob, mesh->mvp_mat, mesh->vertices, mesh->num_vertices, mesh->indices, mesh->num_indices);
+        }
+    }
+    if (!ob->num_triangles)
+        return;
+
+    rasterize_occluders(ob);
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible)
+            continue;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            mesh_t *mesh = &model->meshes[j];
+            if (!mesh->visible || mesh->occluder)
+                continue;
+            update_mesh_draw_matrices(scene, mesh);
+            if (!occlusion_box_visible(ob, mesh->mvp_mat, mesh->bounds.min, mesh->bounds.max))
+            {
+                mesh->visible = false;
+                ++scene->meshes_occluded;
+            }
+        }
+    }
+}
+
+/* Sets the visible flag of every mesh of the visible models to whether its bounding sphere
+   touches the frustum of the scene's view_projection and, if there are occluder meshes, whether
+   it is in front of them. Meshes merged into static batches are always hidden. Needs up to date transforms */
+void cull_scene(scene_t *scene)
+{
+    frustum_t frustum = frustum_from_matrix(scene->view_projection);
+    cull_spheres_t *spheres = &scene->cull_spheres;
+
+    spheres->count = 0;
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible)
+            continue;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            if (model->meshes[j].batched)
+                continue;
+            update_mesh_world_sphere(&model->meshes[j]);
+            push_cull_sphere(spheres, model->meshes[j].world_sphere);
+        }
+    }
+
+    frustum_cull_spheres(&frustum, spheres);
+
+    // Same walk as above, so the results come back in order
+    uint n = 0;
+    scene->meshes_culled = 0;
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (!model->visible)
+            continue;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            if (model->meshes[j].batched)
+            {
+                model->meshes[j].visible = false;
+                continue;
+            }
+            model->meshes[j].visible = spheres->visible[n++];
+            scene->meshes_culled += !model->meshes[j].visible;
+        }
+    }
+
+    scene->meshes_occluded = 0;
+    occlusion_cull_scene(scene);
 }
 
 #endif
@@ -4,52 +4,191 @@
 /* TODO: put an #ifdef for Windows / Linux OpenGL locations if needed */
 #include <GL/glx.h>
 #include <GL/glext.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "shinage_opengl_signatures.h"
 #include "shinage_debug.h"
 #include "shinage_utils.h"
+#include "shinage_textures.h"
 
-/* TODO: Add support for compute shaders, etc. in this file's functions */
+/* Fixed vertex attribute slots. Every program gets these bound before linking so the
+   mesh cache VAOs work with any of our shaders (GLSL 150 has no layout(location)) */
+typedef enum {
+    ATTRIB_POSITION = 0,
+    ATTRIB_NORMAL   = 1,
+    ATTRIB_TEXCOORD = 2,
+    ATTRIB_COLOUR   = 3,
+    /* Per-instance attributes. A mat4 takes 4 consecutive slots */
+    ATTRIB_INSTANCE_MODEL  = 4,
+    ATTRIB_INSTANCE_COLOUR = 8,
+    ATTRIB_DRAW_INDEX      = 9  // Per-instance index into the drawData buffer texture
+} vertex_attrib_t;
 
-/* Returns an OpenGL numeric ID to a compiled (but unlinked) shader program. */
-unsigned int build_shader(char *source, int type)
+/* Texture unit of the drawData buffer texture, right after the ones for materials */
+#define DRAW_DATA_TEXTURE_UNIT MAX_MATERIAL_TEXTURES
+/* Texture unit the depth pyramid is read from by the culling and reduction passes */
+#define HIZ_TEXTURE_UNIT (DRAW_DATA_TEXTURE_UNIT + 1)
+/* Buffer textures of clustered lighting, see light_clusters_t. They go in this order */
+#define LIGHT_DATA_TEXTURE_UNIT     (HIZ_TEXTURE_UNIT + 1)
+#define LIGHT_CLUSTERS_TEXTURE_UNIT (HIZ_TEXTURE_UNIT + 2)
+#define LIGHT_INDICES_TEXTURE_UNIT  (HIZ_TEXTURE_UNIT + 3)
+/* Tiles and depth slices of the cluster grid, shaders get them as defines of the same name */
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 9
+#define LIGHT_CLUSTERS_Z 24
+/* Targets of the G-buffer as the deferred lighting pass reads them, see gbuffer_t. Also in this order */
+#define GBUFFER_ALBEDO_TEXTURE_UNIT (LIGHT_INDICES_TEXTURE_UNIT + 1)
+#define GBUFFER_NORMAL_TEXTURE_UNIT (LIGHT_INDICES_TEXTURE_UNIT + 2)
+#define GBUFFER_DEPTH_TEXTURE_UNIT  (LIGHT_INDICES_TEXTURE_UNIT + 3)
+
+/* Colour attachments fragment shader outputs go to. Programs with a single output get the first one */
+typedef enum {
+    FRAG_DATA_COLOUR = 0,
+    FRAG_DATA_NORMAL = 1 // Second target of the G-buffer
+} frag_data_location_t;
+
+/* Uniform buffer binding points shared by every program */
+typedef enum {
+    FRAME_UNIFORMS_BINDING = 0 // FrameData block, see frame_uniforms_t
+} uniform_block_binding_t;
+
+/* Uniform location cache for a single call site. Relinking a program gives it a new ID,
+   so locations are looked up again after a shader hot reload instead of going stale */
+typedef struct {
+    unsigned int program;
+    int location;
+} uniform_cache_t;
+
+static inline int uniform_location(uniform_cache_t *cache, unsigned int program, char *name)
+{
+    if (cache->program != program)
+    {
+        cache->program = program;
+        cache->location = openGL.glGetUniformLocation(program, name);
+    }
+    return cache->location;
+}
+
+/* Points the uniform blocks a freshly linked program uses to their binding points */
+static inline void bind_uniform_blocks(unsigned int program)
+{
+    unsigned int index = openGL.glGetUniformBlockIndex(program, "FrameData");
+    if (index != GL_INVALID_INDEX)
+        openGL.glUniformBlockBinding(program, index, FRAME_UNIFORMS_BINDING);
+}
+
+static inline void bind_attrib_locations(unsigned int program)
+{
+    openGL.glBindAttribLocation(program, ATTRIB_POSITION, "position");
+    openGL.glBindAttribLocation(program, ATTRIB_POSITION, "vertex"); // font shader
+    openGL.glBindAttribLocation(program, ATTRIB_NORMAL,   "normal");
+    openGL.glBindAttribLocation(program, ATTRIB_TEXCOORD, "texCoords");
+    openGL.glBindAttribLocation(program, ATTRIB_COLOUR,   "vColor");
+    openGL.glBindAttribLocation(program, ATTRIB_INSTANCE_MODEL,  "instanceModel");
+    openGL.glBindAttribLocation(program, ATTRIB_INSTANCE_COLOUR, "instanceColor");
+    openGL.glBindAttribLocation(program, ATTRIB_DRAW_INDEX,      "drawIndex");
+}
+
+static inline void bind_frag_data_locations(unsigned int program)
+{
+    openGL.glBindFragDataLocation(program, FRAG_DATA_COLOUR, "out_color");
+    openGL.glBindFragDataLocation(program, FRAG_DATA_COLOUR, "out_albedo"); // G-buffer shader
+    openGL.glBindFragDataLocation(program, FRAG_DATA_NORMAL, "out_normal");
+}
+
+/* Points the samplers of the render queue a program has, the drawData and light cluster buffer textures
+   and the G-buffer targets, to their texture units. Leaves the program in use */
+static inline void bind_draw_data_unit(unsigned int program)
+{
+    static const struct { char *name; int unit; } samplers[] = {
+        { "drawData",      DRAW_DATA_TEXTURE_UNIT },
+        { "lightData",     LIGHT_DATA_TEXTURE_UNIT },
+        { "lightClusters", LIGHT_CLUSTERS_TEXTURE_UNIT },
+        { "lightIndices",  LIGHT_INDICES_TEXTURE_UNIT },
+        { "gAlbedo",       GBUFFER_ALBEDO_TEXTURE_UNIT },
+        { "gNormal",       GBUFFER_NORMAL_TEXTURE_UNIT },
+        { "gDepth",        GBUFFER_DEPTH_TEXTURE_UNIT },
+    };
+    for (uint i = 0; i < sizeof(samplers) / sizeof(samplers[0]); ++i)
+    {
+        int loc = openGL.glGetUniformLocation(program, samplers[i].name);
+        if (loc != -1)
+        {
+            gl_use_program(program);
+            openGL.glUniform1i(loc, samplers[i].unit);
+        }
+    }
+}
+
+/* Returns an OpenGL numeric ID to a compiled (but unlinked) shader program.
+   prelude, if not NULL, goes between the #version line of the source and the rest of it */
+unsigned int build_shader(char *source, int type, char *prelude)
 {
     char infoLog[512];
     unsigned int shader = openGL.glCreateShader(type);
-    openGL.glShaderSource(shader, 1, (const GLchar * const *)(&source), NULL);
+    char *body = strchr(source, '\n');
+    body = body ? body + 1 : source + strlen(source);
+    // Error messages keep the line numbers of the file
+    const GLchar *strings[] = { source, prelude ? prelude : "", "#line 2\n", body };
+    GLint lengths[] = { body - source, -1, -1, -1 };
+    openGL.glShaderSource(shader, 4, strings, lengths);
     openGL.glCompileShader(shader);
     int success;
     openGL.glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
     if (!success)
     {
         openGL.glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        char *type_str = type == GL_VERTEX_SHADER ? "VERTEX" : "FRAGMENT";
+        char *type_str = type == GL_VERTEX_SHADER ? "VERTEX" : type == GL_COMPUTE_SHADER ? "COMPUTE" : "FRAGMENT";
         log_err("Error: %s shader compilation failed: %s\n", type_str, infoLog);
     }
     // TODO: Maybe better error handling?
     return shader;
 }
 
-/* Returns an OpenGL numeric ID to a compiled (but unlinked) shader program. */
-unsigned int build_shader_from_file(char *pathname, int type)
+/* Returns the constants the C side shares with the shaders followed by the GLSL library at pathname, NULL if
+   it cannot be read. Loaded on each build so hot reloading picks up its changes */
+static char *load_shader_prelude(char *pathname)
+{
+    char *library = load_file(pathname);
+    if (!library)
+        return NULL;
+    char *defines = "#define LIGHT_CLUSTERS_X %d\n#define LIGHT_CLUSTERS_Y %d\n#define LIGHT_CLUSTERS_Z %d\n";
+    size_t size = strlen(defines) + 3 * 11 + strlen(library) + 1; // Room for any three ints
+    char *prelude = malloc(size);
+    int length = snprintf(prelude, size, defines, LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y, LIGHT_CLUSTERS_Z);
+    strcpy(prelude + length, library);
+    free(library);
+    return prelude;
+}
+
+/* Returns an OpenGL numeric ID to a compiled (but unlinked) shader program. See build_shader for prelude */
+unsigned int build_shader_from_file(char *pathname, int type, char *prelude)
 {
     char *file_contents = load_file(pathname);
-    unsigned int shader = build_shader(file_contents, type);
+    if (!file_contents)
+        return 0;
+    unsigned int shader = build_shader(file_contents, type, prelude);
     // Cleanup of unneeed buffer
     free(file_contents);
     return shader;
 }
 
-/* Takes two pathnames and builds a complete OpenGL program from them, then returns a the ID of said program */
-unsigned int make_gl_program(char *pathname_vertex, char *pathname_fragment)
+/* Takes two pathnames and builds a complete OpenGL program from them, then returns a the ID of said program.
+   pathname_library, if not NULL, is a GLSL library the fragment shader calls into, see load_shader_prelude */
+unsigned int make_gl_program(char *pathname_vertex, char *pathname_fragment, char *pathname_library)
 {
     char infoLog[512];
-    unsigned int vertex_shader = build_shader_from_file(pathname_vertex, GL_VERTEX_SHADER);
-    unsigned int fragment_shader = build_shader_from_file(pathname_fragment, GL_FRAGMENT_SHADER);
+    char *prelude = pathname_library ? load_shader_prelude(pathname_library) : NULL;
+    unsigned int vertex_shader = build_shader_from_file(pathname_vertex, GL_VERTEX_SHADER, NULL);
+    unsigned int fragment_shader = build_shader_from_file(pathname_fragment, GL_FRAGMENT_SHADER, prelude);
+    free(prelude);
 
     unsigned int program = openGL.glCreateProgram();
     openGL.glAttachShader(program, vertex_shader);
     openGL.glAttachShader(program, fragment_shader);
+    bind_attrib_locations(program);
+    bind_frag_data_locations(program);
     openGL.glLinkProgram(program);
 
     // print linking errors if any
@@ -66,7 +205,48 @@ unsigned int make_gl_program(char *pathname_vertex, char *pathname_fragment)
         // Cleanup of unneeded structures
         openGL.glDeleteShader(vertex_shader);
         openGL.glDeleteShader(fragment_shader);
+        bind_sampler_units(program);
+        bind_draw_data_unit(program);
+        bind_uniform_blocks(program);
+    }
+    return program;
+}
+
+/* Builds a program out of a single compute shader. Returns 0 if the context has no compute support (GL < 4.3) */
+unsigned int make_gl_compute_program(char *pathname)
+{
+    if (!gl_caps.compute_shaders)
+    {
+        log_debug("Compute shaders are not supported, skipping %s", pathname);
+        return 0;
+    }
+
+    char infoLog[512];
+    int success = 0;
+    unsigned int shader = build_shader_from_file(pathname, GL_COMPUTE_SHADER, NULL);
+    if (shader)
+        openGL.glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) // build_shader already logged why
+    {
+        openGL.glDeleteShader(shader);
+        return 0;
+    }
+
+    unsigned int program = openGL.glCreateProgram();
+    openGL.glAttachShader(program, shader);
+    openGL.glLinkProgram(program);
+    // The program keeps what it needs, whether it linked or not
+    openGL.glDeleteShader(shader);
+
+    openGL.glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        openGL.glGetProgramInfoLog(program, 512, NULL, infoLog);
+        log_err("Error: compute shader linking failed: %s\n", infoLog);
+        openGL.glDeleteProgram(program);
+        return 0;
     }
+    bind_uniform_blocks(program);
     return program;
 }
 
@@ -0,0 +1,477 @@
+#ifndef SHINAGE_SIMPLIFY_H
+#define SHINAGE_SIMPLIFY_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_scene.h"
+
+/* Mesh simplification with quadric error metrics (Garland and Heckbert), by half edge collapses:
+   a vertex is merged into one of its neighbours, which keeps its own position and attributes, so
+   no vertex data is ever made up. Vertices that share a position but not their attributes (UV
+   seams, hard normals) only move along the seam and together with their twin, and open borders
+   and points where more than two of them meet stay where they are */
+
+typedef enum
+{
+    SIMPLIFY_MANIFOLD, // Only vertex at its position, can collapse into any neighbour
+    SIMPLIFY_SEAM,     // One of two vertices at its position, collapses along the seam with the other
+    SIMPLIFY_LOCKED
+} simplify_vertex_kind_t;
+
+/* Sum of squared distances to a set of planes, as the upper half of a symmetric 4x4 matrix.
+   Each plane is weighted by the area of its triangle, w is the sum of those weights */
+typedef struct
+{
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+    double w;
+} quadric_t;
+
+/* Open addressing table from 64 bit keys to a uint32, for welding positions and finding edges */
+typedef struct
+{
+    uint64 *keys;
+    uint32 *values;
+    uint capacity; // Power of two
+} simplify_table_t;
+
+#define SIMPLIFY_EMPTY_KEY (~0ull)
+
+static void init_simplify_table(simplify_table_t *table, uint count)
+{
+    table->capacity = 16;
+    while (table->capacity < count * 2)
+        table->capacity *= 2;
+    table->keys = malloc(sizeof(uint64) * table->capacity);
+    table->values = calloc(table->capacity, sizeof(uint32));
+    memset(table->keys, 0xff, sizeof(uint64) * table->capacity);
+}
+
+static void destroy_simplify_table(simplify_table_t *table)
+{
+    free(table->keys);
+    free(table->values);
+}
+
+/* Slot of a key, inserted with value 0 if it was not there. *found tells which */
+static uint32 *simplify_table_slot(simplify_table_t *table, uint64 key, bool *found)
+{
+    uint64 hash = key * 0x9e3779b97f4a7c15ull;
+    uint i = (uint)(hash >> 32) & (table->capacity - 1);
+    while (table->keys[i] != SIMPLIFY_EMPTY_KEY && table->keys[i] != key)
+        i = (i + 1) & (table->capacity - 1);
+    *found = table->keys[i] == key;
+    table->keys[i] = key;
+    return &table->values[i];
+}
+
+static quadric_t triangle_quadric(vec3f p0, vec3f p1, vec3f p2)
+{
+    quadric_t q = {0};
+    vec3f n = cross_product3f(diff3f(p1, p0), diff3f(p2, p0));
+    float length = length3f(n);
+    if (length == 0.0f)
+        return q;
+    // Weighted by area, so big triangles keep more of their shape than slivers
+    double w = length * 0.5, a = n.x / length, b = n.y / length, c = n.z / length;
+    double d = -(a * p0.x + b * p0.y + c * p0.z);
+    q.a2 = w * a * a; q.ab = w * a * b; q.ac = w * a * c; q.ad = w * a * d;
+    q.b2 = w * b * b; q.bc = w * b * c; q.bd = w * b * d;
+    q.c2 = w * c * c; q.cd = w * c * d;
+    q.d2 = w * d * d;
+    q.w = w;
+    return q;
+}
+
+static void add_quadric(quadric_t *q, quadric_t *r)
+{
+    q->a2 += r->a2; q->ab += r->ab; q->ac += r->ac; q->ad += r->ad;
+    q->b2 += r->b2; q->bc += r->bc; q->bd += r->bd;
+    q->c2 += r->c2; q->cd += r->cd;
+    q->d2 += r->d2;
+    q->w += r->w;
+}
+
+static double quadric_error(quadric_t *q, vec3f p)
+{
+    double x = p.x, y = p.y, z = p.z;
+    double e = q->a2 * x * x + q->b2 * y * y + q->c2 * z * z + q->d2
+        + 2.0 * (q->ab * x * y + q->ac * x * z + q->ad * x + q->bc * y * z + q->bd * y + q->cd * z);
+    return e > 0.0 ? e : 0.0;
+}
+
+typedef struct
+{
+    uint32 from, to;
+    double error;    // Area weighted, what collapses are ranked by
+    double distance; // Squared, the mean over the area of the planes, what max_error bounds
+} simplify_collapse_t;
+
+static int compare_simplify_collapses(const void *a, const void *b)
+{
+    double ea = ((const simplify_collapse_t*)a)->error, eb = ((const simplify_collapse_t*)b)->error;
+    return (ea > eb) - (ea < eb);
+}
+
+/* Working state of simplify_mesh. Positions are identified by the first vertex found at each */
+typedef struct
+{
+    vec3f *vertices;
+    uint num_vertices;
+    uint32 *indices;
+    uint num_indices;
+    uint32 *position;   // Vertex to position
+    uint32 *wedge;      // Next vertex at the same position, in a circular list
+    uint8 *kind;        // simplify_vertex_kind_t, per vertex
+    quadric_t *quadrics; // Per position
+    // Triangles around each position, rebuilt each pass
+    uint32 *adjacency_offsets, *adjacency;
+    uint32 *marks;       // Per position, scratch for the checks
+    uint32 stamp;
+} simplifier_t;
+
+static void build_simplify_adjacency(simplifier_t *s)
+{
+    memset(s->adjacency_offsets, 0, sizeof(uint32) * (s->num_vertices + 1));
+    for (uint i = 0; i < s->num_indices; ++i)
+        ++s->adjacency_offsets[s->position[s->indices[i]] + 1];
+    for (uint i = 0; i < s->num_vertices; ++i)
+        s->adjacency_offsets[i + 1] += s->adjacency_offsets[i];
+    // Fill using the start of each position as its cursor, which leaves it at the start of the next
+    for (uint i = 0; i < s->num_indices; ++i)
+        s->adjacency[s->adjacency_offsets[s->position[s->indices[i]]]++] = i / 3;
+    for (uint i = s->num_vertices; i > 0; --i)
+        s->adjacency_offsets[i] = s->adjacency_offsets[i - 1];
+    s->adjacency_offsets[0] = 0;
+}
+
+static inline bool triangle_has_position(simplifier_t *s, uint triangle, uint32 p)
+{
+    uint32 *t = s->indices + 3 * triangle;
+    return s->position[t[0]] == p || s->position[t[1]] == p || s->position[t[2]] == p;
+}
+
+/* Whether there is a triangle with an edge between vertices a and b */
+static bool simplify_edge_exists(simplifier_t *s, uint32 a, uint32 b)
+{
+    uint32 p = s->position[a];
+    for (uint i = s->adjacency_offsets[p]; i < s->adjacency_offsets[p + 1]; ++i)
+    {
+        uint32 *t = s->indices + 3 * s->adjacency[i];
+        bool has_a = t[0] == a || t[1] == a || t[2] == a;
+        bool has_b = t[0] == b || t[1] == b || t[2] == b;
+        if (has_a && has_b)
+            return true;
+    }
+    return false;
+}
+
+/* Link condition: an interior edge can only collapse if its ends share exactly the two neighbours
+   across it, anything else pinches the surface */
+static bool simplify_link_ok(simplifier_t *s, uint32 from, uint32 to)
+{
+    uint32 seen = ++s->stamp, counted = ++s->stamp;
+    for (uint i = s->adjacency_offsets[from]; i < s->adjacency_offsets[from + 1]; ++i)
+        for (uint k = 0; k < 3; ++k)
+            s->marks[s->position[s->indices[3 * s->adjacency[i] + k]]] = seen;
+
+    uint shared = 0;
+    for (uint i = s->adjacency_offsets[to]; i < s->adjacency_offsets[to + 1]; ++i)
+        for (uint k = 0; k < 3; ++k)
+        {
+            uint32 p = s->position[s->indices[3 * s->adjacency[i] + k]];
+            if (p != from && p != to && s->marks[p] == seen)
+            {
+                s->marks[p] = counted;
+                ++shared;
+            }
+        }
+    return shared <= 2;
+}
+
+/* Whether moving position from onto to turns any of the triangles that survive by 90 degrees or more */
+static bool simplify_collapse_flips(simplifier_t *s, uint32 from, uint32 to)
+{
+    for (uint i = s->adjacency_offsets[from]; i < s->adjacency_offsets[from + 1]; ++i)
+    {
+        uint triangle = s->adjacency[i];
+        if (triangle_has_position(s, triangle, to))
+            continue;
+        vec3f before[3], after[3];
+        for (uint k = 0; k < 3; ++k)
+        {
+            uint32 p = s->position[s->indices[3 * triangle + k]];
+            before[k] = s->vertices[p];
+            after[k] = p == from ? s->vertices[to] : before[k];
+        }
+        vec3f n0 = cross_product3f(diff3f(before[1], before[0]), diff3f(before[2], before[0]));
+        vec3f n1 = cross_product3f(diff3f(after[1], after[0]), diff3f(after[2], after[0]));
+        if (dot_product3f(n0, n1) <= 0.0f)
+            return true;
+    }
+    return false;
+}
+
+/* Sorts out which vertices share a position and which of them are free to move. Positions are
+   welded on a grid of 2^20 steps across the bounds, which is enough to put together the copies
+   of a vertex that only differ by rounding */
+static void classify_simplify_vertices(simplifier_t *s, bounds_t *bounds)
+{
+    simplify_table_t table;
+    init_simplify_table(&table, s->num_vertices);
+    vec3f extent = diff3f(bounds->max, bounds->min);
+    float largest = fmaxf(extent.x, fmaxf(extent.y, extent.z));
+    float scale = largest > 0.0f ? (1 << 20) / largest : 1.0f;
+    for (uint i = 0; i < s->num_vertices; ++i)
+    {
+        vec3f v = diff3f(s->vertices[i], bounds->min);
+        uint64 key = ((uint64)lroundf(v.x * scale) << 42) | ((uint64)lroundf(v.y * scale) << 21) | (uint64)lroundf(v.z * scale);
+        bool found;
+        uint32 *first = simplify_table_slot(&table, key, &found);
+        if (!found)
+            *first = i;
+        s->position[i] = *first;
+        s->wedge[i] = i;
+        if (found)
+        {
+            s->wedge[i] = s->wedge[*first];
+            s->wedge[*first] = i;
+        }
+    }
+    destroy_simplify_table(&table);
+
+    for (uint i = 0; i < s->num_vertices; ++i)
+    {
+        uint wedges = 1;
+        for (uint32 w = s->wedge[i]; w != i; w = s->wedge[w])
+            ++wedges;
+        s->kind[i] = wedges == 1 ? SIMPLIFY_MANIFOLD : wedges == 2 ? SIMPLIFY_SEAM : SIMPLIFY_LOCKED;
+    }
+
+    // Edges between positions have to be used once each way, or they are on a border or worse
+    simplify_table_t edges;
+    init_simplify_table(&edges, s->num_indices * 2);
+    for (uint i = 0; i < s->num_indices; ++i)
+    {
+        uint64 a = s->position[s->indices[i]], b = s->position[s->indices[i - i % 3 + (i + 1) % 3]];
+        bool found;
+        ++*simplify_table_slot(&edges, (a << 32) | b, &found);
+    }
+    for (uint i = 0; i < s->num_indices; ++i)
+    {
+        uint64 a = s->position[s->indices[i]], b = s->position[s->indices[i - i % 3 + (i + 1) % 3]];
+        bool found;
+        uint32 forward = *simplify_table_slot(&edges, (a << 32) | b, &found);
+        uint32 *backward = simplify_table_slot(&edges, (b << 32) | a, &found);
+        if (forward != 1 || *backward != 1)
+        {
+            s->kind[s->indices[i]] = SIMPLIFY_LOCKED;
+            s->kind[s->indices[i - i % 3 + (i + 1) % 3]] = SIMPLIFY_LOCKED;
+        }
+    }
+    destroy_simplify_table(&edges);
+
+    // Every vertex at a position has to agree
+    for (uint i = 0; i < s->num_vertices; ++i)
+        if (s->kind[i] == SIMPLIFY_LOCKED)
+            for (uint32 w = s->wedge[i]; w != i; w = s->wedge[w])
+                s->kind[w] = SIMPLIFY_LOCKED;
+}
+
+/* Returns a copy of the mesh with at most target_triangles triangles, or as close as it gets
+   without moving the surface further than max_error, given as a fraction of the radius of the
+   mesh bounds. The distance is the root mean square, over their area, of the distances to the
+   planes of every original triangle merged into a position. Pass INFINITY to only go by the
+   triangle count. The copy has the same attributes,
+   and no material, program or transform */
+mesh_t *simplify_mesh(mesh_t *mesh, uint target_triangles, float max_error)
+{
+    simplifier_t s = {0};
+    s.vertices = mesh->vertices;
+    s.num_vertices = mesh->num_vertices;
+    s.num_indices = mesh->num_indices - mesh->num_indices % 3;
+    s.indices = malloc(sizeof(uint32) * (s.num_indices + 1));
+    memcpy(s.indices, mesh->indices, sizeof(uint32) * s.num_indices);
+    s.position = malloc(sizeof(uint32) * s.num_vertices);
+    s.wedge = malloc(sizeof(uint32) * s.num_vertices);
+    s.kind = malloc(s.num_vertices);
+    s.quadrics = calloc(s.num_vertices, sizeof(quadric_t));
+    s.adjacency_offsets = malloc(sizeof(uint32) * (s.num_vertices + 1));
+    s.adjacency = malloc(sizeof(uint32) * (s.num_indices + 1));
+    s.marks = calloc(s.num_vertices, sizeof(uint32));
+
+    float radius = mesh->bounds.sphere.w;
+    classify_simplify_vertices(&s, &mesh->bounds);
+    for (uint i = 0; i < s.num_indices; i += 3)
+    {
+        uint32 *t = s.indices + i;
+        quadric_t q = triangle_quadric(s.vertices[t[0]], s.vertices[t[1]], s.vertices[t[2]]);
+        for (uint k = 0; k < 3; ++k)
+            add_quadric(&s.quadrics[s.position[t[k]]], &q);
+    }
+
+    double error_limit = (double)max_error * radius;
+    error_limit *= error_limit;
+    uint32 *remap = malloc(sizeof(uint32) * s.num_vertices);
+    uint8 *touched = malloc(s.num_vertices);
+    simplify_collapse_t *collapses = malloc(sizeof(simplify_collapse_t) * (s.num_indices * 2 + 1));
+
+    // Each pass collapses the cheapest edges it can without two of them touching the same area,
+    // so every check is made against the mesh as it really is
+    uint num_triangles = s.num_indices / 3;
+    while (num_triangles > target_triangles)
+    {
+        build_simplify_adjacency(&s);
+        uint num_collapses = 0;
+        for (uint i = 0; i < s.num_indices; ++i)
+        {
+            uint32 a = s.indices[i], b = s.indices[i - i % 3 + (i + 1) % 3];
+            for (uint k = 0; k < 2; ++k)
+            {
+                uint32 from = k ? b : a, to = k ? a : b;
+                bool allowed = s.kind[from] == SIMPLIFY_MANIFOLD ||
+                    (s.kind[from] == SIMPLIFY_SEAM && s.kind[to] == SIMPLIFY_SEAM);
+                if (!allowed || s.position[from] == s.position[to])
+                    continue;
+                // Both ends, so the error of earlier collapses into to is not forgotten
+                quadric_t q = s.quadrics[s.position[from]];
+                add_quadric(&q, &s.quadrics[s.position[to]]);
+                simplify_collapse_t *c = &collapses[num_collapses++];
+                c->from = from;
+                c->to = to;
+                c->error = quadric_error(&q, s.vertices[to]);
+                c->distance = q.w > 0.0 ? c->error / q.w : 0.0;
+            }
+        }
+        qsort(collapses, num_collapses, sizeof(simplify_collapse_t), compare_simplify_collapses);
+
+        for (uint i = 0; i < s.num_vertices; ++i)
+            remap[i] = i;
+        memset(touched, 0, s.num_vertices);
+        uint removed = 0, collapsed = 0;
+        for (uint i = 0; i < num_collapses && num_triangles - removed > target_triangles; ++i)
+        {
+            simplify_collapse_t *c = &collapses[i];
+            if (c->distance > error_limit)
+                continue;
+            uint32 from = s.position[c->from], to = s.position[c->to];
+            if (touched[from] || touched[to])
+                continue;
+
+            // Seams move both sides at once, along an edge both of them have
+            uint32 twin_from = s.wedge[c->from], twin_to = s.wedge[c->to];
+            if (s.kind[c->from] == SIMPLIFY_SEAM && !simplify_edge_exists(&s, twin_from, twin_to))
+                continue;
+            if (!simplify_link_ok(&s, from, to) || simplify_collapse_flips(&s, from, to))
+                continue;
+
+            remap[c->from] = c->to;
+            if (s.kind[c->from] == SIMPLIFY_SEAM)
+                remap[twin_from] = twin_to;
+            add_quadric(&s.quadrics[to], &s.quadrics[from]);
+            for (uint k = s.adjacency_offsets[from]; k < s.adjacency_offsets[from + 1]; ++k)
+            {
+                uint triangle = s.adjacency[k];
+                removed += triangle_has_position(&s, triangle, to);
+                for (uint j = 0; j < 3; ++j)
+                    touched[s.position[s.indices[3 * triangle + j]]] = 1;
+            }
+            ++collapsed;
+        }
+        if (!collapsed)
+            break;
+
+        // Remap, dropping the triangles that collapsed along with their edge
+        uint n = 0;
+        for (uint i = 0; i < s.num_indices; i += 3)
+        {
+            uint32 a = remap[s.indices[i]], b = remap[s.indices[i + 1]], c = remap[s.indices[i + 2]];
+            if (s.position[a] == s.position[b] || s.position[b] == s.position[c] || s.position[a] == s.position[c])
+                continue;
+            s.indices[n++] = a;
+            s.indices[n++] = b;
+            s.indices[n++] = c;
+        }
+        s.num_indices = n;
+        num_triangles = n / 3;
+    }
+
+    // Copy out the vertices still in use, in the order they are first used
+    for (uint i = 0; i < s.num_vertices; ++i)
+        remap[i] = ~0u;
+    uint num_vertices = 0;
+    for (uint i = 0; i < s.num_indices; ++i)
+    {
+        if (remap[s.indices[i]] == ~0u)
+            remap[s.indices[i]] = num_vertices++;
+        s.indices[i] = remap[s.indices[i]];
+    }
+
+    mesh_t *result = (mesh_t*) calloc(1, sizeof(mesh_t));
+    result->num_vertices = num_vertices;
+    result->num_indices = s.num_indices;
+    result->indices = realloc(s.indices, sizeof(uint32) * (s.num_indices + 1));
+    result->vertices = malloc(sizeof(vec3f) * num_vertices);
+    if (mesh->normals)
+        result->normals = malloc(sizeof(vec3f) * num_vertices);
+    if (mesh->tex_coords)
+        result->tex_coords = malloc(sizeof(vec2f) * num_vertices);
+    if (mesh->colours)
+        result->colours = malloc(sizeof(vec3f) * num_vertices);
+    for (uint i = 0; i < s.num_vertices; ++i)
+    {
+        uint32 v = remap[i];
+        if (v == ~0u)
+            continue;
+        result->vertices[v] = mesh->vertices[i];
+        if (mesh->normals)
+            result->normals[v] = mesh->normals[i];
+        if (mesh->tex_coords)
+            result->tex_coords[v] = mesh->tex_coords[i];
+        if (mesh->colours)
+            result->colours[v] = mesh->colours[i];
+    }
+    result->model_mat = identity_matrix_4x4;
+    result->visible = true;
+    compute_mesh_bounds(result);
+
+    free(s.position);
+    free(s.wedge);
+    free(s.kind);
+    free(s.quadrics);
+    free(s.adjacency_offsets);
+    free(s.adjacency);
+    free(s.marks);
+    free(remap);
+    free(touched);
+    free(collapses);
+    return result;
+}
+
+/* Gives a model coarser levels of detail by simplifying the meshes of its first level, each level
+   with half the triangles of the one before. The first is used below switch_size and the next ones
+   each time the size halves again */
+void add_simplified_lods(model_t *model, float switch_size)
+{
+    mesh_t *first = model->num_lods ? model->lods[0].meshes : model->meshes;
+    uint num_meshes = model->num_lods ? model->lods[0].num_meshes : model->num_meshes;
+    float ratio = 0.5f;
+    while (model->num_lods < MAX_LODS)
+    {
+        mesh_t *meshes = calloc(num_meshes, sizeof(mesh_t));
+        for (uint i = 0; i < num_meshes; ++i)
+        {
+            mesh_t *simplified = simplify_mesh(&first[i], (uint)(first[i].num_indices / 3 * ratio), INFINITY);
+            meshes[i] = *simplified;
+            free(simplified);
+        }
+        add_model_lod(model, meshes, num_meshes, switch_size);
+        switch_size *= 0.5f;
+        ratio *= 0.5f;
+    }
+}
+
+#endif
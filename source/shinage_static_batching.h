@@ -0,0 +1,189 @@
+#ifndef SHINAGE_STATIC_BATCHING_H
+#define SHINAGE_STATIC_BATCHING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_scene.h"
+
+/* Static batching: meshes flagged static_geometry never move once built, so we pre-transform them to
+   world space and merge those that share a spatial cell, program, material and vertex attributes into
+   a single mesh. Each batch is then culled and drawn like any other mesh, with an identity transform */
+
+/* Optional vertex attributes of a mesh as a bit mask, meshes are only merged with those having the same ones */
+static uint mesh_attribute_mask(mesh_t *mesh)
+{
+    return (mesh->normals ? 1 : 0) | (mesh->tex_coords ? 2 : 0) | (mesh->colours ? 4 : 0);
+}
+
+typedef struct
+{
+    int cell[3];
+    uintptr_t program;
+    uintptr_t material;
+    uint attributes;
+    bool occluder;
+    mesh_t *mesh;
+} static_batch_entry_t;
+
+static int compare_static_batch_entries(const void *a, const void *b)
+{
+    const static_batch_entry_t *x = a, *y = b;
+    for (uint i = 0; i < 3; ++i)
+        if (x->cell[i] != y->cell[i])
+            return x->cell[i] < y->cell[i] ? -1 : 1;
+    if (x->program != y->program)
+        return x->program < y->program ? -1 : 1;
+    if (x->material != y->material)
+        return x->material < y->material ? -1 : 1;
+    if (x->attributes != y->attributes)
+        return x->attributes < y->attributes ? -1 : 1;
+    return (int)x->occluder - (int)y->occluder;
+}
+
+/* Appends the vertices and triangles of a mesh, transformed by its final matrix, to a batch being built */
+static void append_static_mesh(mesh_t *batch, mesh_t *mesh)
+{
+    mat4x4f m = mesh->preprocessed_model_mat;
+    mat3x3f normal = normal_matrix_mat3x3f(m);
+    uint32 base = batch->num_vertices;
+
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+    {
+        vec4f p = { .x = mesh->vertices[i].x, .y = mesh->vertices[i].y, .z = mesh->vertices[i].z, .w = 1.0f };
+        p = mat4x4f_vec4f_prod(m, p);
+        vec3f world = { .x = p.x, .y = p.y, .z = p.z };
+        batch->vertices[base + i] = world;
+        if (mesh->normals)
+        {
+            vec3f n = {
+                .x = dot_product3f(normal.rows[0], mesh->normals[i]),
+                .y = dot_product3f(normal.rows[1], mesh->normals[i]),
+                .z = dot_product3f(normal.rows[2], mesh->normals[i])
+            };
+            batch->normals[base + i] = normalize3f(n);
+        }
+        if (mesh->tex_coords)
+            batch->tex_coords[base + i] = mesh->tex_coords[i];
+        if (mesh->colours)
+            batch->colours[base + i] = mesh->colours[i];
+    }
+    batch->num_vertices += mesh->num_vertices;
+
+    // Mirroring transforms turn the triangles around, swap two corners to keep them facing out
+    vec3f x = { .x = m.a1, .y = m.a2, .z = m.a3 };
+    vec3f y = { .x = m.b1, .y = m.b2, .z = m.b3 };
+    vec3f z = { .x = m.c1, .y = m.c2, .z = m.c3 };
+    bool mirrored = dot_product3f(cross_product3f(x, y), z) < 0.0f;
+    for (uint i = 0; i + 2 < mesh->num_indices; i += 3)
+    {
+        uint32 *out = &batch->indices[batch->num_indices];
+        out[0] = base + mesh->indices[i];
+        out[1] = base + mesh->indices[i + (mirrored ? 2 : 1)];
+        out[2] = base + mesh->indices[i + (mirrored ? 1 : 2)];
+        batch->num_indices += 3;
+    }
+}
+
+/* Merges the meshes flagged static_geometry into one mesh per cell of a grid of cell_size and per program,
+   material and set of vertex attributes. The batches go to a new root model, which is returned, and the
+   merged meshes are flagged batched so they are no longer culled or drawn on their own: hiding their models
+   or moving them has no effect from then on. Meshes of models with levels of detail are left alone. Can be
+   called again to batch static meshes added later. Returns NULL if there was nothing to batch */
+model_t *build_static_batches(scene_t *scene, float cell_size)
+{
+    update_scene_transforms(scene);
+
+    uint num_entries = 0;
+    for (uint i = 0; i < scene->num_models; ++i)
+        for (uint j = 0; j < scene->models[i].num_meshes; ++j)
+            num_entries += scene->models[i].meshes[j].static_geometry && !scene->models[i].meshes[j].batched &&
+                !scene->models[i].num_lods;
+    if (!num_entries)
+        return NULL;
+
+    static_batch_entry_t *entries = malloc(sizeof(static_batch_entry_t) * num_entries);
+    uint n = 0;
+    for (uint i = 0; i < scene->num_models; ++i)
+    {
+        model_t *model = &scene->models[i];
+        if (model->num_lods)
+            continue;
+        for (uint j = 0; j < model->num_meshes; ++j)
+        {
+            mesh_t *mesh = &model->meshes[j];
+            if (!mesh->static_geometry || mesh->batched)
+                continue;
+            update_mesh_world_sphere(mesh);
+            static_batch_entry_t *e = &entries[n++];
+            e->cell[0] = (int)floorf(mesh->world_sphere.x / cell_size);
+            e->cell[1] = (int)floorf(mesh->world_sphere.y / cell_size);
+            e->cell[2] = (int)floorf(mesh->world_sphere.z / cell_size);
+            e->program = (uintptr_t)mesh->program;
+            e->material = (uintptr_t)mesh->material;
+            e->attributes = mesh_attribute_mask(mesh);
+            e->occluder = mesh->occluder;
+            e->mesh = mesh;
+        }
+    }
+    qsort(entries, num_entries, sizeof(static_batch_entry_t), compare_static_batch_entries);
+
+    uint num_batches = 0;
+    for (uint i = 0; i < num_entries; ++i)
+        num_batches += !i || compare_static_batch_entries(&entries[i - 1], &entries[i]);
+
+    // Adding the model may move the models array, so no model pointers are kept from here on
+    model_t *batches = add_model(scene, -1);
+    batches->meshes = calloc(num_batches, sizeof(mesh_t));
+    batches->num_meshes = batches->_max_meshes = num_batches;
+
+    uint first = 0;
+    for (uint b = 0; b < num_batches; ++b)
+    {
+        uint last = first + 1;
+        while (last < num_entries && !compare_static_batch_entries(&entries[first], &entries[last]))
+            ++last;
+
+        uint num_vertices = 0, num_indices = 0;
+        for (uint i = first; i < last; ++i)
+        {
+            num_vertices += entries[i].mesh->num_vertices;
+            num_indices += entries[i].mesh->num_indices / 3 * 3;
+        }
+
+        mesh_t *source = entries[first].mesh;
+        mesh_t *batch = &batches->meshes[b];
+        batch->vertices = malloc(sizeof(vec3f) * num_vertices);
+        batch->indices = malloc(sizeof(uint32) * num_indices);
+        if (source->normals)
+            batch->normals = malloc(sizeof(vec3f) * num_vertices);
+        if (source->tex_coords)
+            batch->tex_coords = malloc(sizeof(vec2f) * num_vertices);
+        if (source->colours)
+            batch->colours = malloc(sizeof(vec3f) * num_vertices);
+        batch->_max_vertices = num_vertices;
+        for (uint i = first; i < last; ++i)
+        {
+            append_static_mesh(batch, entries[i].mesh);
+            entries[i].mesh->batched = true;
+            entries[i].mesh->visible = false;
+        }
+
+        batch->program = source->program;
+        batch->material = source->material;
+        batch->occluder = source->occluder;
+        batch->model_mat = identity_matrix_4x4;
+        batch->visible = true;
+        compute_mesh_bounds(batch);
+        first = last;
+    }
+
+    log_info("Merged %u static meshes into %u batches", num_entries, num_batches);
+    free(entries);
+    return batches;
+}
+
+#endif
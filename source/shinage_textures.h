@@ -0,0 +1,271 @@
+#ifndef SHINAGE_TEXTURES_H
+#define SHINAGE_TEXTURES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/glx.h>
+#include <GL/glext.h>
+#include "shinage_ints.h"
+#include "shinage_debug.h"
+#include "shinage_opengl_signatures.h"
+
+/* Handles pack the slot index in the low 16 bits and the slot generation in the high ones,
+   so a handle to a destroyed texture never aliases whatever reuses its slot. 0 is never valid */
+typedef uint32 texture_handle_t;
+
+#define INVALID_TEXTURE_HANDLE 0
+
+/* Sampler uniform names for each texture unit of a material, in order */
+char *material_sampler_names[] = { "tex", "tex1", "tex2", "tex3" };
+#define MAX_MATERIAL_TEXTURES (sizeof(material_sampler_names)/sizeof(material_sampler_names[0]))
+
+typedef struct
+{
+    uint gl_id;          // 0 on free slots
+    uint16 generation;
+    uint ref_count;
+    uint64 key;          // Hash of the path or of the texel data, used for deduplication
+    bool from_file;
+    void *source;        // Copy of what the key hashes, compared on key matches so colliding hashes never alias
+    size_t source_size;
+    int width, height, channels;
+    size_t bytes;        // Estimated GPU memory, mip chain included
+} texture_t;
+
+typedef struct
+{
+    uint num_textures, _max_textures;
+    texture_t *textures;
+    size_t resident_bytes;
+} texture_manager_t;
+
+static inline uint64 fnv1a_hash(const void *data, size_t size, uint64 h)
+{
+    const uint8 *bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= bytes[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+#define FNV1A_SEED 0xCBF29CE484222325ull
+
+static inline texture_handle_t make_texture_handle(texture_manager_t *tm, uint slot)
+{
+    return ((uint32)tm->textures[slot].generation << 16) | (slot + 1);
+}
+
+/* Returns the texture a handle points to, or NULL if the handle is stale or invalid */
+texture_t *get_texture(texture_manager_t *tm, texture_handle_t handle)
+{
+    uint slot = (handle & 0xFFFF) - 1;
+    if (handle == INVALID_TEXTURE_HANDLE || slot >= tm->_max_textures)
+        return NULL;
+    texture_t *t = &tm->textures[slot];
+    if (!t->gl_id || t->generation != (handle >> 16))
+        return NULL;
+    return t;
+}
+
+/* Looks for a live texture made from the same source and takes a reference to it. The size is only
+   known beforehand for texel data, file textures are told apart by their path alone */
+static texture_handle_t find_texture(texture_manager_t *tm, uint64 key, bool from_file, const void *source, size_t source_size,
+                                     int width, int height, int channels)
+{
+    for (uint i = 0; i < tm->_max_textures; ++i)
+    {
+        texture_t *t = &tm->textures[i];
+        if (!t->gl_id || t->key != key || t->from_file != from_file || t->source_size != source_size)
+            continue;
+        if (!from_file && (t->width != width || t->height != height || t->channels != channels))
+            continue;
+        if (memcmp(t->source, source, source_size))
+            continue;
+        ++t->ref_count;
+        return make_texture_handle(tm, i);
+    }
+    return INVALID_TEXTURE_HANDLE;
+}
+
+static uint alloc_texture_slot(texture_manager_t *tm)
+{
+    for (uint i = 0; i < tm->_max_textures; ++i)
+        if (!tm->textures[i].gl_id)
+            return i;
+
+    uint old_max = tm->_max_textures;
+    tm->_max_textures = old_max ? old_max * 2 : 16;
+    tm->textures = realloc(tm->textures, sizeof(texture_t) * tm->_max_textures);
+    memset(tm->textures + old_max, 0, sizeof(texture_t) * (tm->_max_textures - old_max));
+    return old_max;
+}
+
+static texture_handle_t upload_texture(texture_manager_t *tm, uint64 key, bool from_file, const void *source, size_t source_size,
+                                       int width, int height, int channels, const uint8 *texels)
+{
+    if (tm->num_textures >= 0xFFFF)
+    {
+        log_err("Error: too many live textures");
+        return INVALID_TEXTURE_HANDLE;
+    }
+    GLenum format = channels == 4 ? GL_RGBA : channels == 3 ? GL_RGB : GL_RED;
+
+    uint slot = alloc_texture_slot(tm);
+    texture_t *t = &tm->textures[slot];
+    glGenTextures(1, &t->gl_id);
+    glBindTexture(GL_TEXTURE_2D, t->gl_id);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    /* Rows of our texel data are tightly packed, whoever uploads after us may not expect it */
+    int alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    openGL.glGenerateMipmap(GL_TEXTURE_2D);
+
+    t->ref_count = 1;
+    t->key = key;
+    t->from_file = from_file;
+    t->source = malloc(source_size);
+    memcpy(t->source, source, source_size);
+    t->source_size = source_size;
+    t->width = width;
+    t->height = height;
+    t->channels = channels;
+    // The full mip chain adds roughly a third on top of the base level
+    t->bytes = ((size_t)width * height * channels * 4) / 3;
+    tm->resident_bytes += t->bytes;
+    ++tm->num_textures;
+
+    return make_texture_handle(tm, slot);
+}
+
+/* Creates a texture from tightly packed 8 bit texels with 1, 3 or 4 channels.
+   Textures with the same content are only uploaded once; each call takes a reference */
+texture_handle_t texture_from_texels(texture_manager_t *tm, int width, int height, int channels, const uint8 *texels)
+{
+    int dims[] = { width, height, channels };
+    size_t size = (size_t)width * height * channels;
+    uint64 key = fnv1a_hash(dims, sizeof(dims), FNV1A_SEED);
+    key = fnv1a_hash(texels, size, key);
+
+    texture_handle_t handle = find_texture(tm, key, false, texels, size, width, height, channels);
+    if (handle != INVALID_TEXTURE_HANDLE)
+        return handle;
+    return upload_texture(tm, key, false, texels, size, width, height, channels, texels);
+}
+
+/* Reads a binary (P6) PPM file. Returns a heap-allocated buffer of RGB texels or NULL on error */
+uint8 *load_ppm(char *pathname, int *width, int *height)
+{
+    FILE *f = fopen(pathname, "rb");
+    if (!f)
+    {
+        log_err("Error: fail trying to read image at %s", pathname);
+        return NULL;
+    }
+
+    int max_value;
+    uint8 *texels = NULL;
+    if (fscanf(f, "P6 %d %d %d", width, height, &max_value) != 3 || max_value != 255 || *width <= 0 || *height <= 0)
+    {
+        log_err("Error: %s is not an 8 bit binary PPM file", pathname);
+    }
+    else
+    {
+        fgetc(f); // Single whitespace between header and data
+        size_t size = (size_t)*width * *height * 3;
+        texels = malloc(size);
+        if (fread(texels, 1, size, f) != size)
+        {
+            log_err("Error: truncated PPM file %s", pathname);
+            free(texels);
+            texels = NULL;
+        }
+    }
+    fclose(f);
+    return texels;
+}
+
+/* Loads a texture from an image file. Each path is only read and uploaded once; later calls
+   just take a reference to the resident texture. Only binary PPM is supported for now */
+texture_handle_t texture_from_file(texture_manager_t *tm, char *pathname)
+{
+    size_t length = strlen(pathname);
+    uint64 key = fnv1a_hash(pathname, length, FNV1A_SEED);
+    texture_handle_t handle = find_texture(tm, key, true, pathname, length, 0, 0, 0);
+    if (handle != INVALID_TEXTURE_HANDLE)
+        return handle;
+
+    int width, height;
+    uint8 *texels = load_ppm(pathname, &width, &height);
+    if (!texels)
+        return INVALID_TEXTURE_HANDLE;
+    handle = upload_texture(tm, key, true, pathname, length, width, height, 3, texels);
+    free(texels);
+    return handle;
+}
+
+/* Drops a reference to a texture, destroying it when nobody else holds one */
+void release_texture(texture_manager_t *tm, texture_handle_t handle)
+{
+    texture_t *t = get_texture(tm, handle);
+    if (!t)
+    {
+        log_debug("Trying to release a stale texture handle %08x", handle);
+        return;
+    }
+    if (--t->ref_count)
+        return;
+
+    glDeleteTextures(1, &t->gl_id);
+    free(t->source);
+    tm->resident_bytes -= t->bytes;
+    --tm->num_textures;
+    uint16 generation = t->generation + 1;
+    memset(t, 0, sizeof(texture_t));
+    t->generation = generation;
+}
+
+/* Destroys every texture regardless of how many references are left */
+void destroy_texture_manager(texture_manager_t *tm)
+{
+    for (uint i = 0; i < tm->_max_textures; ++i)
+        if (tm->textures[i].gl_id)
+        {
+            glDeleteTextures(1, &tm->textures[i].gl_id);
+            free(tm->textures[i].source);
+        }
+    free(tm->textures);
+    memset(tm, 0, sizeof(texture_manager_t));
+}
+
+/* Binds a texture to a texture unit. Invalid handles unbind the unit */
+void bind_texture(texture_manager_t *tm, texture_handle_t handle, uint unit)
+{
+    texture_t *t = get_texture(tm, handle);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, t ? t->gl_id : 0);
+}
+
+/* Points the sampler uniforms of a freshly linked program to their texture units */
+void bind_sampler_units(unsigned int program)
+{
+    gl_use_program(program);
+    for (uint i = 0; i < MAX_MATERIAL_TEXTURES; ++i)
+    {
+        int loc = openGL.glGetUniformLocation(program, material_sampler_names[i]);
+        if (loc != -1)
+            openGL.glUniform1i(loc, i);
+    }
+}
+
+#endif
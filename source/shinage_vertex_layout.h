@@ -0,0 +1,295 @@
+#ifndef SHINAGE_VERTEX_LAYOUT_H
+#define SHINAGE_VERTEX_LAYOUT_H
+
+#include <math.h>
+#include <string.h>
+#include "shinage_ints.h"
+#include "shinage_math.h"
+#include "shinage_debug.h"
+#include "shinage_opengl_signatures.h"
+#include "shinage_shaders.h"
+#include "shinage_scene.h"
+
+/* Interleaved vertex formats. Each vertex of the geometry buffer takes stride bytes holding every
+   stream at its own offset and storage format. Positions not stored as floats are relative to the
+   mesh bounds, mapped to [-1, 1] on every axis, and the draws fold the way back into their matrices,
+   see vertex_dequantize_t. Normals are always octahedral encoded in two components, so the shaders
+   decode them the same way whatever the format, see decodeNormal in the shaders */
+
+typedef enum
+{
+    MESH_STREAM_POSITION,
+    MESH_STREAM_NORMAL,
+    MESH_STREAM_TEXCOORD,
+    MESH_STREAM_COLOUR,
+    NUM_MESH_STREAMS
+} mesh_stream_t;
+
+static const struct { uint attrib, components; } mesh_streams[NUM_MESH_STREAMS] = {
+    [MESH_STREAM_POSITION] = { ATTRIB_POSITION, 3 },
+    [MESH_STREAM_NORMAL]   = { ATTRIB_NORMAL,   2 },
+    [MESH_STREAM_TEXCOORD] = { ATTRIB_TEXCOORD, 2 },
+    [MESH_STREAM_COLOUR]   = { ATTRIB_COLOUR,   3 },
+};
+
+/* Storage of each component of a stream. Normalized formats are read as floats by the shaders */
+typedef enum
+{
+    VERTEX_FLOAT,
+    VERTEX_HALF,
+    VERTEX_SNORM16, // [-1, 1]
+    VERTEX_UNORM16, // [0, 1]
+    VERTEX_UNORM8,  // [0, 1]
+    NUM_VERTEX_FORMATS
+} vertex_format_t;
+
+static const struct { uint gl_type, size; bool normalized, is_signed; } vertex_formats[NUM_VERTEX_FORMATS] = {
+    [VERTEX_FLOAT]   = { GL_FLOAT,          4, false, true },
+    [VERTEX_HALF]    = { GL_HALF_FLOAT,     2, false, true },
+    [VERTEX_SNORM16] = { GL_SHORT,          2, true,  true },
+    [VERTEX_UNORM16] = { GL_UNSIGNED_SHORT, 2, true,  false },
+    [VERTEX_UNORM8]  = { GL_UNSIGNED_BYTE,  1, true,  false },
+};
+
+typedef struct
+{
+    vertex_format_t format[NUM_MESH_STREAMS];
+    uint offset[NUM_MESH_STREAMS];
+    uint stride;
+} vertex_layout_t;
+
+/* Maps the stored positions of a mesh back to model space: position = offset + scale * stored */
+typedef struct
+{
+    vec3f scale;
+    vec3f offset;
+} vertex_dequantize_t;
+
+/* Builds the layout with the given formats, every stream starting 4-byte aligned. Positions and normals
+   need one of the signed formats, unsigned ones are replaced by floats */
+vertex_layout_t make_vertex_layout(vertex_format_t position, vertex_format_t normal, vertex_format_t tex_coord, vertex_format_t colour)
+{
+    vertex_layout_t layout = { .format = { position, normal, tex_coord, colour } };
+    for (uint i = 0; i < NUM_MESH_STREAMS; ++i)
+    {
+        if ((i == MESH_STREAM_POSITION || i == MESH_STREAM_NORMAL) && !vertex_formats[layout.format[i]].is_signed)
+        {
+            log_err("Vertex stream %u cannot be stored unsigned, using floats", i);
+            layout.format[i] = VERTEX_FLOAT;
+        }
+        layout.offset[i] = layout.stride;
+        layout.stride += (vertex_formats[layout.format[i]].size * mesh_streams[i].components + 3) & ~3u;
+    }
+    return layout;
+}
+
+/* Full precision layout, 40 bytes per vertex */
+vertex_layout_t float_vertex_layout()
+{
+    return make_vertex_layout(VERTEX_FLOAT, VERTEX_FLOAT, VERTEX_FLOAT, VERTEX_FLOAT);
+}
+
+/* 20 bytes per vertex. Texture coordinates are half floats so repeating ones keep working, colours
+   outside [0, 1] are clamped */
+vertex_layout_t compact_vertex_layout()
+{
+    return make_vertex_layout(VERTEX_SNORM16, VERTEX_SNORM16, VERTEX_HALF, VERTEX_UNORM8);
+}
+
+/* IEEE half precision, rounding to nearest even */
+uint16 float_to_half(float f)
+{
+    uint32 x;
+    memcpy(&x, &f, sizeof(x));
+    uint16 sign = (x >> 16) & 0x8000;
+    uint32 abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000) // Infinity and NaN
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    if (abs >= 0x477ff000) // Rounds past 65504, the largest half
+        return sign | 0x7c00;
+    if (abs < 0x38800000) // Under 2^-14, only representable as a denormal
+    {
+        float a;
+        memcpy(&a, &abs, sizeof(a));
+        return sign | (uint16)lrintf(a * 16777216.0f);
+    }
+    // Rebias the exponent from 127 to 15 and round away the 13 extra mantissa bits
+    uint32 h = (abs - 0x38000000) >> 13;
+    uint32 rest = abs & 0x1fff;
+    h += rest > 0x1000 || (rest == 0x1000 && (h & 1));
+    return sign | (uint16)h;
+}
+
+float half_to_float(uint16 h)
+{
+    uint32 sign = (uint32)(h & 0x8000) << 16;
+    uint32 exponent = (h >> 10) & 0x1f;
+    uint32 mantissa = h & 0x3ff;
+    uint32 x;
+    if (!exponent)
+    {
+        float f = ldexpf((float)mantissa, -24);
+        return sign ? -f : f;
+    }
+    if (exponent == 31)
+        x = sign | 0x7f800000 | mantissa << 13;
+    else
+        x = sign | (exponent + 112) << 23 | mantissa << 13;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+/* Projects a unit vector onto the octahedron |x| + |y| + |z| = 1 and unfolds its lower half
+   over the corners, leaving two components in [-1, 1] */
+vec2f octahedral_encode(vec3f n)
+{
+    vec2f e = {0};
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (l1 == 0.0f)
+        return e;
+    e.x = n.x / l1;
+    e.y = n.y / l1;
+    if (n.z < 0.0f)
+    {
+        float x = e.x;
+        e.x = (1.0f - fabsf(e.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        e.y = (1.0f - fabsf(x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return e;
+}
+
+vec3f octahedral_decode(vec2f e)
+{
+    vec3f n = { .x = e.x, .y = e.y, .z = 1.0f - fabsf(e.x) - fabsf(e.y) };
+    if (n.z < 0.0f)
+    {
+        n.x = (1.0f - fabsf(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    float length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+    n.x /= length;
+    n.y /= length;
+    n.z /= length;
+    return n;
+}
+
+static float clampf(float x, float lo, float hi)
+{
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
+/* Writes the components of one stream of a vertex in the given format */
+static void write_vertex_components(uint8 *dst, vertex_format_t format, float *values, uint count)
+{
+    for (uint i = 0; i < count; ++i)
+    {
+        switch (format)
+        {
+        case VERTEX_FLOAT:
+            memcpy(dst + sizeof(float) * i, &values[i], sizeof(float));
+            break;
+        case VERTEX_HALF:
+        {
+            uint16 h = float_to_half(values[i]);
+            memcpy(dst + sizeof(uint16) * i, &h, sizeof(uint16));
+        } break;
+        case VERTEX_SNORM16:
+        {
+            int16 s = (int16)lrintf(clampf(values[i], -1.0f, 1.0f) * 32767.0f);
+            memcpy(dst + sizeof(int16) * i, &s, sizeof(int16));
+        } break;
+        case VERTEX_UNORM16:
+        {
+            uint16 u = (uint16)lrintf(clampf(values[i], 0.0f, 1.0f) * 65535.0f);
+            memcpy(dst + sizeof(uint16) * i, &u, sizeof(uint16));
+        } break;
+        case VERTEX_UNORM8:
+            dst[i] = (uint8)lrintf(clampf(values[i], 0.0f, 1.0f) * 255.0f);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* Returns how positions of the mesh are stored in the layout, identity for float positions */
+vertex_dequantize_t mesh_vertex_dequantize(vertex_layout_t *layout, mesh_t *mesh)
+{
+    vertex_dequantize_t dq = { .scale = { .x = 1.0f, .y = 1.0f, .z = 1.0f } };
+    if (layout->format[MESH_STREAM_POSITION] == VERTEX_FLOAT)
+        return dq;
+
+    bounds_t *b = &mesh->bounds;
+    dq.offset.x = (b->min.x + b->max.x) * 0.5f;
+    dq.offset.y = (b->min.y + b->max.y) * 0.5f;
+    dq.offset.z = (b->min.z + b->max.z) * 0.5f;
+    dq.scale.x = (b->max.x - b->min.x) * 0.5f;
+    dq.scale.y = (b->max.y - b->min.y) * 0.5f;
+    dq.scale.z = (b->max.z - b->min.z) * 0.5f;
+    return dq;
+}
+
+/* Interleaves the vertices of a mesh in the layout, layout->stride * mesh->num_vertices bytes.
+   Streams the mesh does not have are zeroed */
+void pack_mesh_vertices(vertex_layout_t *layout, mesh_t *mesh, void *dst)
+{
+    vertex_dequantize_t dq = mesh_vertex_dequantize(layout, mesh);
+    // Flat meshes have a 0 scale on some axis, every position maps to the centre on that one
+    vec3f inverse_scale = {
+        .x = dq.scale.x > 0.0f ? 1.0f / dq.scale.x : 0.0f,
+        .y = dq.scale.y > 0.0f ? 1.0f / dq.scale.y : 0.0f,
+        .z = dq.scale.z > 0.0f ? 1.0f / dq.scale.z : 0.0f
+    };
+
+    memset(dst, 0, (size_t)layout->stride * mesh->num_vertices);
+    for (uint i = 0; i < mesh->num_vertices; ++i)
+    {
+        uint8 *vertex = (uint8 *)dst + (size_t)layout->stride * i;
+        vec3f p = mesh->vertices[i];
+        float position[3] = { (p.x - dq.offset.x) * inverse_scale.x, (p.y - dq.offset.y) * inverse_scale.y,
+                              (p.z - dq.offset.z) * inverse_scale.z };
+        write_vertex_components(vertex + layout->offset[MESH_STREAM_POSITION], layout->format[MESH_STREAM_POSITION], position, 3);
+        if (mesh->normals)
+        {
+            vec2f e = octahedral_encode(mesh->normals[i]);
+            write_vertex_components(vertex + layout->offset[MESH_STREAM_NORMAL], layout->format[MESH_STREAM_NORMAL], e.v, 2);
+        }
+        if (mesh->tex_coords)
+            write_vertex_components(vertex + layout->offset[MESH_STREAM_TEXCOORD], layout->format[MESH_STREAM_TEXCOORD], mesh->tex_coords[i].v, 2);
+        if (mesh->colours)
+            write_vertex_components(vertex + layout->offset[MESH_STREAM_COLOUR], layout->format[MESH_STREAM_COLOUR], mesh->colours[i].v, 3);
+    }
+}
+
+/* Returns m * D, D being the matrix taking stored positions to model space */
+mat4x4f dequantize_matrix(mat4x4f m, vertex_dequantize_t dq)
+{
+    mat4x4f r = m;
+    for (uint row = 0; row < 4; ++row)
+    {
+        vec4f *in = &m.rows[row];
+        vec4f *out = &r.rows[row];
+        out->w = in->x * dq.offset.x + in->y * dq.offset.y + in->z * dq.offset.z + in->w;
+        out->x = in->x * dq.scale.x;
+        out->y = in->y * dq.scale.y;
+        out->z = in->z * dq.scale.z;
+    }
+    return r;
+}
+
+/* Points the mesh attributes of the bound VAO to the interleaved vertices of a buffer */
+void bind_vertex_layout(vertex_layout_t *layout, uint bo)
+{
+    gl_bind_buffer(GL_ARRAY_BUFFER, bo);
+    for (uint i = 0; i < NUM_MESH_STREAMS; ++i)
+    {
+        vertex_format_t format = layout->format[i];
+        openGL.glVertexAttribPointer(mesh_streams[i].attrib, mesh_streams[i].components, vertex_formats[format].gl_type,
+                                     vertex_formats[format].normalized, layout->stride, (void*)(uintptr_t)layout->offset[i]);
+        openGL.glEnableVertexAttribArray(mesh_streams[i].attrib);
+    }
+}
+
+#endif
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shinage_common.h"
+
+/* Offline mesh simplifier, for reducing artist meshes before they ever get loaded. The output is
+   also run through optimize_mesh.
+   Usage: simplify_mesh <input.obj> <output.obj> <triangle ratio> [max error] */
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <input.obj> <output.obj> <triangle ratio> [max error]\n"
+                "  ratio is the fraction of triangles to keep and max error how far the surface\n"
+                "  may move, as a fraction of the radius of the mesh bounds\n", argv[0]);
+        return 1;
+    }
+
+    mesh_t *mesh = load_obj_mesh(argv[1]);
+    if (!mesh)
+        return 1;
+
+    float ratio = strtof(argv[3], NULL);
+    float max_error = argc > 4 ? strtof(argv[4], NULL) : INFINITY;
+    mesh_t *simplified = simplify_mesh(mesh, (uint)(mesh->num_indices / 3 * ratio), max_error);
+    mesh_optimize_stats_t stats = optimize_mesh(simplified);
+    printf("%u triangles, %u vertices -> %u triangles, %u vertices\n", mesh->num_indices / 3,
+           mesh->num_vertices, simplified->num_indices / 3, simplified->num_vertices);
+    printf("ACMR %.3f -> %.3f after optimizing for the vertex cache\n", stats.acmr_before, stats.acmr_after);
+
+    int result = save_obj_mesh(simplified, argv[2]) ? 0 : 1;
+    free_mesh(simplified);
+    free_mesh(mesh);
+    return result;
+}
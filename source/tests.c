@@ -51,7 +51,7 @@ int vec4_eq_debug(vec4f v1, vec4f v2)
     return res;
 }
 
-int vec3_eq(vec3f v1, vec3f v2)
+int vec3_eq_debug(vec3f v1, vec3f v2)
 {
     int res = 1;
     for (int i = 0; i < 3; ++i)
@@ -116,21 +116,21 @@ UTEST(vector_math, rotations)
     /* Expected value of rotating vector 90º around Y axis */
     vec3f v2_t6 = { .x = 0, .y = 1, .z = -1};
 
-    EXPECT_TRUE(vec3_eq(y_axis_rot(v1_t6, 90.0f), v2_t6));
+    EXPECT_TRUE(vec3_eq_debug(y_axis_rot(v1_t6, 90.0f), v2_t6));
 
     vec3f v1_t7 = { .x = 1, .y = 1, .z = 0 };
 
     /* Expected value of rotating vector 90º around X axis */
     vec3f v2_t7 = { .x = 1, .y = 0, .z = 1};
 
-    EXPECT_TRUE(vec3_eq(x_axis_rot(v1_t7, 90.0f), v2_t7));
+    EXPECT_TRUE(vec3_eq_debug(x_axis_rot(v1_t7, 90.0f), v2_t7));
 
     vec3f v1_t8 = { .x = 1, .y = 1, .z = 0 };
 
     /* Expected value of rotating vector 90º around Z axis */
     vec3f v2_t8 = { .x = -1, .y = 1, .z = 0};
 
-    EXPECT_TRUE(vec3_eq(z_axis_rot(v1_t8, 90.0f), v2_t8));
+    EXPECT_TRUE(vec3_eq_debug(z_axis_rot(v1_t8, 90.0f), v2_t8));
 }
 
 UTEST(vector_math, angle)
@@ -171,6 +171,26 @@ UTEST(matrix_math, inverse)
     EXPECT_TRUE(mat4_eq_debug(inverse_mat4x4f(m2_t11), m3_t11));
 }
 
+UTEST(matrix_math, normal_matrix)
+{
+    /* Non-uniform scale, rotation around Z and a translation that should be ignored */
+    mat4x4f m1_t15 = {
+        .a1 = 0, .b1 = -3, .c1 = 0, .d1 = 5,
+        .a2 = 2, .b2 = 0,  .c2 = 0, .d2 = -1,
+        .a3 = 0, .b3 = 0,  .c3 = 4, .d3 = 2,
+        .a4 = 0, .b4 = 0,  .c4 = 0, .d4 = 1
+    };
+    mat4x4f m2_t15 = transpose_mat4x4f(inverse_mat4x4f(m1_t15));
+    mat3x3f m3_t15 = normal_matrix_mat3x3f(m1_t15);
+
+    /* Expected result is the upper 3x3 block of the inverse transpose */
+    int res = 1;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            res &= fabs(m3_t15.rows[i].v[j] - m2_t15.v[4*i + j]) < epsilon;
+    EXPECT_TRUE(res);
+}
+
 UTEST(matrix_math, camera)
 {
      /* Expected view matrix for a camera in (0,0,1) looking at (0,0,0) */
@@ -198,7 +218,568 @@ UTEST(matrix_math, camera)
 
     /* Expected result of asking for the camera position */
     vec3f v1_t13 = camera_pos;
-    EXPECT_TRUE(vec3_eq(get_position(), v1_t13));
+    EXPECT_TRUE(vec3_eq_debug(get_position(), v1_t13));
+}
+
+UTEST(scene, transform_propagation)
+{
+    scene_t scene = {0};
+    model_t *parent = add_model(&scene, -1);
+    vec3f parent_translation = { .x = 1, .y = 0, .z = 0 };
+    parent->model_mat = get_translated_matrix_mat4x4f(parent->model_mat, parent_translation);
+    model_t *child = add_model(&scene, 0);
+    vec3f child_translation = { .x = 0, .y = 2, .z = 0 };
+    child->model_mat = get_translated_matrix_mat4x4f(child->model_mat, child_translation);
+
+    /* Expected final matrix of the child: both translations combined */
+    mat4x4f m1_t14 = identity_matrix_4x4;
+    m1_t14.d1 = 1; m1_t14.d2 = 2;
+
+    /* The first update computes everything */
+    update_scene_transforms(&scene);
+    EXPECT_EQ(scene.transforms_updated, 2u);
+    EXPECT_TRUE(mat4_eq_debug(scene.models[1].preprocessed_model_mat, m1_t14));
+
+    /* Nothing changed, so nothing should be recomputed */
+    update_scene_transforms(&scene);
+    EXPECT_EQ(scene.transforms_updated, 0u);
+
+    /* Moving the parent has to move the child along */
+    translate_model(&scene.models[0], 0, 0, 3);
+    m1_t14.d3 = 3;
+    update_scene_transforms(&scene);
+    EXPECT_EQ(scene.transforms_updated, 2u);
+    EXPECT_TRUE(mat4_eq_debug(scene.models[1].preprocessed_model_mat, m1_t14));
+}
+
+UTEST(scene, lod_selection)
+{
+    scene_t scene = {0};
+    model_t *model = add_model(&scene, -1);
+    model->meshes = sphere_mesh(1.0f, 32, 32);
+    model->num_meshes = 1;
+    add_sphere_lods(model, 1.0f, 32, 32, 0.25f);
+    EXPECT_EQ(model->num_lods, 4u);
+    EXPECT_LT(model->lods[3].meshes[0].num_indices, 3u * 64);
+
+    /* 90 degree fov, so a unit sphere d units away covers 1 / d of the viewport height. Switching
+       to the second level happens below 0.25 * 0.85 and back above 0.25 * 1.15 */
+    set_scene_view_projection(&scene, get_perspective_camera_mat4x4f(M_PI / 2, 1.0f, 0.1f, 1000.0f));
+    float distances[] = { 2.0f, 5.0f, 3.6f, 3.3f, 20.0f, 4.0f, 100.0f };
+    uint expected[] =   { 0,    1,    1,    0,    3,     1,    3 };
+    for (uint i = 0; i < sizeof(distances) / sizeof(distances[0]); ++i)
+    {
+        scene.models[0].model_mat = identity_matrix_4x4;
+        translate_model(&scene.models[0], 0, 0, -distances[i]);
+        update_scene_transforms(&scene);
+        select_scene_lods(&scene);
+        EXPECT_EQ(scene.models[0].lod, expected[i]);
+        EXPECT_EQ(scene.models[0].meshes, scene.models[0].lods[expected[i]].meshes);
+        /* The new level has to be in place right away */
+        EXPECT_EQ(scene.models[0].meshes[0].preprocessed_model_mat.d3, -distances[i]);
+    }
+}
+
+UTEST(scene, static_batching)
+{
+    scene_t scene = {0};
+    uint program = 1, other_program = 2;
+    /* Three cubes in the first cell, one of them mirrored, one in the third and one with another program */
+    float xs[] = { 0.0f, 1.0f, 2.0f, 20.0f, 3.0f };
+    for (uint i = 0; i < 5; ++i)
+    {
+        model_t *model = add_model(&scene, -1);
+        model->meshes = cube_mesh(NULL);
+        model->num_meshes = 1;
+        model->meshes[0].program = i == 4 ? &other_program : &program;
+        model->meshes[0].static_geometry = true;
+        translate_model(model, xs[i], 0, -30);
+        if (i == 2)
+            scale_model(model, -1, 1, 1);
+    }
+
+    model_t *batches = build_static_batches(&scene, 10.0f);
+    ASSERT_TRUE(batches);
+    EXPECT_EQ(batches->num_meshes, 3u);
+    EXPECT_FALSE(build_static_batches(&scene, 10.0f));
+
+    uint num_vertices = 0;
+    bool outward = true;
+    for (uint b = 0; b < batches->num_meshes; ++b)
+    {
+        mesh_t *batch = &batches->meshes[b];
+        num_vertices += batch->num_vertices;
+        EXPECT_LT(batch->bounds.max.x - batch->bounds.min.x, 10.0f);
+        /* Every triangle still faces away from the centre of its cube */
+        for (uint i = 0; i < batch->num_indices; i += 3)
+        {
+            vec3f p0 = batch->vertices[batch->indices[i]];
+            vec3f p1 = batch->vertices[batch->indices[i + 1]];
+            vec3f p2 = batch->vertices[batch->indices[i + 2]];
+            vec3f normal = cross_product3f(diff3f(p1, p0), diff3f(p2, p0));
+            // Cubes are one unit wide and whole units apart, the closest centre is the right one
+            vec3f centre = { .x = roundf((p0.x + p1.x + p2.x) / 3.0f), .y = 0, .z = scene.models[0].preprocessed_model_mat.d3 };
+            if (fabsf(centre.x - (p0.x + p1.x + p2.x) / 3.0f) > 0.45f)
+                continue;
+            outward &= dot_product3f(normal, diff3f(p0, centre)) > 0.0f;
+        }
+    }
+    EXPECT_EQ(num_vertices, 5u * 8);
+    EXPECT_TRUE(outward);
+
+    /* Only the batches are drawn from now on */
+    update_scene_transforms(&scene);
+    set_scene_view_projection(&scene, get_perspective_camera_mat4x4f(M_PI / 2, 1.0f, 0.1f, 1000.0f));
+    cull_scene(&scene);
+    for (uint i = 0; i < 5; ++i)
+        EXPECT_FALSE(scene.models[i].meshes[0].visible);
+    for (uint b = 0; b < 3; ++b)
+        EXPECT_TRUE(scene.models[5].meshes[b].visible);
+    EXPECT_EQ(scene.meshes_culled, 0u);
+}
+
+UTEST(scene, mesh_simplification)
+{
+    mesh_t *sphere = sphere_mesh(1.0f, 32, 32);
+    mesh_t *simplified = simplify_mesh(sphere, 200, INFINITY);
+    uint triangles = simplified->num_indices / 3;
+    EXPECT_LE(triangles, 200u);
+    EXPECT_GT(triangles, 150u);
+
+    /* Vertices are kept as they were, attributes and all */
+    uint moved = 0;
+    for (uint i = 0; i < simplified->num_vertices; ++i)
+    {
+        vec3f v = simplified->vertices[i], n = simplified->normals[i];
+        moved += fabsf(length3f(v) - 1.0f) > 1e-5f || length3f(diff3f(v, n)) > 1e-5f;
+    }
+    EXPECT_EQ(moved, 0u);
+
+    /* Seams have to stay closed: every edge has to be there the other way round, going by position */
+    uint open_edges = 0;
+    for (uint i = 0; i < simplified->num_indices; ++i)
+    {
+        vec3f a = simplified->vertices[simplified->indices[i]];
+        vec3f b = simplified->vertices[simplified->indices[i - i % 3 + (i + 1) % 3]];
+        bool found = false;
+        for (uint j = 0; j < simplified->num_indices && !found; ++j)
+        {
+            vec3f c = simplified->vertices[simplified->indices[j]];
+            vec3f d = simplified->vertices[simplified->indices[j - j % 3 + (j + 1) % 3]];
+            found = length3f(diff3f(c, b)) < 1e-5f && length3f(diff3f(d, a)) < 1e-5f;
+        }
+        open_edges += !found;
+    }
+    EXPECT_EQ(open_edges, 0u);
+
+    /* A tight error bound stops well before the triangle count */
+    mesh_t *bounded = simplify_mesh(sphere, 10, 0.01f);
+    EXPECT_GT(bounded->num_indices / 3, 200u);
+    EXPECT_LT(bounded->num_indices, sphere->num_indices);
+
+    /* The bound is a distance, so it stops at about the same shape however finely the mesh started */
+    mesh_t *fine_sphere = sphere_mesh(1.0f, 96, 96);
+    mesh_t *fine = simplify_mesh(fine_sphere, 10, 0.01f);
+    EXPECT_LT(fine->num_indices, bounded->num_indices * 2);
+    EXPECT_GT(fine->num_indices * 2, bounded->num_indices);
+    float deepest = 0.0f;
+    for (uint i = 0; i < fine->num_indices; i += 3)
+    {
+        vec3f centroid = sum3f(fine->vertices[fine->indices[i]], sum3f(fine->vertices[fine->indices[i + 1]], fine->vertices[fine->indices[i + 2]]));
+        deepest = fmaxf(deepest, 1.0f - length3f(centroid) / 3.0f);
+    }
+    EXPECT_LT(deepest, 0.03f);
+
+    /* Level of detail chains halve the triangles each level */
+    scene_t scene = {0};
+    model_t *model = add_model(&scene, -1);
+    model->meshes = sphere;
+    model->num_meshes = 1;
+    add_simplified_lods(model, 0.25f);
+    EXPECT_EQ(model->num_lods, (uint)MAX_LODS);
+    EXPECT_LE(model->lods[MAX_LODS - 1].meshes[0].num_indices, sphere->num_indices / 8);
+}
+
+static int compare_triangle_bytes(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(float) * 15);
+}
+
+/* Triangles of a mesh as positions and texture coordinates, each starting from its smallest
+   vertex and all of them sorted, so meshes can be compared regardless of vertex and triangle order */
+static float *canonical_triangles(mesh_t *mesh)
+{
+    uint num_triangles = mesh->num_indices / 3;
+    float *triangles = malloc(sizeof(float) * 15 * num_triangles);
+    for (uint t = 0; t < num_triangles; ++t)
+    {
+        float corners[3][5];
+        uint first = 0;
+        for (uint k = 0; k < 3; ++k)
+        {
+            uint32 v = mesh->indices[3 * t + k];
+            float corner[5] = { mesh->vertices[v].x, mesh->vertices[v].y, mesh->vertices[v].z,
+                                mesh->tex_coords[v].x, mesh->tex_coords[v].y };
+            memcpy(corners[k], corner, sizeof(corner));
+            if (memcmp(corners[k], corners[first], sizeof(corner)) < 0)
+                first = k;
+        }
+        for (uint k = 0; k < 3; ++k)
+            memcpy(triangles + 15 * t + 5 * k, corners[(first + k) % 3], sizeof(float) * 5);
+    }
+    qsort(triangles, num_triangles, sizeof(float) * 15, compare_triangle_bytes);
+    return triangles;
+}
+
+UTEST(scene, mesh_optimization)
+{
+    mesh_t *sphere = sphere_mesh(1.0f, 32, 32);
+    float *before = canonical_triangles(sphere);
+    uint num_indices = sphere->num_indices;
+
+    mesh_optimize_stats_t stats = optimize_mesh(sphere);
+    EXPECT_EQ(stats.vertices_welded, 0u);
+    EXPECT_LT(stats.acmr_after, stats.acmr_before * 0.75f);
+    EXPECT_EQ(stats.acmr_after, mesh_acmr(sphere->indices, sphere->num_indices, sphere->num_vertices, VERTEX_CACHE_SIZE));
+
+    /* Same triangles, same winding */
+    EXPECT_EQ(sphere->num_indices, num_indices);
+    float *after = canonical_triangles(sphere);
+    EXPECT_EQ(memcmp(before, after, sizeof(float) * 5 * num_indices), 0);
+
+    /* Vertices come in the order they are first used */
+    uint32 next = 0;
+    bool in_order = true;
+    for (uint i = 0; i < sphere->num_indices; ++i)
+    {
+        in_order &= sphere->indices[i] <= next;
+        next += sphere->indices[i] == next;
+    }
+    EXPECT_TRUE(in_order);
+    EXPECT_EQ(next, sphere->num_vertices);
+
+    /* Exact copies get welded */
+    const float vertices[] = { 0,0,0, 1,0,0, 0,1,0, 0,1,0, 1,0,0, 1,1,0 };
+    const uint32 indices[] = { 0,1,2, 3,4,5 };
+    mesh_t *quad = mesh_from_arrays(vertices, NULL, 6, indices, 6);
+    EXPECT_EQ(optimize_mesh(quad).vertices_welded, 2u);
+    EXPECT_EQ(quad->num_vertices, 4u);
+    free(before);
+    free(after);
+}
+
+UTEST(text, utf8_decoding)
+{
+    /* 'a', U+00E9, U+3042, U+1F600 and a stray continuation byte */
+    char text[] = "a\xC3\xA9\xE3\x81\x82\xF0\x9F\x98\x80\x80";
+    uint32 expected[] = { 0x61, 0xE9, 0x3042, 0x1F600, 0xFFFD };
+    char *p = text;
+    for (uint i = 0; i < sizeof(expected)/sizeof(expected[0]); ++i)
+        EXPECT_EQ(next_utf8_codepoint(&p), expected[i]);
+    EXPECT_EQ(*p, '\0');
+
+    /* Overlong encoding of '/' */
+    char overlong[] = "\xC0\xAF";
+    p = overlong;
+    EXPECT_EQ(next_utf8_codepoint(&p), (uint32)0xFFFD);
+    EXPECT_EQ(p, overlong + 1);
+}
+
+UTEST(render_queue, radix_sort)
+{
+    /* Keys spread over every byte, with plenty of duplicates to check the sort is stable */
+    enum { count = 1000 };
+    render_sort_entry_t entries[count], scratch[count];
+    uint64 seed = 12345;
+    for (uint i = 0; i < count; ++i)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        entries[i].key = (seed >> 4) & 0xF0F0F0F0F0F0F0F0ull;
+        entries[i].offset = i;
+    }
+    radix_sort_entries(entries, scratch, count);
+
+    int res = 1;
+    for (uint i = 1; i < count; ++i)
+    {
+        if (entries[i - 1].key > entries[i].key)
+            res = 0;
+        if (entries[i - 1].key == entries[i].key && entries[i - 1].offset > entries[i].offset)
+            res = 0;
+    }
+    EXPECT_TRUE(res);
+}
+
+UTEST(render_queue, uniform_order)
+{
+    /* Two scenes sharing a program with their own light: each draw has to run after its scene's uniform */
+    static render_queue_t queue;
+    mesh_t meshes[3] = {0};
+    vec3f first = { .x = 1 }, second = { .x = 2 };
+    record_draw_mesh(&queue, RENDER_PASS_OPAQUE, 7, &meshes[0], NULL, identity_matrix_4x4, identity_matrix_4x4, identity_matrix_3x3);
+    record_uniform_3f(&queue, RENDER_PASS_OPAQUE, 7, "lightColor", first);
+    record_draw_mesh(&queue, RENDER_PASS_OPAQUE, 3, &meshes[2], NULL, identity_matrix_4x4, identity_matrix_4x4, identity_matrix_3x3);
+    record_draw_mesh(&queue, RENDER_PASS_OPAQUE, 7, &meshes[1], NULL, identity_matrix_4x4, identity_matrix_4x4, identity_matrix_3x3);
+    record_uniform_3f(&queue, RENDER_PASS_OPAQUE, 7, "lightColor", second);
+    record_draw_mesh(&queue, RENDER_PASS_OPAQUE, 7, &meshes[0], NULL, identity_matrix_4x4, identity_matrix_4x4, identity_matrix_3x3);
+    sort_render_commands(&queue);
+
+    // Value of lightColor each draw of program 7 runs with, in execution order
+    float expected[] = { 0, 1, 2 };
+    float value = 0;
+    uint draws = 0;
+    for (uint i = 0; i < queue.num_commands; ++i)
+    {
+        render_command_t *cmd = (render_command_t *)(queue.buffer + queue.entries[i].offset);
+        if (cmd->type == RENDER_CMD_UNIFORM_3F)
+            value = ((render_uniform_3f_t *)(cmd + 1))->value.x;
+        else if (((render_draw_mesh_t *)(cmd + 1))->program == 7)
+        {
+            EXPECT_EQ(value, expected[draws]);
+            ++draws;
+        }
+    }
+    EXPECT_EQ(draws, 3u);
+    // Draws sharing a uniform group still go together
+    EXPECT_EQ(queue.stats.program_changes, 2u);
+    free(queue.buffer);
+    free(queue.entries);
+    free(queue.sort_scratch);
+}
+
+UTEST(mesh_cache, range_allocator)
+{
+    range_allocator_t a = {0};
+    grow_range_allocator(&a, 100);
+
+    uint r0 = alloc_range(&a, 30);
+    uint r1 = alloc_range(&a, 30);
+    uint r2 = alloc_range(&a, 30);
+    EXPECT_EQ(r0, 0u);
+    EXPECT_EQ(r1, 30u);
+    EXPECT_EQ(r2, 60u);
+    EXPECT_EQ(alloc_range(&a, 20), INVALID_RANGE);
+
+    /* The smallest hole that fits is reused, and freed neighbours merge back together */
+    free_range(&a, r1, 30);
+    EXPECT_EQ(alloc_range(&a, 10), 90u);
+    EXPECT_EQ(alloc_range(&a, 20), 30u);
+    free_range(&a, 30, 20);
+    free_range(&a, r0, 30);
+    free_range(&a, r2, 30);
+    EXPECT_EQ(a.num_free, 1u);
+    EXPECT_EQ(alloc_range(&a, 100), INVALID_RANGE);
+    free_range(&a, 90, 10);
+    EXPECT_EQ(a.num_free, 1u);
+    EXPECT_EQ(alloc_range(&a, 100), 0u);
+
+    /* Growing appends to the free range at the end */
+    free_range(&a, 50, 50);
+    grow_range_allocator(&a, 200);
+    EXPECT_EQ(a.num_free, 1u);
+    EXPECT_EQ(alloc_range(&a, 150), 50u);
+
+    destroy_range_allocator(&a);
+}
+
+UTEST(mesh_cache, vertex_layout)
+{
+    vertex_layout_t compact = compact_vertex_layout();
+    EXPECT_EQ(compact.stride, 20u);
+    EXPECT_EQ(compact.offset[MESH_STREAM_NORMAL], 8u);
+    EXPECT_EQ(float_vertex_layout().stride, 40u);
+
+    EXPECT_EQ(float_to_half(1.0f), 0x3c00);
+    EXPECT_EQ(float_to_half(-2.0f), 0xc000);
+    EXPECT_EQ(float_to_half(65504.0f), 0x7bff);
+    EXPECT_EQ(float_to_half(65520.0f), 0x7c00);
+    EXPECT_EQ(float_to_half(ldexpf(1.0f, -24)), 0x0001);
+    // Halfway between two halves goes to the even one
+    EXPECT_EQ(float_to_half(1.0f + ldexpf(1.0f, -11)), 0x3c00);
+    EXPECT_EQ(float_to_half(1.0f + 3.0f * ldexpf(1.0f, -11)), 0x3c02);
+    EXPECT_EQ(half_to_float(float_to_half(0.1f)), 0.0999755859375f);
+
+    /* Positions, normals and texture coordinates survive the compact layout */
+    mesh_t *sphere = sphere_mesh(2.0f, 16, 16);
+    uint8 *packed = malloc(compact.stride * sphere->num_vertices);
+    pack_mesh_vertices(&compact, sphere, packed);
+    vertex_dequantize_t dq = mesh_vertex_dequantize(&compact, sphere);
+    float max_position_error = 0.0f, max_normal_error = 0.0f, max_uv_error = 0.0f;
+    for (uint i = 0; i < sphere->num_vertices; ++i)
+    {
+        uint8 *vertex = packed + compact.stride * i;
+        int16 p[3], n[2];
+        uint16 uv[2];
+        memcpy(p, vertex + compact.offset[MESH_STREAM_POSITION], sizeof(p));
+        memcpy(n, vertex + compact.offset[MESH_STREAM_NORMAL], sizeof(n));
+        memcpy(uv, vertex + compact.offset[MESH_STREAM_TEXCOORD], sizeof(uv));
+
+        vec3f position = {
+            .x = dq.offset.x + dq.scale.x * p[0] / 32767.0f,
+            .y = dq.offset.y + dq.scale.y * p[1] / 32767.0f,
+            .z = dq.offset.z + dq.scale.z * p[2] / 32767.0f
+        };
+        max_position_error = fmaxf(max_position_error, length3f(diff3f(position, sphere->vertices[i])));
+        vec2f e = { .x = n[0] / 32767.0f, .y = n[1] / 32767.0f };
+        max_normal_error = fmaxf(max_normal_error, length3f(diff3f(octahedral_decode(e), sphere->normals[i])));
+        max_uv_error = fmaxf(max_uv_error, fabsf(half_to_float(uv[0]) - sphere->tex_coords[i].x));
+        max_uv_error = fmaxf(max_uv_error, fabsf(half_to_float(uv[1]) - sphere->tex_coords[i].y));
+    }
+    EXPECT_LT(max_position_error, 1e-4f);
+    EXPECT_LT(max_normal_error, 1e-4f);
+    EXPECT_LT(max_uv_error, 5e-4f);
+
+    /* Repeating texture coordinates are not clamped to [0, 1] */
+    sphere->tex_coords[0] = (vec2f){ .x = 3.5f, .y = -2.0f };
+    pack_mesh_vertices(&compact, sphere, packed);
+    uint16 wrapped[2];
+    memcpy(wrapped, packed + compact.offset[MESH_STREAM_TEXCOORD], sizeof(wrapped));
+    EXPECT_EQ(half_to_float(wrapped[0]), 3.5f);
+    EXPECT_EQ(half_to_float(wrapped[1]), -2.0f);
+
+    /* Folding the dequantization into a matrix gives the same points as transforming the model space ones */
+    mat4x4f model = identity_matrix_4x4;
+    model.a1 = 2.0f;
+    model.d1 = 1.0f;
+    model.d2 = 2.0f;
+    model.d3 = 3.0f;
+    mat4x4f folded = dequantize_matrix(model, dq);
+    vec4f stored = { .x = 0.5f, .y = -0.25f, .z = 1.0f, .w = 1.0f };
+    vec4f model_space = { .x = dq.offset.x + dq.scale.x * stored.x, .y = dq.offset.y + dq.scale.y * stored.y,
+                          .z = dq.offset.z + dq.scale.z * stored.z, .w = 1.0f };
+    EXPECT_TRUE(vec4_eq_debug(mat4x4f_vec4f_prod(folded, stored), mat4x4f_vec4f_prod(model, model_space)));
+
+    free(packed);
+}
+
+UTEST(culling, frustum_planes)
+{
+    /* 90 degree square frustum looking down -z from the origin, between 1 and 10 units away */
+    frustum_t f = frustum_from_matrix(get_perspective_camera_mat4x4f(M_PI / 2, 1.0f, 1.0f, 10.0f));
+
+    vec3f ahead  = { .x = 0, .y = 0, .z = -5 };
+    vec3f behind = { .x = 0, .y = 0, .z = 5 };
+    vec3f beyond = { .x = 0, .y = 0, .z = -12 };
+    vec3f left   = { .x = -7, .y = 0, .z = -5 };
+    EXPECT_TRUE(sphere_in_frustum(&f, ahead, 0.5f));
+    EXPECT_FALSE(sphere_in_frustum(&f, behind, 0.5f));
+    EXPECT_FALSE(sphere_in_frustum(&f, beyond, 1.0f));
+    EXPECT_TRUE(sphere_in_frustum(&f, beyond, 3.0f));
+    EXPECT_FALSE(sphere_in_frustum(&f, left, 1.0f));
+    // The left plane goes through the origin at 45 degrees, sqrt(2) units away from (-7, 0, -5)
+    EXPECT_TRUE(sphere_in_frustum(&f, left, 1.5f));
+    vec4f p = f.planes[FRUSTUM_LEFT];
+    EXPECT_TRUE(fabsf(p.x * left.x + p.y * left.y + p.z * left.z + p.w + sqrtf(2.0f)) < 1e-5f);
+}
+
+UTEST(culling, simd_kernel)
+{
+    frustum_t f = frustum_from_matrix(get_perspective_camera_mat4x4f(M_PI / 3, 1.5f, 0.5f, 50.0f));
+
+    /* Odd count so the last batch of the kernel runs into the padding */
+    cull_spheres_t spheres = {0};
+    srand(1234);
+    for (uint i = 0; i < 1001; ++i)
+    {
+        vec4f sphere = {
+            .x = (rand() / (float)RAND_MAX) * 80.0f - 40.0f,
+            .y = (rand() / (float)RAND_MAX) * 80.0f - 40.0f,
+            .z = (rand() / (float)RAND_MAX) * 80.0f - 60.0f,
+            .w = (rand() / (float)RAND_MAX) * 4.0f
+        };
+        push_cull_sphere(&spheres, sphere);
+    }
+    frustum_cull_spheres(&f, &spheres);
+
+    uint mismatches = 0, visible = 0;
+    for (uint i = 0; i < spheres.count; ++i)
+    {
+        vec3f centre = { .x = spheres.x[i], .y = spheres.y[i], .z = spheres.z[i] };
+        mismatches += spheres.visible[i] != sphere_in_frustum(&f, centre, spheres.r[i]);
+        visible += spheres.visible[i];
+    }
+    EXPECT_EQ(mismatches, 0u);
+    EXPECT_GT(visible, 0u);
+    EXPECT_LT(visible, spheres.count);
+    destroy_cull_spheres(&spheres);
+}
+
+UTEST(culling, software_occlusion)
+{
+    /* A wide wall 5 units down -z with a small cube right behind it */
+    scene_t scene = {0};
+    model_t *wall = add_model(&scene, -1);
+    wall->meshes = cube_mesh(NULL);
+    wall->num_meshes = 1;
+    wall->meshes[0].occluder = true;
+    translate_mesh(&wall->meshes[0], 0, 0, -5);
+    scale_mesh(&wall->meshes[0], 6, 6, 0.2f);
+    model_t *hidden = add_model(&scene, -1);
+    hidden->meshes = cube_mesh(NULL);
+    hidden->num_meshes = 1;
+    translate_mesh(&hidden->meshes[0], 0.5f, 0, -8);
+
+    set_scene_view_projection(&scene, get_perspective_camera_mat4x4f(M_PI / 2, 2.0f, 0.1f, 100.0f));
+    update_scene_transforms(&scene);
+    cull_scene(&scene);
+    EXPECT_TRUE(scene.models[0].meshes[0].visible);
+    EXPECT_FALSE(scene.models[1].meshes[0].visible);
+    EXPECT_EQ(scene.meshes_occluded, 1u);
+
+    /* Poking out past the edge of the wall, even by a bit, makes it visible again */
+    translate_mesh(&scene.models[1].meshes[0], 4.0f, 0, 0);
+    update_scene_transforms(&scene);
+    cull_scene(&scene);
+    EXPECT_TRUE(scene.models[1].meshes[0].visible);
+    EXPECT_EQ(scene.meshes_occluded, 0u);
+
+    /* And so does moving in front of it */
+    translate_mesh(&scene.models[1].meshes[0], -4.0f, 0, 4);
+    update_scene_transforms(&scene);
+    cull_scene(&scene);
+    EXPECT_TRUE(scene.models[1].meshes[0].visible);
+    destroy_occlusion_buffer(&scene.occlusion);
+}
+
+UTEST(culling, light_clusters)
+{
+    /* 90 degree camera at the origin looking down -z on a 320x200 viewport */
+    static light_clusters_t lc;
+    mat4x4f projection = get_perspective_camera_mat4x4f(M_PI / 2, 1.6f, 0.1f, 100.0f);
+    light_source_t lights[4] = {0};
+    for (uint i = 0; i < 4; ++i)
+    {
+        lights[i].enabled = true;
+        lights[i].diffuse = (vec4f){ .x = 1, .y = 1, .z = 1, .w = 1 };
+        lights[i].position_world = (vec4f){ .x = 0, .y = 0, .z = -5, .w = 1 };
+        lights[i].attenuation = (vec3f){ .x = 1, .y = 0, .z = 1000 }; // Reaches about half a unit
+    }
+    lights[1].position_world.z = 5; // Behind the camera
+    lights[2].enabled = false;
+    lights[3].attenuation = (vec3f){0}; // No attenuation, reaches everywhere
+
+    assign_light_clusters(&lc, lights, 4, identity_matrix_4x4, projection, 320, 200);
+    EXPECT_EQ(lc.num_lights, 2u);
+    EXPECT_EQ(lc.max_cluster_lights, 2u);
+
+    /* Light 0 sits in the centre cluster five units away and not in any corner */
+    uint32 *centre = lc.clusters[light_cluster_index(lc.params, 160, 100, 5)];
+    EXPECT_EQ(centre[1], 2u);
+    EXPECT_EQ(lc.indices[centre[0]] + lc.indices[centre[0] + 1], 1u);
+    uint corners[] = { light_cluster_index(lc.params, 0, 0, 5), light_cluster_index(lc.params, 319, 199, 50),
+                       light_cluster_index(lc.params, 160, 100, 0.2f) };
+    for (uint i = 0; i < 3; ++i)
+    {
+        EXPECT_EQ(lc.clusters[corners[i]][1], 1u);
+        EXPECT_EQ(lc.indices[lc.clusters[corners[i]][0]], 1u);
+    }
+    EXPECT_LT(lc.num_indices, NUM_LIGHT_CLUSTERS + 64u);
+
+    /* Orthographic projections put everything in one cluster */
+    assign_light_clusters(&lc, lights, 4, identity_matrix_4x4, identity_matrix_4x4, 320, 200);
+    EXPECT_EQ(lc.clusters[0][1], 3u);
+    EXPECT_EQ(lc.num_indices, 3u);
+    destroy_light_clusters(&lc);
 }
 
 UTEST_MAIN();
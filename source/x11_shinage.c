@@ -170,13 +170,7 @@ int main(int argc, char *argv[])
         log_debug("FreeType started");
     if (!load_face(ft_library, default_font_path, &default_face))
         log_debug("Default font face loaded");
-
-    // Check if we loaded all characters we wanted
-    int loaded_chars = load_charmap(default_face);
-    if (loaded_chars == sizeof(charmap)/sizeof(charmap[0]))
-        log_debug("Successfully loaded charmap");
-    else
-        log_debug("Failed to load complete charmap. %d chars loaded", loaded_chars);
+    // Glyphs are rasterized the first time they are drawn
 
 
     // Set title name for our open window
@@ -211,7 +205,10 @@ int main(int argc, char *argv[])
     game_state.loop_state = RUNNING;
     game_state.window_width = x11_window_width;
     game_state.window_height = x11_window_height;
-    game_state.default_charmap = &charmap[0];
+    game_state.default_face = default_face;
+    game_state.sdf_text_batch.mode = GLYPH_SDF;
+    game_state.render_queue.gpu_culling = true;
+    game_state.render_queue.occlusion_culling = true;
     game_state.vsync = false;
     game_state.curr_frame_input = curr_frame_input;
     game_state.last_frame_input = last_frame_input;
@@ -261,6 +258,7 @@ int main(int argc, char *argv[])
         dt = curr_frame_start_time - last_frame_start_time;
         // Pack dt into the game_state struct to the game layer can see it
         game_state.dt = dt;
+        game_state.elapsed_time += dt;
 
         //log_debug("Delta time %f , we should sleep for %f s", dt, sleep_time);
 
@@ -445,6 +443,12 @@ int main(int argc, char *argv[])
                                     PRESSED,
                                     input_phase_stamp);
                     break;
+                case XK_F3:
+                    set_input_state(&player1_input->f3,
+                                    &player1_last_input->f3,
+                                    PRESSED,
+                                    input_phase_stamp);
+                    break;
                 }
                 break;
 
@@ -540,6 +544,12 @@ int main(int argc, char *argv[])
                                     UNPRESSED,
                                     input_phase_stamp);
                     break;
+                case XK_F3:
+                    set_input_state(&player1_input->f3,
+                                    &player1_last_input->f3,
+                                    UNPRESSED,
+                                    input_phase_stamp);
+                    break;
                 }
                 break;
 
@@ -707,11 +717,12 @@ int main(int argc, char *argv[])
         // NOTE: This is just for testing that OpenGL actually works
         /* TODO: Maybe color clear should be moved to game layer? */
         glClearColor(1.0f, 0.6f, 1.0f, 1.0f);
-        glEnable(GL_DEPTH_TEST);
+        gl_enable(GL_DEPTH_TEST);
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         game_code.game_render(&game_state);
+        execute_render_queue(&game_state.render_queue, &game_state.mesh_cache, &game_state.textures, &game_state.glyph_cache);
 
 
         glXSwapBuffers(x11_display, x11_window);
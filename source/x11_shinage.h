@@ -59,8 +59,17 @@ GLXContext glx_context;
 char *simple_color_vertex_shader_path = "./shaders/simple_color.vert";
 char *simple_color_fragment_shader_path = "./shaders/simple_color.frag";
 
+char *simple_color_instanced_vertex_shader_path = "./shaders/simple_color_instanced.vert";
+
 char *single_light_vertex_shader_path = "./shaders/single_light_simple_shader.vert";
 char *single_light_fragment_shader_path = "./shaders/single_light_simple_shader.frag";
+char *clustered_lighting_fragment_shader_path = "./shaders/clustered_lighting.frag";
+char *gbuffer_fragment_shader_path = "./shaders/gbuffer.frag";
+char *deferred_lighting_vertex_shader_path = "./shaders/deferred_lighting.vert";
+char *deferred_lighting_fragment_shader_path = "./shaders/deferred_lighting.frag";
+char *clustered_lights_library_path = "./shaders/clustered_lights.glsl"; // Light loop of the two above
+char *frustum_cull_compute_shader_path = "./shaders/frustum_cull.comp";
+char *hiz_reduce_compute_shader_path = "./shaders/hiz_reduce.comp";
 
 unsigned int simple_color_program = 0;
 
@@ -167,8 +176,19 @@ int load_game_code(game_code_t *game_code)
 
 void build_programs(game_state_t *state)
 {
-    state->simple_color_program = make_gl_program(simple_color_vertex_shader_path, simple_color_fragment_shader_path);
-    state->single_light_program = make_gl_program(single_light_vertex_shader_path, single_light_fragment_shader_path);
+    state->simple_color_program = make_gl_program(simple_color_vertex_shader_path, simple_color_fragment_shader_path, NULL);
+    state->single_light_program = make_gl_program(single_light_vertex_shader_path, single_light_fragment_shader_path, NULL);
+    state->clustered_light_program = make_gl_program(single_light_vertex_shader_path, clustered_lighting_fragment_shader_path, clustered_lights_library_path);
+    // Deferred shading stands in for the clustered forward program, see render_scene
+    state->render_queue.gbuffer.forward_program = state->clustered_light_program;
+    state->render_queue.gbuffer.geometry_program = make_gl_program(single_light_vertex_shader_path, gbuffer_fragment_shader_path, NULL);
+    state->render_queue.gbuffer.lighting_program = make_gl_program(deferred_lighting_vertex_shader_path, deferred_lighting_fragment_shader_path, clustered_lights_library_path);
+    state->simple_color_instanced_program = make_gl_program(simple_color_instanced_vertex_shader_path, simple_color_fragment_shader_path, NULL);
+    state->font_program = make_gl_program(font_vertex_shader_path, font_fragment_shader_path, NULL);
+    state->font_sdf_program = make_gl_program(font_vertex_shader_path, font_sdf_fragment_shader_path, NULL);
+    // Only available on GL 4.3 contexts, the render queue draws everything without it
+    state->render_queue.cull_program = make_gl_compute_program(frustum_cull_compute_shader_path);
+    state->render_queue.hiz.program = make_gl_compute_program(hiz_reduce_compute_shader_path);
 }
 
 /* Reloads the dynamic part of game code if shinage_game.so was edited.
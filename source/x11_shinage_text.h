@@ -1,5 +1,8 @@
 #ifndef X11_SHINAGE_TEXT_H
 #define X11_SHINAGE_TEXT_H
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "shinage_math.h"
 #include "shinage_opengl_signatures.h"
 #include "shinage_shaders.h"
@@ -8,24 +11,95 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#define GLYPH_PAGE_SIZE 512    // Width and height of each atlas page, in texels
+#define MAX_GLYPH_PAGES 4      // Layers of the atlas texture, which bounds the memory used by glyphs
+#define MAX_GLYPH_SHELVES 64   // Per page
+#define GLYPH_PADDING 1        // Empty texels around each glyph so linear filtering never bleeds into neighbours
+#define GLYPH_SHELF_ROUNDING 8 // Shelf heights are rounded up to this so glyphs of similar sizes can share them
+#define SDF_GLYPH_SIZE 32      // Pixel size SDF glyphs are rasterized at, whatever size they are drawn with
+
+/* FreeType can only render distance fields from 2.11 onwards */
+#define HAS_FT_SDF (FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 11))
+
+typedef enum {
+    GLYPH_BITMAP, // Coverage bitmap rasterized at the exact size it is drawn with
+    GLYPH_SDF     // Signed distance to the outline, 0.5 on the edge, drawn at any size with font_sdf.frag
+} glyph_mode_t;
+
+/* A rasterized glyph, keyed by face, codepoint, pixel size and mode */
 typedef struct {
-    unsigned int tex;      // ID handle of the glyph texture
+    FT_Face face;          // NULL on empty slots
+    uint32 codepoint;
+    uint pixel_size;
+    glyph_mode_t mode;
     vec2f size;            // size of the glyph
     vec2f bearing;         // offset from baseline
     unsigned int advance;  // offset to advance to next glyph
-} character_t;
+    vec2f uv_min, uv_max;  // corners of the glyph inside its atlas page
+    uint page, shelf;
+    uint last_used;        // Value of the cache frame counter when it was last queued
+} glyph_t;
+
+/* Row of a page where glyphs are packed from left to right */
+typedef struct {
+    int y, height;
+    int used_width;
+    uint last_used;        // Most recent last_used of the glyphs on it
+} glyph_shelf_t;
+
+typedef struct {
+    uint num_shelves;
+    int used_height;
+    glyph_shelf_t shelves[MAX_GLYPH_SHELVES];
+} glyph_page_t;
+
+/* Glyph cell waiting to be copied to the atlas texture */
+typedef struct {
+    uint page;
+    int x, y, width, height;
+    uint8 *texels;
+} glyph_upload_t;
+
+/* Glyphs are only rasterized the first time they are drawn. When the pages fill up,
+   the least recently used shelf is emptied to make room */
+typedef struct {
+    uint num_glyphs, _max_glyphs; // Open addressing hash table, _max_glyphs is always a power of 2
+    glyph_t *glyphs;
+    glyph_page_t pages[MAX_GLYPH_PAGES];
+    // Rasterizing happens while recording, the texture is only updated when text is drawn
+    uint num_uploads, _max_uploads;
+    glyph_upload_t *uploads;
+    uint tex;                     // GL_TEXTURE_2D_ARRAY with one layer per page
+    uint frame;                   // Glyphs used during the current frame can not be evicted
+    uint rasterized, evicted;     // Totals, useful to check we are not thrashing
+} glyph_cache_t;
+
+/* Vertex of a glyph quad: position in window pixels, atlas coordinates and page, and colour */
+typedef struct {
+    float x, y;
+    float u, v, page;
+    vec3f colour;
+} text_vertex_t;
+
+/* Text queued during a frame, drawn all at once by flush_text. Every glyph in
+   a batch has the same mode, since each mode needs its own fragment shader */
+typedef struct {
+    glyph_mode_t mode;
+    uint num_vertices, _max_vertices;
+    text_vertex_t *vertices;
+    uint vao;
+    uint vbo;
+} text_batch_t;
 
 char *default_font_path = "fonts/OpenSans-Regular.ttf";
 
 char *font_vertex_shader_path = "./shaders/font.vert";
 char *font_fragment_shader_path = "./shaders/font.frag";
-unsigned int font_program = 0;
+char *font_sdf_fragment_shader_path = "./shaders/font_sdf.frag";
 
 FT_Library ft_library;
 FT_Face default_face;
 
-character_t charmap[128];
-
 /* Loads a Freetype library handle. Returns 0 on success, 1 on error.
    NOTE: For our purposes, this should only be called once. It is possible to
    have multiple instances of Freetype with their own fonts, but we don't need to.
@@ -51,157 +125,447 @@ int load_face(FT_Library lib_handle, char *path, FT_Face *new_face)
     return err;
 }
 
-/* Loads a charmap using a FreeType face. Returns 0 on error, or the number of successfully
-   loaded characters (useless at the moment, might be useful later)
+/* Decodes the UTF-8 sequence at *text and advances past it. Malformed sequences
+   decode to U+FFFD one byte at a time */
+uint32 next_utf8_codepoint(char **text)
+{
+    const uint8 *p = (const uint8 *)*text;
+    uint32 cp;
+    int extra;
+    if (p[0] < 0x80)               { cp = p[0];        extra = 0; }
+    else if ((p[0] & 0xE0) == 0xC0) { cp = p[0] & 0x1F; extra = 1; }
+    else if ((p[0] & 0xF0) == 0xE0) { cp = p[0] & 0x0F; extra = 2; }
+    else if ((p[0] & 0xF8) == 0xF0) { cp = p[0] & 0x07; extra = 3; }
+    else
+    {
+        ++*text;
+        return 0xFFFD;
+    }
+
+    for (int i = 1; i <= extra; ++i)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            ++*text;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    // Overlong encodings and surrogates are not valid UTF-8
+    static const uint32 min_cp[] = { 0, 0x80, 0x800, 0x10000 };
+    if (cp < min_cp[extra] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+    {
+        ++*text;
+        return 0xFFFD;
+    }
+    *text += extra + 1;
+    return cp;
+}
+
+static inline uint glyph_slot(glyph_cache_t *cache, FT_Face face, uint32 codepoint, uint pixel_size, glyph_mode_t mode)
+{
+    uint64 h = ((uint64)(uintptr_t)face >> 4) ^ ((uint64)codepoint << 16) ^ ((uint64)mode << 15) ^ pixel_size;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (uint)(h >> 32) & (cache->_max_glyphs - 1);
+}
 
-   TODO: More than 128 first ASCII characters, UTF-8 support
- */
-int load_charmap(FT_Face face)
+/* Returns the cached glyph, or NULL if it has not been rasterized */
+glyph_t *find_glyph(glyph_cache_t *cache, FT_Face face, uint32 codepoint, uint pixel_size, glyph_mode_t mode)
 {
-    /* Enable blending for text rendering */
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (!cache->_max_glyphs)
+        return NULL;
 
-    // set size to load glyphs as
-    FT_Set_Pixel_Sizes(face, 0, 48);
-    // disable byte alignment restriction
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    int charcount = 0;
-    for (int i = 0; i < 128; ++i)
+    uint i = glyph_slot(cache, face, codepoint, pixel_size, mode);
+    while (cache->glyphs[i].face)
     {
-        if (FT_Load_Char(face, (unsigned char)i, FT_LOAD_RENDER))
+        glyph_t *g = &cache->glyphs[i];
+        if (g->face == face && g->codepoint == codepoint && g->pixel_size == pixel_size && g->mode == mode)
+            return g;
+        i = (i + 1) & (cache->_max_glyphs - 1);
+    }
+    return NULL;
+}
+
+static glyph_t *glyph_cache_insert(glyph_cache_t *cache, glyph_t glyph)
+{
+    uint i = glyph_slot(cache, glyph.face, glyph.codepoint, glyph.pixel_size, glyph.mode);
+    while (cache->glyphs[i].face)
+        i = (i + 1) & (cache->_max_glyphs - 1);
+    cache->glyphs[i] = glyph;
+    ++cache->num_glyphs;
+    return &cache->glyphs[i];
+}
+
+static void glyph_cache_grow(glyph_cache_t *cache)
+{
+    uint old_max = cache->_max_glyphs;
+    glyph_t *old_glyphs = cache->glyphs;
+
+    cache->_max_glyphs = old_max ? old_max * 2 : 256;
+    cache->glyphs = calloc(cache->_max_glyphs, sizeof(glyph_t));
+    cache->num_glyphs = 0;
+
+    for (uint i = 0; i < old_max; ++i)
+        if (old_glyphs[i].face)
+            glyph_cache_insert(cache, old_glyphs[i]);
+    free(old_glyphs);
+}
+
+/* Backward shift deletion, same as release_gpu_mesh */
+static void glyph_cache_remove(glyph_cache_t *cache, uint hole)
+{
+    uint mask = cache->_max_glyphs - 1;
+    uint i = (hole + 1) & mask;
+    while (cache->glyphs[i].face)
+    {
+        glyph_t *g = &cache->glyphs[i];
+        uint home = glyph_slot(cache, g->face, g->codepoint, g->pixel_size, g->mode);
+        if (((i - home) & mask) >= ((i - hole) & mask))
         {
-            log_debug("Failed to load glyph number %d in font %s", i, face->family_name);
-            continue;
+            cache->glyphs[hole] = *g;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+    memset(&cache->glyphs[hole], 0, sizeof(glyph_t));
+    --cache->num_glyphs;
+}
+
+/* Drops every glyph on a shelf so its space can be reused */
+static void evict_glyph_shelf(glyph_cache_t *cache, uint page, uint shelf)
+{
+    uint i = 0;
+    while (i < cache->_max_glyphs)
+    {
+        glyph_t *g = &cache->glyphs[i];
+        // Removing shifts a later entry into this slot, so it has to be checked again
+        if (g->face && g->page == page && g->shelf == shelf)
+        {
+            glyph_cache_remove(cache, i);
+            ++cache->evicted;
         }
         else
         {
-            ++charcount;
-            /* Generate texture */
-            unsigned int face_tex;
-            glGenTextures(1, &face_tex);
-            glBindTexture(GL_TEXTURE_2D, face_tex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RED,
-                         face->glyph->bitmap.width,
-                         face->glyph->bitmap.rows,
-                         0,
-                         GL_RED,
-                         GL_UNSIGNED_BYTE,
-                         face->glyph->bitmap.buffer);
-
-            /* Set texture options */
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-            character_t c = {
-                .tex = face_tex,
-                .size = { .x = face->glyph->bitmap.width, face->glyph->bitmap.rows },
-                .bearing = { .x = face->glyph->bitmap_left, face->glyph->bitmap_top },
-                .advance = (unsigned int)face->glyph->advance.x
-            };
-            charmap[i] = c;
+            ++i;
+        }
+    }
+    cache->pages[page].shelves[shelf].used_width = 0;
+}
+
+/* Finds room for a width x height rectangle, evicting the least recently used shelf
+   that fits if every page is full. Returns false if everything is in use this frame */
+static bool alloc_glyph_rect(glyph_cache_t *cache, int width, int height, uint *page_out, uint *shelf_out)
+{
+    glyph_shelf_t *best = NULL;
+    uint best_page = 0, best_shelf = 0;
+
+    /* Tightest shelf with enough room left */
+    for (uint p = 0; p < MAX_GLYPH_PAGES; ++p)
+    {
+        glyph_page_t *page = &cache->pages[p];
+        for (uint s = 0; s < page->num_shelves; ++s)
+        {
+            glyph_shelf_t *shelf = &page->shelves[s];
+            if (shelf->height < height || shelf->used_width + width > GLYPH_PAGE_SIZE)
+                continue;
+            // Do not waste tall shelves on small glyphs
+            if (shelf->height > 2 * height)
+                continue;
+            if (!best || shelf->height < best->height)
+            {
+                best = shelf;
+                best_page = p;
+                best_shelf = s;
+            }
         }
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
 
-    /* Enable blending for text rendering */
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_BLEND);
-    return charcount;
+    /* Open a new shelf */
+    if (!best)
+    {
+        int shelf_height = (height + GLYPH_SHELF_ROUNDING - 1) / GLYPH_SHELF_ROUNDING * GLYPH_SHELF_ROUNDING;
+        for (uint p = 0; p < MAX_GLYPH_PAGES && !best; ++p)
+        {
+            glyph_page_t *page = &cache->pages[p];
+            if (page->num_shelves == MAX_GLYPH_SHELVES || page->used_height + shelf_height > GLYPH_PAGE_SIZE)
+                continue;
+            best_page = p;
+            best_shelf = page->num_shelves++;
+            best = &page->shelves[best_shelf];
+            best->y = page->used_height;
+            best->height = shelf_height;
+            best->used_width = 0;
+            page->used_height += shelf_height;
+        }
+    }
+
+    /* Evict the least recently used shelf tall enough for us */
+    if (!best)
+    {
+        for (uint p = 0; p < MAX_GLYPH_PAGES; ++p)
+        {
+            glyph_page_t *page = &cache->pages[p];
+            for (uint s = 0; s < page->num_shelves; ++s)
+            {
+                glyph_shelf_t *shelf = &page->shelves[s];
+                if (shelf->height < height || shelf->last_used == cache->frame)
+                    continue;
+                if (!best || shelf->last_used < best->last_used ||
+                    (shelf->last_used == best->last_used && shelf->height < best->height))
+                {
+                    best = shelf;
+                    best_page = p;
+                    best_shelf = s;
+                }
+            }
+        }
+        if (!best)
+            return false;
+        evict_glyph_shelf(cache, best_page, best_shelf);
+    }
+
+    *page_out = best_page;
+    *shelf_out = best_shelf;
+    return true;
 }
 
-void render_text(character_t *charmap, char *text, float x, float y, int window_width, int window_height, float scale, vec3f color)
+/* Rasterizes a glyph with FreeType and copies it to the atlas. Returns NULL on error */
+static glyph_t *rasterize_glyph(glyph_cache_t *cache, FT_Face face, uint32 codepoint, uint pixel_size, glyph_mode_t mode)
 {
-    /* Enable blending for text rendering */
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glDisable(GL_DEPTH_TEST);
+    FT_Set_Pixel_Sizes(face, 0, pixel_size);
+    if (FT_Load_Char(face, codepoint, mode == GLYPH_SDF ? FT_LOAD_DEFAULT : FT_LOAD_RENDER))
+    {
+        log_debug("Failed to load glyph U+%04X in font %s", codepoint, face->family_name);
+        return NULL;
+    }
+    if (mode == GLYPH_SDF)
+    {
+#if HAS_FT_SDF
+        /* Distances come from the outline, and the bitmap grows by the spread on every side */
+        if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF))
+        {
+            log_debug("Failed to render the distance field of glyph U+%04X in font %s", codepoint, face->family_name);
+            return NULL;
+        }
+#else
+        log_err("Error: SDF glyphs need FreeType 2.11 or newer");
+        return NULL;
+#endif
+    }
+
+    FT_Bitmap *bitmap = &face->glyph->bitmap;
+    int cell_width = bitmap->width + 2 * GLYPH_PADDING;
+    int cell_height = bitmap->rows + 2 * GLYPH_PADDING;
+    if (cell_width > GLYPH_PAGE_SIZE || cell_height > GLYPH_PAGE_SIZE)
+    {
+        log_err("Error: glyph U+%04X at %upx does not fit in an atlas page", codepoint, pixel_size);
+        return NULL;
+    }
+
+    glyph_t glyph = {
+        .face = face,
+        .codepoint = codepoint,
+        .pixel_size = pixel_size,
+        .mode = mode,
+        .size = { .x = bitmap->width, .y = bitmap->rows },
+        .bearing = { .x = face->glyph->bitmap_left, .y = face->glyph->bitmap_top },
+        .advance = (unsigned int)face->glyph->advance.x,
+        .last_used = cache->frame
+    };
+
+    /* Blank glyphs such as spaces only need their metrics */
+    if (bitmap->width && bitmap->rows)
+    {
+        if (!alloc_glyph_rect(cache, cell_width, cell_height, &glyph.page, &glyph.shelf))
+        {
+            log_err("Error: glyph atlas is full of glyphs used this frame");
+            return NULL;
+        }
+        glyph_shelf_t *shelf = &cache->pages[glyph.page].shelves[glyph.shelf];
+        int x = shelf->used_width, y = shelf->y;
+        shelf->used_width += cell_width;
+        shelf->last_used = cache->frame;
+
+        /* Queue the glyph along with its padding, which might hold texels of an evicted glyph */
+        uint8 *cell = calloc((size_t)cell_width, cell_height);
+        for (uint row = 0; row < bitmap->rows; ++row)
+            memcpy(cell + (size_t)(row + GLYPH_PADDING) * cell_width + GLYPH_PADDING, bitmap->buffer + row * bitmap->pitch, bitmap->width);
+        if (cache->num_uploads == cache->_max_uploads)
+        {
+            cache->_max_uploads = cache->_max_uploads ? cache->_max_uploads * 2 : 64;
+            cache->uploads = realloc(cache->uploads, sizeof(glyph_upload_t) * cache->_max_uploads);
+        }
+        glyph_upload_t upload = { .page = glyph.page, .x = x, .y = y, .width = cell_width, .height = cell_height, .texels = cell };
+        cache->uploads[cache->num_uploads++] = upload;
 
-    if (!font_program)
-        font_program = make_gl_program(font_vertex_shader_path, font_fragment_shader_path);
-    openGL.glUseProgram(font_program);
+        glyph.uv_min.x = (float)(x + GLYPH_PADDING) / GLYPH_PAGE_SIZE;
+        glyph.uv_min.y = (float)(y + GLYPH_PADDING) / GLYPH_PAGE_SIZE;
+        glyph.uv_max.x = (float)(x + GLYPH_PADDING + bitmap->width) / GLYPH_PAGE_SIZE;
+        glyph.uv_max.y = (float)(y + GLYPH_PADDING + bitmap->rows) / GLYPH_PAGE_SIZE;
+    }
 
-    static int pmatrix_uniform_pos = -1;
-    if (pmatrix_uniform_pos == -1)
-        pmatrix_uniform_pos = openGL.glGetUniformLocation(font_program, "projMatrix");
+    // Keep the load factor under 1/2 so probe sequences stay short
+    if (2 * (cache->num_glyphs + 1) > cache->_max_glyphs)
+        glyph_cache_grow(cache);
+    ++cache->rasterized;
+    return glyph_cache_insert(cache, glyph);
+}
 
-    mat4x4f pmatrix;
-    pmatrix = orthogonal_proj_matrix(0.0f, window_width, 0.0f, window_height);
-    openGL.glUniformMatrix4fv(pmatrix_uniform_pos, 1, GL_TRUE, pmatrix.v);
+/* Returns a glyph ready to draw, rasterizing it on a cache miss. Returns NULL if it can not be drawn */
+glyph_t *get_glyph(glyph_cache_t *cache, FT_Face face, uint32 codepoint, uint pixel_size, glyph_mode_t mode)
+{
+    glyph_t *glyph = find_glyph(cache, face, codepoint, pixel_size, mode);
+    if (!glyph)
+        glyph = rasterize_glyph(cache, face, codepoint, pixel_size, mode);
+    if (glyph)
+    {
+        glyph->last_used = cache->frame;
+        if (glyph->size.x && glyph->size.y)
+            cache->pages[glyph->page].shelves[glyph->shelf].last_used = cache->frame;
+    }
+    return glyph;
+}
 
-    static int color_uniform_pos = -1;
-    if (color_uniform_pos == -1)
-        color_uniform_pos = openGL.glGetUniformLocation(font_program, "textColor");
+/* Copies the glyphs rasterized since the last call to the atlas texture, creating it if needed */
+void upload_pending_glyphs(glyph_cache_t *cache)
+{
+    if (!cache->num_uploads)
+        return;
+
+    if (!cache->tex)
+    {
+        // Start from a blank atlas so there is never garbage around the glyphs
+        uint8 *blank = calloc((size_t)GLYPH_PAGE_SIZE * GLYPH_PAGE_SIZE, MAX_GLYPH_PAGES);
+        glGenTextures(1, &cache->tex);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, cache->tex);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, GLYPH_PAGE_SIZE, GLYPH_PAGE_SIZE, MAX_GLYPH_PAGES, 0, GL_RED, GL_UNSIGNED_BYTE, blank);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        free(blank);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cache->tex);
+    // disable byte alignment restriction
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // In order, since a later glyph may reuse the cell of an evicted one
+    for (uint i = 0; i < cache->num_uploads; ++i)
+    {
+        glyph_upload_t *u = &cache->uploads[i];
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, u->x, u->y, u->page, u->width, u->height, 1, GL_RED, GL_UNSIGNED_BYTE, u->texels);
+        free(u->texels);
+    }
+    cache->num_uploads = 0;
+}
+
+/* Needs to be called once all the text of a frame has been flushed, so its glyphs can be evicted again */
+void end_glyph_cache_frame(glyph_cache_t *cache)
+{
+    ++cache->frame;
+}
+
+/* Frees the atlas and forgets every glyph */
+void destroy_glyph_cache(glyph_cache_t *cache)
+{
+    if (cache->tex)
+        glDeleteTextures(1, &cache->tex);
+    for (uint i = 0; i < cache->num_uploads; ++i)
+        free(cache->uploads[i].texels);
+    free(cache->uploads);
+    free(cache->glyphs);
+    memset(cache, 0, sizeof(glyph_cache_t));
+}
+
+/* Draws every glyph queued since the last flush with a single draw call. Expects the font program
+   of the batch's mode to be in use, and blending to be set up (see the overlay render pass) */
+void flush_text(text_batch_t *batch, glyph_cache_t *cache)
+{
+    upload_pending_glyphs(cache);
+    if (!batch->num_vertices)
+        return;
 
-    openGL.glUniform3f(color_uniform_pos, color.x, color.y, color.z);
     glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, cache->tex);
 
-    static unsigned int vao = 0;
-    if (!vao)
-        openGL.glGenVertexArrays(1, &vao);
+    if (!batch->vao)
+    {
+        openGL.glGenVertexArrays(1, &batch->vao);
+        openGL.glGenBuffers(1, &batch->vbo);
+        gl_bind_vertex_array(batch->vao);
+        gl_bind_buffer(GL_ARRAY_BUFFER, batch->vbo);
+        openGL.glVertexAttribPointer(ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, sizeof(text_vertex_t), (void*)offsetof(text_vertex_t, x));
+        openGL.glEnableVertexAttribArray(ATTRIB_POSITION);
+        openGL.glVertexAttribPointer(ATTRIB_TEXCOORD, 3, GL_FLOAT, GL_FALSE, sizeof(text_vertex_t), (void*)offsetof(text_vertex_t, u));
+        openGL.glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+        openGL.glVertexAttribPointer(ATTRIB_COLOUR, 3, GL_FLOAT, GL_FALSE, sizeof(text_vertex_t), (void*)offsetof(text_vertex_t, colour));
+        openGL.glEnableVertexAttribArray(ATTRIB_COLOUR);
+    }
+    gl_bind_vertex_array(batch->vao);
+
+    /* Orphan and refill the buffer so we never wait on last frame's text */
+    gl_bind_buffer(GL_ARRAY_BUFFER, batch->vbo);
+    openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(text_vertex_t) * batch->num_vertices, batch->vertices, GL_STREAM_DRAW);
+    glDrawArrays(GL_TRIANGLES, 0, batch->num_vertices);
+    batch->num_vertices = 0;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
 
-    static unsigned int vbo = 0;
-    if (!vbo)
-        openGL.glGenBuffers(1, &vbo);
+/* Queues UTF-8 text at window coordinates (x, y), in pixels from the bottom left corner.
+   Missing glyphs are rasterized now, but nothing is drawn until the batch is flushed.
+   SDF batches scale the same glyphs to every pixel size */
+void render_text(text_batch_t *batch, glyph_cache_t *cache, FT_Face face, char *text, float x, float y, uint pixel_size, vec3f color)
+{
+    // Codepoints never take more bytes than the string, so this is enough room for every quad
+    uint needed = batch->num_vertices + 6 * strlen(text);
+    if (needed > batch->_max_vertices)
+    {
+        while (needed > batch->_max_vertices)
+            batch->_max_vertices = batch->_max_vertices ? batch->_max_vertices * 2 : 6 * 256;
+        batch->vertices = realloc(batch->vertices, sizeof(text_vertex_t) * batch->_max_vertices);
+    }
 
-    static bool initialized = false;
-    if (!initialized)
+    float scale = 1.0f;
+    if (batch->mode == GLYPH_SDF)
     {
-        openGL.glBindVertexArray(vao);
-        openGL.glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        openGL.glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 6 * 4, NULL, GL_DYNAMIC_DRAW);
-        openGL.glEnableVertexAttribArray(0);
-        openGL.glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
-        initialized = true;
+        scale = (float)pixel_size / SDF_GLYPH_SIZE;
+        pixel_size = SDF_GLYPH_SIZE;
     }
-    openGL.glBindVertexArray(vao);
 
-    char c;
     char *p = text;
-    while ((c = *p++))
+    while (*p)
     {
         /* Iterate through characters of string */
-        // TODO: Be a decent human being and use a hashtable
-        character_t ch = charmap[(int)c];
-
-        float xpos = x + ch.bearing.x * scale;
-        float ypos = y - (ch.size.y - ch.bearing.y) * scale;
+        glyph_t *glyph = get_glyph(cache, face, next_utf8_codepoint(&p), pixel_size, batch->mode);
+        if (!glyph)
+            continue;
 
-        float w = ch.size.x * scale;
-        float h = ch.size.y * scale;
+        float xpos = x + glyph->bearing.x * scale;
+        float ypos = y - (glyph->size.y - glyph->bearing.y) * scale;
 
-        float vertices[6][4] = {
-            { xpos,     ypos + h,   0.0f, 0.0f },
-            { xpos,     ypos,       0.0f, 1.0f },
-            { xpos + w, ypos,       1.0f, 1.0f },
+        float w = glyph->size.x * scale;
+        float h = glyph->size.y * scale;
 
-            { xpos,     ypos + h,   0.0f, 0.0f },
-            { xpos + w, ypos,       1.0f, 1.0f },
-            { xpos + w, ypos + h,   1.0f, 0.0f }
-        };
+        // now advance cursors for next glyph (note that advance is number of 1/64 pixels)
+        x += (glyph->advance >> 6) * scale; // bitshift by 6 to get value in pixels (2^6 = 64 (divide amount of 1/64th pixels by 64 to get amount of pixels))
+        if (!w || !h)
+            continue;
 
-        /* Render glyph texture over quad */
-        glBindTexture(GL_TEXTURE_2D, ch.tex);
-        /* Update content of VBO memory */
-        openGL.glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        openGL.glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices); // be sure to use glBufferSubData and not glBufferData
+        float u0 = glyph->uv_min.x, v0 = glyph->uv_min.y, u1 = glyph->uv_max.x, v1 = glyph->uv_max.y;
+        float page = glyph->page;
+        text_vertex_t quad[6] = {
+            { xpos,     ypos + h,   u0, v0, page, color },
+            { xpos,     ypos,       u0, v1, page, color },
+            { xpos + w, ypos,       u1, v1, page, color },
 
-        openGL.glBindBuffer(GL_ARRAY_BUFFER, 0);
-        // render quad
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        // now advance cursors for next glyph (note that advance is number of 1/64 pixels)
-        x += (ch.advance >> 6) * scale; // bitshift by 6 to get value in pixels (2^6 = 64 (divide amount of 1/64th pixels by 64 to get amount of pixels))
+            { xpos,     ypos + h,   u0, v0, page, color },
+            { xpos + w, ypos,       u1, v1, page, color },
+            { xpos + w, ypos + h,   u1, v0, page, color }
+        };
+        memcpy(batch->vertices + batch->num_vertices, quad, sizeof(quad));
+        batch->num_vertices += 6;
     }
-    openGL.glBindVertexArray(0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_BLEND);
-    glEnable(GL_DEPTH_TEST);
 }
 
 